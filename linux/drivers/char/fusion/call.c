@@ -25,6 +25,7 @@
 #include <linux/smp_lock.h>
 #endif
 #include <linux/sched.h>
+#include <linux/module.h>
 
 #include <linux/fusion.h>
 
@@ -33,10 +34,23 @@
 #include "list.h"
 #include "hash.h"
 #include "skirmish.h"
+#include "shmpool.h"
 #include "call.h"
 
+/* Call data > 64k should be stored in shared memory, see FCEF_SHMPOOL. */
+#define FUSION_CALL_MAX_LENGTH  0x10000
+
+/*
+ * Executions are looked up by serial in a table of buckets, which grows and shrinks
+ * with the number of outstanding executions. The smallest one is part of the call.
+ */
+#define CALL_SERIAL_BUCKETS     16
+
 typedef struct {
      FusionLink link;
+     FusionLink serial_link;  /* in the serial bucket of the call */
+
+     int klass;               /* size class of the return data, -1 if not pooled */
 
      Fusionee *caller;
 
@@ -44,6 +58,10 @@ typedef struct {
 
      bool executed;
      bool signalled;
+     bool async;              /* result is sent to the caller as FMT_CALL_RESULT */
+     bool shmpool;            /* result is a FusionSHMPoolRef */
+     bool boosted;            /* callee's dispatcher is boosted for the caller */
+     bool cancelled;          /* caller timed out, freed by the callee's return */
 
      FusionWaitQueue wait;
 
@@ -52,7 +70,7 @@ typedef struct {
      int          caller_pid;
 
      unsigned int ret_size;
-     unsigned int ret_length;
+     unsigned int ret_length; /* maximum length of an async result */
 
      /* return data follows */
 } FusionCallExecution;
@@ -66,9 +84,16 @@ typedef struct {
      void *ctx;
 
      FusionLink *executions;
+     FusionLink **serials;              /* executions by serial, power of two buckets */
+     unsigned int num_serials;          /* number of buckets */
+     unsigned int num_executions;       /* number of executions in the table */
+     FusionLink *buckets[CALL_SERIAL_BUCKETS];
 
      int count;          /* number of calls ever made */
 
+     unsigned int allocated;    /* number of executions allocated and ... */
+     unsigned int pooled;       /* ... taken from a pool */
+
      unsigned int serial;
 
      FusionHash *quotas;
@@ -100,6 +125,42 @@ static void remove_execution(FusionCall * call,
 static void free_execution(FusionDev * dev,
                            FusionCallExecution * execution);
 static void free_all_executions(FusionCall * call);
+static void unboost_execution(FusionCall * call,
+                              FusionCallExecution * execution);
+static FusionCallExecution *lookup_execution(FusionCall * call,
+                                             unsigned int serial);
+static void resize_serials(FusionCall * call,
+                           unsigned int num_serials);
+
+/******************************************************************************/
+
+/*
+ * Returns the quota of the caller, if any.
+ *
+ * The last lookup is kept by the caller, as most callers keep executing the
+ * same call. Quotas are only removed along with the call, so the number of
+ * quotas tells whether a cached miss is still valid.
+ */
+static CallQuota *
+lookup_quota( FusionCall *call, Fusionee *fusionee )
+{
+     CallQuota *quota;
+
+     if (!fusionee || !call->quotas->nnodes)
+          return NULL;
+
+     if (fusionee->call_quota.call_id == call->entry.id &&
+         fusionee->call_quota.quotas  == call->quotas->nnodes)
+          return fusionee->call_quota.quota;
+
+     quota = fusion_hash_lookup( call->quotas, (void*)(long) fusionee->id );
+
+     fusionee->call_quota.call_id = call->entry.id;
+     fusionee->call_quota.quotas  = call->quotas->nnodes;
+     fusionee->call_quota.quota   = quota;
+
+     return quota;
+}
 
 /******************************************************************************/
 
@@ -115,6 +176,9 @@ fusion_call_construct(FusionEntry * entry, void *ctx, void *create_ctx)
      call->handler = cc->call_new->handler;
      call->ctx = cc->call_new->ctx;
 
+     call->serials     = call->buckets;
+     call->num_serials = CALL_SERIAL_BUCKETS;
+
      fusion_hash_create( FHT_PTR, FHT_PTR, 5, &call->quotas );
 
      cc->call_new->call_id = entry->id;
@@ -149,6 +213,9 @@ static void fusion_call_destruct(FusionEntry * entry, void *ctx)
 
      free_all_executions(call);
 
+     if (call->serials != call->buckets)
+          fusion_core_free( fusion_core, call->serials );
+
      fusion_hash_iterate( call->quotas, fusion_call_quota_hash_iterator, call );
      fusion_hash_destroy( call->quotas );
 }
@@ -214,8 +281,9 @@ fusion_call_print(FusionEntry * entry, void *ctx, struct seq_file *p)
 
      fusion_hash_iterate( call->quotas, fusion_call_quota_hash_dump_iterator, &quota_dump );
 
-     seq_printf(p, "(%d calls) %s [%s]",
-                call->count, idle ? "idle" : "executing", quota_dump.string);
+     seq_printf(p, "(%d calls, %u%% pooled) %s [%s]",
+                call->count, call->allocated ? call->pooled * 100 / call->allocated : 0,
+                idle ? "idle" : "executing", quota_dump.string);
 
      fusion_list_foreach(e, call->executions) {
           FusionCallExecution *exec = (FusionCallExecution *) e;
@@ -232,8 +300,79 @@ FUSION_ENTRY_CLASS(FusionCall, call, fusion_call_construct,
 
 /******************************************************************************/
 
+/*
+ * Executions are allocated with room for return data of one of these sizes,
+ * larger ones are allocated with fusion_core_malloc().
+ */
+static const unsigned int execution_data_sizes[CACHE_EXECUTIONS_CLASSES] = { 32, 256, 1024, 4096 };
+static const char        *execution_cache_names[CACHE_EXECUTIONS_CLASSES] = { "fusion_execution_32",
+                                                                               "fusion_execution_256",
+                                                                               "fusion_execution_1k",
+                                                                               "fusion_execution_4k" };
+
+static FusionCache execution_caches[CACHE_EXECUTIONS_CLASSES];
+
+/*
+ * Free executions of a CPU. It's only a hint to reuse memory that is still
+ * hot in the cache, all pools are protected by the world lock.
+ */
+struct __Fusion_ExecutionPool {
+     FusionLink    *free[CACHE_EXECUTIONS_CLASSES];
+     unsigned int   num[CACHE_EXECUTIONS_CLASSES];
+
+     unsigned long  hits[CACHE_EXECUTIONS_CLASSES];
+     unsigned long  misses[CACHE_EXECUTIONS_CLASSES];
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 28)
+#define nr_cpu_ids NR_CPUS
+#endif
+
+/* Number of free executions each world keeps per CPU and size class. */
+static int fusion_execution_pool = CACHE_EXECUTIONS_NUM;
+
+module_param( fusion_execution_pool, int, S_IRUGO | S_IWUSR );
+MODULE_PARM_DESC( fusion_execution_pool, "Number of free call executions kept per world, CPU and size class" );
+
+int fusion_call_caches_init(void)
+{
+     int i;
+
+     for (i = 0; i < CACHE_EXECUTIONS_CLASSES; i++) {
+          if (fusion_core_cache_init( fusion_core, &execution_caches[i], execution_cache_names[i],
+                                      sizeof(FusionCallExecution) + execution_data_sizes[i] ))
+               goto error;
+     }
+
+     return 0;
+
+error:
+     while (i--)
+          fusion_core_cache_deinit( fusion_core, &execution_caches[i] );
+
+     return -ENOMEM;
+}
+
+void fusion_call_caches_deinit(void)
+{
+     int i;
+
+     for (i = 0; i < CACHE_EXECUTIONS_CLASSES; i++)
+          fusion_core_cache_deinit( fusion_core, &execution_caches[i] );
+}
+
+/******************************************************************************/
+
 int fusion_call_init(FusionDev * dev)
 {
+     if (!dev->refs) {
+          dev->execution_pools = fusion_core_malloc( fusion_core, nr_cpu_ids * sizeof(ExecutionPool) );
+          if (!dev->execution_pools)
+               return -ENOMEM;
+
+          memset( dev->execution_pools, 0, nr_cpu_ids * sizeof(ExecutionPool) );
+     }
+
      fusion_entries_init(&dev->call, &call_class, dev, dev);
 
      fusion_entries_create_proc_entry(dev, "calls", &dev->call);
@@ -243,9 +382,65 @@ int fusion_call_init(FusionDev * dev)
 
 void fusion_call_deinit(FusionDev * dev)
 {
+     unsigned int cpu;
+     int          i;
+
      fusion_entries_destroy_proc_entry(dev, "calls");
 
      fusion_entries_deinit(&dev->call);
+
+     if (!dev->refs && dev->execution_pools) {
+          for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+               ExecutionPool *pool = &dev->execution_pools[cpu];
+
+               for (i = 0; i < CACHE_EXECUTIONS_CLASSES; i++) {
+                    while (pool->free[i]) {
+                         FusionLink *link = pool->free[i];
+
+                         direct_list_remove( &pool->free[i], link );
+
+                         fusion_core_cache_free( fusion_core, &execution_caches[i], link );
+                    }
+               }
+          }
+
+          fusion_core_free( fusion_core, dev->execution_pools );
+
+          dev->execution_pools = NULL;
+     }
+}
+
+unsigned int fusion_call_pooled_executions(FusionDev * dev)
+{
+     unsigned int cpu;
+     unsigned int num = 0;
+     int          i;
+
+     for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+          for (i = 0; i < CACHE_EXECUTIONS_CLASSES; i++)
+               num += dev->execution_pools[cpu].num[i];
+     }
+
+     return num;
+}
+
+void fusion_call_print_pools(FusionDev * dev, struct seq_file *m)
+{
+     unsigned int cpu;
+     int          i;
+
+     for (i = 0; i < CACHE_EXECUTIONS_CLASSES; i++) {
+          unsigned long hits   = 0;
+          unsigned long misses = 0;
+
+          for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+               hits   += dev->execution_pools[cpu].hits[i];
+               misses += dev->execution_pools[cpu].misses[i];
+          }
+
+          seq_printf(m, "%-24s %10lu hits %10lu misses (%lu%%)\n", execution_cache_names[i],
+                     hits, misses, (hits + misses) ? hits * 100 / (hits + misses) : 0);
+     }
 }
 
 /******************************************************************************/
@@ -287,12 +482,7 @@ restart:
      FUSION_DEBUG( "  -> call %u '%s'\n", call->entry.id, call->entry.name );
 
      if (execute->flags & FCEF_RESUMABLE && execute->serial != 0) {
-          /* Search for execution, starting with oldest. */
-          direct_list_foreach (execution, call->executions) {
-               if (execution->serial == execute->serial)
-                    break;
-          }
-
+          execution = lookup_execution(call, execute->serial);
           if (!execution) {
                printk( KERN_ERR "%s: resumable execution with serial %u not found!\n", __FUNCTION__, execute->serial );
                direct_list_foreach (execution, call->executions) {
@@ -305,30 +495,27 @@ restart:
           CallQuota             *quota    = NULL;
           FusionMessageCallback  callback = FMC_NONE;
 
-          if (call->quotas->nnodes) {
-               // TODO: optimise by keeping last quota lookup which is most likely the one we want
-               quota = fusion_hash_lookup( call->quotas, (void*)(long) fusionee->id );
-               if (quota) {
-                    if (quota->count >= quota->limit) {
+          quota = lookup_quota( call, fusionee );
+          if (quota) {
+               if (quota->count >= quota->limit) {
 #ifdef FUSION_CALL_INTERRUPTIBLE
-                         fusion_core_wq_wait( fusion_core, &quota->wait, 0, true );
+                    fusion_core_wq_wait( fusion_core, &quota->wait, &dev->lock, 0, true );
 
-                         if (signal_pending(current)) {
-                              FUSION_DEBUG( "  -> woke up waiting for quota, SIGNAL PENDING!\n" );
-                              return -EINTR;
-                         }
+                    if (signal_pending(current)) {
+                         FUSION_DEBUG( "  -> woke up waiting for quota, SIGNAL PENDING!\n" );
+                         return -EINTR;
+                    }
 #else
-                         fusion_core_wq_wait( fusion_core, &quota->wait, 0, false );
+                    fusion_core_wq_wait( fusion_core, &quota->wait, &dev->lock, 0, false );
 #endif
 
-                         goto restart;
-                    }
+                    goto restart;
                }
           }
 
           do {
                serial = ++call->serial;
-          } while (!serial);
+          } while (!serial || lookup_execution(call, serial));
 
           /* Add execution to receive the result. */
           if (!(execute->flags & FCEF_ONEWAY)) {
@@ -387,6 +574,7 @@ restart:
                fusion_skirmish_transfer_all(dev, call->fusionee->id,
                                             fusionee_id(fusionee),
                                             fusion_core_pid( fusion_core ),
+                                            call->entry.id,
                                             execution->serial);
 
           while (!execution->executed) {
@@ -395,7 +583,7 @@ restart:
                FUSION_DEBUG( "  -> skirmishs transferred, sleeping on call...\n" );
 
 #ifdef FUSION_CALL_INTERRUPTIBLE
-               fusion_core_wq_wait( fusion_core, &execution->wait, 0, true );
+               fusion_core_wq_wait( fusion_core, &execution->wait, &dev->lock, 0, true );
 
                if (signal_pending(current)) {
                     FUSION_DEBUG( "  -> woke up, SIGNAL PENDING!\n" );
@@ -415,7 +603,7 @@ restart:
                     return -EINTR;
                }
 #else
-               fusion_core_wq_wait( fusion_core, &execution->wait, 0, false );
+               fusion_core_wq_wait( fusion_core, &execution->wait, &dev->lock, 0, false );
 #endif
           }
 
@@ -455,6 +643,9 @@ fusion_call_execute2(FusionDev * dev, Fusionee * fusionee,
      FUSION_DEBUG( "%s( dev %p, fusionee %p, execute %p, call id %d, serial %u )\n", __FUNCTION__, dev, fusionee, execute,
                    execute->call_id, execute->serial );
 
+     if (execute->length > FUSION_CALL_MAX_LENGTH)
+          return -EMSGSIZE;
+
 restart:
      /* Lookup and lock call. */
      ret = fusion_call_lookup(&dev->call, execute->call_id, &call);
@@ -464,12 +655,7 @@ restart:
      FUSION_DEBUG( "  -> call %u '%s'\n", call->entry.id, call->entry.name );
 
      if (execute->flags & FCEF_RESUMABLE && execute->serial != 0) {
-          /* Search for execution, starting with oldest. */
-          direct_list_foreach (execution, call->executions) {
-               if (execution->serial == execute->serial)
-                    break;
-          }
-
+          execution = lookup_execution(call, execute->serial);
           if (!execution) {
                printk( KERN_ERR "%s: resumable execution with serial %u not found!\n", __FUNCTION__, execute->serial );
                direct_list_foreach (execution, call->executions) {
@@ -482,30 +668,27 @@ restart:
           CallQuota             *quota    = NULL;
           FusionMessageCallback  callback = FMC_NONE;
 
-          if (call->quotas->nnodes) {
-               // TODO: optimise by keeping last quota lookup which is most likely the one we want
-               quota = fusion_hash_lookup( call->quotas, (void*)(long) fusionee->id );
-               if (quota) {
-                    if (quota->count >= quota->limit) {
+          quota = lookup_quota( call, fusionee );
+          if (quota) {
+               if (quota->count >= quota->limit) {
 #ifdef FUSION_CALL_INTERRUPTIBLE
-                         fusion_core_wq_wait( fusion_core, &quota->wait, 0, true );
+                    fusion_core_wq_wait( fusion_core, &quota->wait, &dev->lock, 0, true );
 
-                         if (signal_pending(current)) {
-                              FUSION_DEBUG( "  -> woke up waiting for quota, SIGNAL PENDING!\n" );
-                              return -EINTR;
-                         }
+                    if (signal_pending(current)) {
+                         FUSION_DEBUG( "  -> woke up waiting for quota, SIGNAL PENDING!\n" );
+                         return -EINTR;
+                    }
 #else
-                         fusion_core_wq_wait( fusion_core, &quota->wait, 0, false );
+                    fusion_core_wq_wait( fusion_core, &quota->wait, &dev->lock, 0, false );
 #endif
 
-                         goto restart;
-                    }
+                    goto restart;
                }
           }
 
           do {
                serial = ++call->serial;
-          } while (!serial);
+          } while (!serial || lookup_execution(call, serial));
 
           /* Add execution to receive the result. */
           if (!(execute->flags & FCEF_ONEWAY)) {
@@ -564,6 +747,7 @@ restart:
                fusion_skirmish_transfer_all(dev, call->fusionee->id,
                                             fusionee_id(fusionee),
                                             fusion_core_pid( fusion_core ),
+                                            call->entry.id,
                                             execution->serial);
 
           while (!execution->executed) {
@@ -572,7 +756,7 @@ restart:
                FUSION_DEBUG( "  -> skirmishs transferred, sleeping on call...\n" );
 
 #ifdef FUSION_CALL_INTERRUPTIBLE
-               fusion_core_wq_wait( fusion_core, &execution->wait, 0, true );
+               fusion_core_wq_wait( fusion_core, &execution->wait, &dev->lock, 0, true );
 
                if (signal_pending(current)) {
                     FUSION_DEBUG( "  -> woke up, SIGNAL PENDING!\n" );
@@ -592,7 +776,7 @@ restart:
                     return -EINTR;
                }
 #else
-               fusion_core_wq_wait( fusion_core, &execution->wait, 0, false );
+               fusion_core_wq_wait( fusion_core, &execution->wait, &dev->lock, 0, false );
 #endif
           }
 
@@ -637,15 +821,20 @@ fusion_call_return(FusionDev * dev, int fusion_id, FusionCallReturn * call_ret)
 
      FUSION_DEBUG( "  -> call %u '%s'\n", call->entry.id, call->entry.name );
 
-     /* Search for execution, starting with oldest. */
-     direct_list_foreach (execution, call->executions) {
-          if ((execution->executed)
-              || (execution->call_id != call_ret->call_id)
-              || ((dev->api.major >= 4)
-                  && (execution->serial != call_ret->serial))) {
-               continue;
+     /* Search for execution, by serial or starting with oldest for API 3.x */
+     if (dev->api.major >= 4) {
+          execution = lookup_execution(call, call_ret->serial);
+          if (execution && execution->executed)
+               execution = NULL;
+     }
+     else {
+          direct_list_foreach (execution, call->executions) {
+               if (!execution->executed)
+                    break;
           }
+     }
 
+     if (execution) {
           /*
            * Check if caller received a signal while waiting for the result.
            *
@@ -682,6 +871,85 @@ fusion_call_return(FusionDev * dev, int fusion_id, FusionCallReturn * call_ret)
      return -ENOMSG;
 }
 
+/*
+ * Gives up waiting for the result after FCEF_TIMEOUT expired.
+ *
+ * The skirmishs are taken back from the callee, unless it's holding one of them
+ * and revoking is not forced. The call message is dropped if it has not been read
+ * yet, otherwise the execution stays cancelled until the callee returns.
+ */
+static int
+cancel_execution(FusionDev * dev, FusionCall * call, FusionCallExecution * execution,
+                 Fusionee * fusionee, bool force)
+{
+     int ret;
+
+     if (fusionee) {
+          ret = fusion_skirmish_revoke_all(dev, call->fusionee->id, fusion_core_pid( fusion_core ),
+                                           execution->serial, force);
+          if (ret)
+               return ret;
+     }
+
+     unboost_execution(call, execution);
+
+     if (fusionee_cancel_message(dev, call->fusionee, FMT_CALL3, call->entry.id,
+                                 offsetof(FusionCallMessage3, serial), execution->serial) == 0) {
+          FUSION_DEBUG( "  -> call message dropped, serial %u\n", execution->serial );
+
+          remove_execution(call, execution);
+          free_execution(dev, execution);
+     }
+     else
+          execution->cancelled = true;
+
+     return -ETIMEDOUT;
+}
+
+int
+fusion_call_execute_batch(FusionDev * dev, int call_id,
+                          const int *call_args, int num)
+{
+     int                     ret;
+     FusionCall             *call;
+     FusionCallBatchMessage *message;
+     int                     size = sizeof(FusionCallBatchMessage) + num * sizeof(int);
+
+     FUSION_DEBUG( "%s( dev %p, call id %d, num %d )\n", __FUNCTION__, dev, call_id, num );
+
+     FUSION_ASSERT( num > 0 && num <= FUSION_CALL_BATCH_MAX );
+
+     ret = fusion_call_lookup(&dev->call, call_id, &call);
+     if (ret)
+          return ret;
+
+     message = fusion_core_malloc( fusion_core, size );
+     if (!message)
+          return -ENOMEM;
+
+     message->message.handler  = call->handler;
+     message->message.ctx      = call->ctx;
+     message->message.caller   = 0;
+     message->message.call_arg = num;
+     message->message.call_ptr = NULL;
+     message->message.serial   = 0;
+
+     memcpy( message->call_args, call_args, num * sizeof(int) );
+
+     ret = fusionee_send_message2(dev, NULL, call->fusionee, FMT_CALL,
+                                  call->entry.id, 0, size, message,
+                                  FMC_NONE, NULL, 0, NULL, 0, true);
+
+     fusion_core_free( fusion_core, message );
+
+     if (ret)
+          return ret;
+
+     call->count++;
+
+     return 0;
+}
+
 int
 fusion_call_execute3(FusionDev * dev, Fusionee * fusionee,
                      FusionCallExecute3 * execute)
@@ -690,12 +958,24 @@ fusion_call_execute3(FusionDev * dev, Fusionee * fusionee,
      FusionCall *call;
      FusionCallExecution *execution = NULL;
      FusionCallMessage3 message;
+     FusionSHMPoolRef ref;
+     void *call_ptr = NULL;
      unsigned int serial;
      bool flush = true;
+     int prio = 0;
+     int timeout = 0;
+     bool revoking = false;
+     unsigned long revoke_deadline = 0;
 
      FUSION_DEBUG( "%s( dev %p, fusionee %p, execute %p, call id %d, serial %u )\n", __FUNCTION__, dev, fusionee, execute,
                    execute->call_id, execute->serial );
 
+     if (execute->flags & FCEF_TIMEOUT && execute->timeout_ms < 0)
+          return -EINVAL;
+
+     if (execute->length > FUSION_CALL_MAX_LENGTH || execute->ret_length > FUSION_CALL_MAX_LENGTH)
+          return -EMSGSIZE;
+
 restart:
      /* Lookup and lock call. */
      ret = fusion_call_lookup(&dev->call, execute->call_id, &call);
@@ -705,12 +985,7 @@ restart:
      FUSION_DEBUG( "  -> call %u '%s'\n", call->entry.id, call->entry.name );
 
      if (execute->flags & FCEF_RESUMABLE && execute->serial != 0) {
-          /* Search for execution, starting with oldest. */
-          direct_list_foreach (execution, call->executions) {
-               if (execution->serial == execute->serial)
-                    break;
-          }
-
+          execution = lookup_execution(call, execute->serial);
           if (!execution) {
                printk( KERN_ERR "%s: resumable execution with serial %u not found!\n", __FUNCTION__, execute->serial );
                direct_list_foreach (execution, call->executions) {
@@ -718,45 +993,71 @@ restart:
                }
                return -EIDRM;
           }
+
+          /* Nobody waits for the result of an asynchronous or cancelled execution. */
+          if (execution->async || execution->cancelled)
+               return -EINVAL;
      }
      else {
           CallQuota             *quota    = NULL;
           FusionMessageCallback  callback = FMC_NONE;
 
-          if (call->quotas->nnodes) {
-               // TODO: optimise by keeping last quota lookup which is most likely the one we want
-               quota = fusion_hash_lookup( call->quotas, (void*)(long) fusionee->id );
-               if (quota) {
-                    if (quota->count >= quota->limit) {
-                         fusionee->wait_on_call_quota = execute->call_id;
+          quota = lookup_quota( call, fusionee );
+          if (quota) {
+               if (quota->count >= quota->limit) {
+                    fusionee->wait_on_call_quota = execute->call_id;
 
 #ifdef FUSION_CALL_INTERRUPTIBLE
-                         fusion_core_wq_wait( fusion_core, &quota->wait, 0, true );
+                    fusion_core_wq_wait( fusion_core, &quota->wait, &dev->lock, 0, true );
 
-                         if (signal_pending(current)) {
-                              FUSION_DEBUG( "  -> woke up waiting for quota, SIGNAL PENDING!\n" );
-                              fusionee->wait_on_call_quota = 0;
-                              return -EINTR;
-                         }
+                    if (signal_pending(current)) {
+                         FUSION_DEBUG( "  -> woke up waiting for quota, SIGNAL PENDING!\n" );
+                         fusionee->wait_on_call_quota = 0;
+                         return -EINTR;
+                    }
 #else
-                         fusion_core_wq_wait( fusion_core, &quota->wait, 0, false );
+                    fusion_core_wq_wait( fusion_core, &quota->wait, &dev->lock, 0, false );
 #endif
-                         fusionee->wait_on_call_quota = 0;
+                    fusionee->wait_on_call_quota = 0;
 
-                         goto restart;
-                    }
+                    goto restart;
                }
           }
 
+          /* Only a reference to the data is passed. */
+          if (execute->flags & FCEF_SHMPOOL) {
+               if (!fusionee || execute->length != sizeof(FusionSHMPoolRef))
+                    return -EINVAL;
+
+               if (copy_from_user( &ref, execute->ptr, sizeof(FusionSHMPoolRef) ))
+                    return -EFAULT;
+
+               ret = fusion_shmpool_check_ref( dev, &ref, fusionee_id(fusionee), call->fusionee->id, &call_ptr );
+               if (ret)
+                    return ret;
+          }
+
           do {
                serial = ++call->serial;
-          } while (!serial);
+          } while (!serial || lookup_execution(call, serial));
 
           /* Add execution to receive the result. */
           if (!(execute->flags & FCEF_ONEWAY)) {
-               execution = add_execution(call, fusionee, serial, execute->ret_length);
-               if (!execution)
-                    return -ENOMEM;
+               if (execute->flags & FCEF_ASYNC && fusionee) {
+                    execution = add_execution(call, fusionee, serial, 0);
+                    if (!execution)
+                         return -ENOMEM;
+
+                    execution->async      = true;
+                    execution->ret_length = execute->ret_length;
+               }
+               else {
+                    execution = add_execution(call, fusionee, serial, execute->ret_length);
+                    if (!execution)
+                         return -ENOMEM;
+               }
+
+               execution->shmpool = !!(execute->flags & FCEF_SHMPOOL);
 
                FUSION_DEBUG( "  -> execution %p, serial %u\n", execution, execution->serial );
           }
@@ -770,8 +1071,8 @@ restart:
           message.caller = fusionee ? fusionee_id(fusionee) : 0;
 
           message.call_arg    = execute->call_arg;
-          message.call_ptr    = NULL;
-          message.call_length = execute->length;
+          message.call_ptr    = call_ptr;
+          message.call_length = (execute->flags & FCEF_SHMPOOL) ? ref.length : execute->length;
           message.ret_length  = execute->ret_length;
 
           message.serial = execution ? serial : 0;
@@ -784,11 +1085,17 @@ restart:
                //flush    = true;
           }
 
+          /* Calls real time callers wait for are handled first and at their priority. */
+          if (execution && !execution->async && fusionee && rt_task( current ))
+               prio = current->rt_priority;
+
           /* Put message into queue of callee. */
-          ret = fusionee_send_message2(dev, fusionee, call->fusionee, FMT_CALL3,
-                                       call->entry.id, 0, sizeof(FusionCallMessage3),
-                                       &message, callback, quota, 1, execute->ptr, execute->length,
-                                       flush);
+          ret = fusionee_send_message_prio(dev, fusionee, call->fusionee, FMT_CALL3,
+                                           call->entry.id, 0, sizeof(FusionCallMessage3),
+                                           &message, callback, quota, 1,
+                                           (execute->flags & FCEF_SHMPOOL) ? NULL : execute->ptr,
+                                           (execute->flags & FCEF_SHMPOOL) ? 0 : execute->length,
+                                           flush, prio);
           if (ret) {
                FUSION_DEBUG( "  -> MESSAGE SENDING FAILED! (ret %u)\n", ret );
                if (quota)
@@ -801,10 +1108,22 @@ restart:
           }
 
           call->count++;
+
+          if (execution && !execution->async && prio) {
+               fusionee_boost(dev, call->fusionee, prio);
+
+               execution->boosted = true;
+          }
      }
 
+     /* The result of an asynchronous execution is sent to the caller. */
+     if (execution && execution->async) {
+          FUSION_DEBUG( "  -> message sent, result will be sent as serial %u.\n", execution->serial );
+
+          execute->serial = execution->serial;
+     }
      /* When waiting for a result... */
-     if (execution) {
+     else if (execution) {
           FUSION_DEBUG( "  -> message sent, transfering all skirmishs...\n" );
 
           /* Transfer held skirmishs (locks). */
@@ -812,15 +1131,22 @@ restart:
                fusion_skirmish_transfer_all(dev, call->fusionee->id,
                                             fusionee_id(fusionee),
                                             fusion_core_pid( fusion_core ),
+                                            call->entry.id,
                                             execution->serial);
 
+          if (execute->flags & FCEF_TIMEOUT) {
+               timeout = msecs_to_jiffies( execute->timeout_ms );
+               if (timeout < 1)
+                    timeout = 1;
+          }
+
           while (!execution->executed) {
-               /* Unlock call and wait for execution result. TODO: add timeout? */
+               /* Unlock call and wait for execution result. */
 
                FUSION_DEBUG( "  -> skirmishs transferred, sleeping on call...\n" );
 
 #ifdef FUSION_CALL_INTERRUPTIBLE
-               fusion_core_wq_wait( fusion_core, &execution->wait, 0, true );
+               fusion_core_wq_wait( fusion_core, &execution->wait, &dev->lock, timeout ? &timeout : NULL, true );
 
                if (signal_pending(current)) {
                     FUSION_DEBUG( "  -> woke up, SIGNAL PENDING!\n" );
@@ -840,8 +1166,26 @@ restart:
                     return -EINTR;
                }
 #else
-               fusion_core_wq_wait( fusion_core, &execution->wait, 0, false );
+               fusion_core_wq_wait( fusion_core, &execution->wait, &dev->lock, timeout ? &timeout : NULL, false );
 #endif
+
+               if ((execute->flags & FCEF_TIMEOUT) && !timeout && !execution->executed) {
+                    FUSION_DEBUG( "  -> woke up, TIMEOUT!\n" );
+
+                    /* The callee gets as long again to release a transferred skirmish it holds. */
+                    if (!revoking) {
+                         revoking        = true;
+                         revoke_deadline = jiffies + msecs_to_jiffies( execute->timeout_ms );
+                    }
+
+                    ret = cancel_execution(dev, call, execution, fusionee,
+                                           time_after_eq( jiffies, revoke_deadline ));
+                    if (ret != -EBUSY)
+                         return ret;
+
+                    /* Retry soon. */
+                    timeout = HZ / 100 + 1;
+               }
           }
 
           /* Return result to calling process. */
@@ -879,6 +1223,77 @@ restart:
      return ret;
 }
 
+/*
+ * The reference returned by the callee has to be valid for the caller, too.
+ */
+static int
+check_result_ref(FusionDev * dev, FusionCall * call, FusionCallExecution * execution,
+                 const FusionSHMPoolRef * ref)
+{
+     return fusion_shmpool_check_ref(dev, ref, call->fusionee->id, fusionee_id(execution->caller), NULL);
+}
+
+/*
+ * Queues the result of an asynchronous execution to the caller. If the result
+ * can't be passed on, the caller still gets one with the error as status.
+ */
+static int
+send_result(FusionDev * dev, FusionCall * call, FusionCallExecution * execution,
+            FusionCallReturn3 * call_ret)
+{
+     int ret;
+     FusionCallResult result;
+     struct {
+          FusionCallResult result;
+          FusionSHMPoolRef ref;
+     } shm_result;
+
+     /* Caller has left already. */
+     if (!execution->caller)
+          return 0;
+
+     result.serial     = execution->serial;
+     result.ret_length = call_ret->length;
+     result.status     = 0;
+
+     if (execution->ret_length < call_ret->length)
+          ret = -E2BIG;
+     else if (execution->shmpool && call_ret->length) {
+          /* Pass on the validated copy of the reference. */
+          if (call_ret->length != sizeof(FusionSHMPoolRef))
+               ret = -EINVAL;
+          else if (copy_from_user( &shm_result.ref, call_ret->ptr, sizeof(FusionSHMPoolRef) ))
+               ret = -EFAULT;
+          else
+               ret = check_result_ref(dev, call, execution, &shm_result.ref);
+
+          if (!ret) {
+               shm_result.result = result;
+
+               ret = fusionee_send_message2(dev, NULL, execution->caller, FMT_CALL_RESULT,
+                                            call->entry.id, 0, sizeof(shm_result), &shm_result,
+                                            FMC_NONE, NULL, 0, NULL, 0, true);
+          }
+     }
+     else {
+          /* Without sender, the dispatcher must not be throttled by the caller's queue. */
+          ret = fusionee_send_message2(dev, NULL, execution->caller, FMT_CALL_RESULT,
+                                       call->entry.id, 0, sizeof(FusionCallResult), &result,
+                                       FMC_NONE, NULL, 0, call_ret->ptr, call_ret->length, true);
+     }
+
+     if (ret) {
+          result.ret_length = 0;
+          result.status     = ret;
+
+          fusionee_send_message2(dev, NULL, execution->caller, FMT_CALL_RESULT,
+                                 call->entry.id, 0, sizeof(FusionCallResult), &result,
+                                 FMC_NONE, NULL, 0, NULL, 0, true);
+     }
+
+     return ret;
+}
+
 int
 fusion_call_return3(FusionDev * dev, int fusion_id, FusionCallReturn3 * call_ret)
 {
@@ -898,28 +1313,42 @@ fusion_call_return3(FusionDev * dev, int fusion_id, FusionCallReturn3 * call_ret
 
      FUSION_DEBUG( "  -> call %u '%s'\n", call->entry.id, call->entry.name );
 
-     /* Search for execution, starting with oldest. */
-     direct_list_foreach (execution, call->executions) {
-          if ((execution->executed)
-              || (execution->call_id != call_ret->call_id)
-              || ((dev->api.major >= 4)
-                  && (execution->serial != call_ret->serial))) {
-               continue;
+     /* Search for execution, by serial or starting with oldest for API 3.x */
+     if (dev->api.major >= 4) {
+          execution = lookup_execution(call, call_ret->serial);
+          if (execution && execution->executed)
+               execution = NULL;
+     }
+     else {
+          direct_list_foreach (execution, call->executions) {
+               if (!execution->executed)
+                    break;
           }
+     }
 
+     if (execution) {
           /*
-           * Check if caller received a signal while waiting for the result.
+           * Check if caller received a signal or timed out while waiting for the result.
            *
            * TODO: This is not completely solved. Restarting the system call
            * should be possible without causing another execution.
            */
-          if (execution->signalled) {
+          if (execution->signalled || execution->cancelled) {
                /* Remove and free execution. */
                remove_execution(call, execution);
                free_execution(dev, execution);
                return -EIDRM;
           }
 
+          if (execution->async) {
+               ret = send_result(dev, call, execution, call_ret);
+
+               /* Remove and free execution. */
+               remove_execution(call, execution);
+               free_execution(dev, execution);
+               return ret;
+          }
+
           if (execution->ret_size < call_ret->length) {
                /* Remove and free execution. */
                remove_execution(call, execution);
@@ -938,6 +1367,20 @@ fusion_call_return3(FusionDev * dev, int fusion_id, FusionCallReturn3 * call_ret
           execution->ret_length = call_ret->length;
           execution->executed = true;
 
+          /* The caller gets no data instead of an invalid reference. */
+          if (execution->shmpool && call_ret->length) {
+               if (call_ret->length != sizeof(FusionSHMPoolRef))
+                    ret = -EINVAL;
+               else
+                    ret = check_result_ref(dev, call, execution, (FusionSHMPoolRef *)(execution + 1));
+
+               if (ret)
+                    execution->ret_length = 0;
+          }
+
+          /* The dispatcher is done with it. */
+          unboost_execution(call, execution);
+
           /* FIXME: Caller might still have received a signal since check above. */
           FUSION_ASSERT(!execution->signalled);
 
@@ -947,7 +1390,7 @@ fusion_call_return3(FusionDev * dev, int fusion_id, FusionCallReturn3 * call_ret
           /* Wake up caller. */
           fusion_core_wq_wake( fusion_core, &execution->wait);
 
-          return 0;
+          return ret;
      }
 
      /* DirectFB 1.0.x does not handle one-way-calls properly */
@@ -1027,7 +1470,7 @@ int fusion_call_destroy(FusionDev * dev, Fusionee *fusionee, int call_id)
           execution = (FusionCallExecution *) call->executions;
           if (execution) {
                /* Unlock call and wait for execution. TODO: add timeout? */
-               fusion_core_wq_wait( fusion_core, &execution->wait, 0, true);
+               fusion_core_wq_wait( fusion_core, &execution->wait, &dev->lock, 0, true);
 
                if (signal_pending(current))
                     return -EINTR;
@@ -1065,6 +1508,22 @@ void fusion_call_destroy_all(FusionDev * dev, Fusionee *fusionee)
                fusion_entry_destroy_locked(call->entry.entries,
                                            &call->entry);
           }
+          else {
+               FusionCallExecution *execution, *next_execution;
+
+               /* Results of asynchronous executions are dropped, cancelled ones are freed. */
+               direct_list_foreach_safe (execution, next_execution, call->executions) {
+                    if (execution->caller != fusionee)
+                         continue;
+
+                    if (execution->cancelled) {
+                         remove_execution(call, execution);
+                         free_execution(dev, execution);
+                    }
+                    else if (execution->async)
+                         execution->caller = NULL;
+               }
+          }
 
           l = next;
      }
@@ -1078,25 +1537,47 @@ static FusionCallExecution *add_execution(FusionCall * call,
                                           unsigned int ret_size)
 {
      FusionCallExecution *execution;
+     int                  klass;
 
      FUSION_DEBUG( "%s( call %p [%u], caller %p [%lu], serial %i )\n", __FUNCTION__, call, call->entry.id, caller, caller ? caller->id : 0, serial );
 
-     /* Allocate execution. */
+     /* Allocate execution, preferably from the pool of this CPU. */
+     for (klass = 0; klass < CACHE_EXECUTIONS_CLASSES; klass++) {
+          if (execution_data_sizes[klass] >= ret_size)
+               break;
+     }
+
+     if (klass < CACHE_EXECUTIONS_CLASSES) {
+          ExecutionPool *pool = &call->entry.entries->dev->execution_pools[raw_smp_processor_id()];
 
-     if (ret_size < 20 && call->entry.entries->dev->execution_free_list_num > 0) {
-          execution = (FusionCallExecution *)call->entry.entries->dev->execution_free_list;
-          direct_list_remove( &call->entry.entries->dev->execution_free_list, &execution->link );
-          call->entry.entries->dev->execution_free_list_num--;
+          if (pool->free[klass]) {
+               execution = (FusionCallExecution *) pool->free[klass];
+               direct_list_remove( &pool->free[klass], &execution->link );
+               pool->num[klass]--;
+               pool->hits[klass]++;
+
+               call->pooled++;
+          }
+          else {
+               execution = fusion_core_cache_alloc( fusion_core, &execution_caches[klass] );
+               pool->misses[klass]++;
+          }
      }
      else {
-          execution = fusion_core_malloc( fusion_core, sizeof(FusionCallExecution) + (ret_size > CACHE_EXECUTIONS_DATA_LEN ? ret_size : CACHE_EXECUTIONS_DATA_LEN) );
+          klass = -1;
+
+          execution = fusion_core_malloc( fusion_core, sizeof(FusionCallExecution) + ret_size );
      }
      if (!execution)
           return NULL;
 
+     call->allocated++;
+
      /* Initialize execution. */
      memset(execution, 0, sizeof(FusionCallExecution));
 
+     execution->klass = klass;
+
      execution->caller = caller;
      execution->caller_pid = fusion_core_pid( fusion_core );
      execution->call_id = call->entry.id;
@@ -1105,18 +1586,92 @@ static FusionCallExecution *add_execution(FusionCall * call,
 
      fusion_core_wq_init( fusion_core, &execution->wait);
 
-     /* Add execution. */
+     /* Add execution, resizing here keeps the allocator out of returns and teardown. */
+     if (call->num_executions >= call->num_serials)
+          resize_serials( call, call->num_serials * 2 );
+     else if (call->num_serials > CALL_SERIAL_BUCKETS && call->num_executions < call->num_serials / 4)
+          resize_serials( call, call->num_serials / 2 );
+
+     direct_list_prepend(&call->serials[serial & (call->num_serials - 1)], &execution->serial_link);
+
+     call->num_executions++;
+
      direct_list_append(&call->executions, &execution->link);
 
      return execution;
 }
 
+static FusionCallExecution *lookup_execution(FusionCall * call,
+                                             unsigned int serial)
+{
+     FusionCallExecution *execution;
+
+     direct_list_foreach_via (execution, call->serials[serial & (call->num_serials - 1)], serial_link) {
+          if (execution->serial == serial)
+               return execution;
+     }
+
+     return NULL;
+}
+
+/*
+ * Moves all executions to a table with the given number of buckets.
+ * The old table is kept if allocating the new one fails.
+ */
+static void resize_serials( FusionCall * call, unsigned int num_serials )
+{
+     unsigned int          i;
+     FusionLink          **serials;
+     FusionCallExecution  *execution, *next;
+
+     FUSION_DEBUG( "%s( call %p [%u], %u -> %u buckets )\n", __FUNCTION__, call, call->entry.id,
+                   call->num_serials, num_serials );
+
+     if (num_serials == CALL_SERIAL_BUCKETS) {
+          serials = call->buckets;
+
+          memset( serials, 0, sizeof(call->buckets) );
+     }
+     else {
+          serials = fusion_core_malloc( fusion_core, num_serials * sizeof(FusionLink*) );
+          if (!serials)
+               return;
+     }
+
+     for (i = 0; i < call->num_serials; i++) {
+          direct_list_foreach_via_safe (execution, next, call->serials[i], serial_link) {
+               direct_list_prepend( &serials[execution->serial & (num_serials - 1)], &execution->serial_link );
+          }
+     }
+
+     if (call->serials != call->buckets)
+          fusion_core_free( fusion_core, call->serials );
+
+     call->serials     = serials;
+     call->num_serials = num_serials;
+}
+
+static void unboost_execution( FusionCall * call, FusionCallExecution * execution )
+{
+     if (execution->boosted) {
+          fusionee_unboost( call->entry.entries->dev, call->fusionee );
+
+          execution->boosted = false;
+     }
+}
+
 static void remove_execution( FusionCall * call, FusionCallExecution * execution )
 {
      FUSION_DEBUG( "%s( call %p [%u], execution %p )\n", __FUNCTION__, call, call->entry.id, execution );
 
      fusion_list_remove( &call->executions, &execution->link );
 
+     direct_list_remove( &call->serials[execution->serial & (call->num_serials - 1)], &execution->serial_link );
+
+     call->num_executions--;
+
+     unboost_execution( call, execution );
+
      fusion_core_wq_wake( fusion_core, &execution->wait );
 }
 
@@ -1124,10 +1679,18 @@ static void free_execution( FusionDev * dev, FusionCallExecution * execution )
 {
      FUSION_DEBUG( "%s( execution %p )\n", __FUNCTION__, execution );
 
-     if (execution->ret_size <= CACHE_EXECUTIONS_DATA_LEN && dev->execution_free_list_num < CACHE_EXECUTIONS_NUM) {
-          direct_list_append( &dev->execution_free_list, &execution->link );
+     if (execution->klass >= 0) {
+          ExecutionPool *pool  = &dev->execution_pools[raw_smp_processor_id()];
+          int            klass = execution->klass;
 
-          dev->execution_free_list_num++;
+          /* Most recently used first. */
+          if (pool->num[klass] < fusion_execution_pool) {
+               direct_list_prepend( &pool->free[klass], &execution->link );
+
+               pool->num[klass]++;
+          }
+          else
+               fusion_core_cache_free( fusion_core, &execution_caches[klass], execution );
      }
      else
           fusion_core_free( fusion_core, execution );
@@ -1142,7 +1705,8 @@ static void free_all_executions(FusionCall * call)
      direct_list_foreach_safe (execution, next, call->executions) {
           remove_execution( call, execution );
 
-          if (!execution->caller)
+          /* Nobody waits for these anymore. */
+          if (!execution->caller || execution->async || execution->cancelled || execution->signalled)
                free_execution( call->entry.entries->dev,  execution );
      }
 }
@@ -1151,9 +1715,13 @@ void
 fusion_call_quota_message_callback(FusionDev * dev, int id, void *ctx, int arg)
 {
      CallQuota *quota = ctx;
+     bool       full  = quota->count >= quota->limit;
 
-     quota->count--;// -= quota->limit / 4 + 1;
+     /* Calls delivered in the same packet are accounted at once. */
+     quota->count -= arg;
 
-     fusion_core_wq_wake( fusion_core, &quota->wait );
+     /* Only callers that reached the limit are waiting. */
+     if (full && quota->count < quota->limit)
+          fusion_core_wq_wake( fusion_core, &quota->wait );
 }
 
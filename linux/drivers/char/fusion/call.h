@@ -21,9 +21,15 @@
 
 /* module init/cleanup */
 
+int fusion_call_caches_init(void);
+void fusion_call_caches_deinit(void);
+
 int fusion_call_init(FusionDev * dev);
 void fusion_call_deinit(FusionDev * dev);
 
+unsigned int fusion_call_pooled_executions(FusionDev * dev);
+void fusion_call_print_pools(FusionDev * dev, struct seq_file *m);
+
 /* public API */
 
 int fusion_call_new(FusionDev * dev, Fusionee *fusionee, FusionCallNew * call);
@@ -43,6 +49,13 @@ int fusion_call_execute3(FusionDev * dev, Fusionee * fusionee,   /* NULL if call
 int fusion_call_return3(FusionDev * dev,
                         int fusion_id, FusionCallReturn3 * call_ret);
 
+/*
+ * Executes the call one way from the kernel for up to FUSION_CALL_BATCH_MAX call args
+ * in a single FusionCallBatchMessage.
+ */
+int fusion_call_execute_batch(FusionDev * dev, int call_id,
+                              const int *call_args, int num);
+
 int fusion_call_get_owner(FusionDev * dev, int call_id, FusionID *ret_fusion_id);
 
 int fusion_call_set_quota(FusionDev * dev, FusionCallSetQuota *set_quota);
@@ -99,7 +99,7 @@ static void *fusion_entries_seq_start(struct seq_file *f, loff_t * pos)
 
      entries = f->private;
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( entries->dev );
 
      if (!entries->dev->shutdown) {
           entry = (void *)(entries->list);
@@ -112,7 +112,7 @@ static void *fusion_entries_seq_start(struct seq_file *f, loff_t * pos)
 
           class = entry_classes[entries->dev->index][entries->class_index];
           if (!class->Print) {
-               fusion_core_unlock( fusion_core );
+               fusion_dev_unlock( entries->dev );
                return NULL;
           }
 
@@ -121,7 +121,7 @@ static void *fusion_entries_seq_start(struct seq_file *f, loff_t * pos)
           return entry;
      }
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( entries->dev );
 
      return NULL;
 }
@@ -141,7 +141,7 @@ static void fusion_entries_seq_stop(struct seq_file *f, void *v)
      entries = f->private;
      (void)v;
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( entries->dev );
 }
 
 int fusion_entries_show(struct seq_file *p, void *v)
@@ -221,11 +221,11 @@ void fusion_entries_create_proc_entry(FusionDev * dev, const char *name,
 
 void fusion_entries_destroy_proc_entry(FusionDev * dev, const char *name)
 {
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      remove_proc_entry(name, fusion_proc_dir[dev->index]);
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 }
 
 int fusion_entry_create(FusionEntries * entries, int *ret_id, void *create_ctx, FusionID fusion_id)
@@ -497,7 +497,7 @@ int fusion_entry_wait(FusionEntry * entry, int *timeout)
 
      entry->waiters++;
 
-     fusion_core_wq_wait( fusion_core, &entry->wait, timeout, true );
+     fusion_core_wq_wait( fusion_core, &entry->wait, &entry->entries->dev->lock, timeout, true );
 
      for (i=0; i<entry->waiters-1; i++) {
           if (entry->waiters_list[i] == fusion_core_pid( fusion_core ))
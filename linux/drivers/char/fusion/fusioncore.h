@@ -35,6 +35,10 @@ void              fusion_core_exit     ( FusionCore      *core );
 
 pid_t             fusion_core_pid      ( FusionCore      *core );
 
+/* Same as fusion_core_pid() for another thread of this system. */
+pid_t             fusion_core_pid_of   ( FusionCore      *core,
+                                         pid_t            tid );
+
 
 void             *fusion_core_malloc   ( FusionCore      *core,
                                          size_t           size );
@@ -42,6 +46,36 @@ void             *fusion_core_malloc   ( FusionCore      *core,
 void              fusion_core_free     ( FusionCore      *core,
                                          void            *ptr );
 
+/*
+ * Typed object caches, backed by a slab cache of their own.
+ * Unlike fusion_core_malloc() the memory is not cleared.
+ */
+FusionCoreResult  fusion_core_cache_init  ( FusionCore      *core,
+                                            FusionCache     *cache,
+                                            const char      *name,
+                                            size_t           size );
+
+void              fusion_core_cache_deinit( FusionCore      *core,
+                                            FusionCache     *cache );
+
+void             *fusion_core_cache_alloc ( FusionCore      *core,
+                                            FusionCache     *cache );
+
+void              fusion_core_cache_free  ( FusionCore      *core,
+                                            FusionCache     *cache,
+                                            void            *ptr );
+
+/* Iterates over all caches, starting with prev == NULL. */
+FusionCache      *fusion_core_cache_next  ( FusionCore      *core,
+                                            FusionCache     *prev );
+
+void              fusion_core_cache_stat  ( FusionCore      *core,
+                                            FusionCache     *cache,
+                                            const char     **ret_name,
+                                            size_t          *ret_size,
+                                            int             *ret_allocs,
+                                            int             *ret_frees );
+
 void              fusion_core_set_pointer( FusionCore      *core,
                                            unsigned int     index,
                                            void            *ptr );
@@ -54,6 +88,19 @@ void              fusion_core_lock     ( FusionCore      *core );
 void              fusion_core_unlock   ( FusionCore      *core );
 
 
+FusionCoreResult  fusion_core_mutex_init  ( FusionCore      *core,
+                                            FusionMutex     *mutex );
+
+void              fusion_core_mutex_deinit( FusionCore      *core,
+                                            FusionMutex     *mutex );
+
+void              fusion_core_mutex_lock  ( FusionCore      *core,
+                                            FusionMutex     *mutex );
+
+void              fusion_core_mutex_unlock( FusionCore      *core,
+                                            FusionMutex     *mutex );
+
+
 FusionCoreResult  fusion_core_wq_init  ( FusionCore      *core,
                                          FusionWaitQueue *queue );
 
@@ -62,6 +109,7 @@ void              fusion_core_wq_deinit( FusionCore      *core,
 
 void              fusion_core_wq_wait  ( FusionCore      *core,
                                          FusionWaitQueue *queue,
+                                         FusionMutex     *mutex,
                                          int             *timeout_ms,
                                          bool             interruptible );
 
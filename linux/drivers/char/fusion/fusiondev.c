@@ -102,11 +102,11 @@ static struct class_simple *fusion_class;
 ({                                      \
      int ret;                           \
                                         \
-     /*fusion_core_unlock( fusion_core );*/ \
+     /*fusion_dev_unlock( dev );*/       \
                                         \
      ret = copy_from_user( a, b, c );   \
                                         \
-     /*fusion_core_lock( fusion_core );*/   \
+     /*fusion_dev_lock( dev );*/         \
                                         \
      ret;                               \
 })
@@ -116,11 +116,11 @@ static struct class_simple *fusion_class;
 ({                                      \
      int ret;                           \
                                         \
-     /*fusion_core_unlock( fusion_core );*/ \
+     /*fusion_dev_unlock( dev );*/       \
                                         \
      ret = copy_to_user( a, b, c );     \
                                         \
-     /*fusion_core_lock( fusion_core );*/   \
+     /*fusion_dev_lock( dev );*/         \
                                         \
      ret;                               \
 })
@@ -139,7 +139,7 @@ fusiondev_stat_proc_show(struct seq_file *m, void *v)
 {
      FusionDev *dev = m->private;
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      if (!dev->shutdown) {
           if ((dev->api.major != 0) || (dev->api.minor != 0))
@@ -147,10 +147,10 @@ fusiondev_stat_proc_show(struct seq_file *m, void *v)
      
           seq_printf(m,
                               "lease/purchase   cede      attach     detach   dispatch      "
-                              "ref up   ref down  prevail/swoop dismiss\n");
+                              "ref up   ref down  prevail/swoop dismiss   ref push\n");
 
           seq_printf(m,
-                                   "%10d %10d  %10d %10d %10d  %10d %10d  %10d %10d\n",
+                                   "%10d %10d  %10d %10d %10d  %10d %10d  %10d %10d %10d\n",
                                    dev->stat.property_lease_purchase,
                                    dev->stat.property_cede,
                                    dev->stat.reactor_attach,
@@ -159,10 +159,11 @@ fusiondev_stat_proc_show(struct seq_file *m, void *v)
                                    dev->stat.ref_up,
                                    dev->stat.ref_down,
                                    dev->stat.skirmish_prevail_swoop,
-                                   dev->stat.skirmish_dismiss);
+                                   dev->stat.skirmish_dismiss,
+                                   dev->stat.ref_push);
      }
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      return 0;
 }
@@ -179,6 +180,60 @@ static const struct file_operations fusiondev_stat_proc_fops = {
      .release = seq_release,
 };
 
+static int
+fusiondev_caches_proc_show(struct seq_file *m, void *v)
+{
+     FusionDev   *dev   = m->private;
+     FusionCache *cache = NULL;
+
+     /* Caches are only added or removed while loading or unloading the module. */
+     seq_printf(m, "cache                          size     allocs      frees     in use\n");
+
+     while ((cache = fusion_core_cache_next( fusion_core, cache )) != NULL) {
+          const char *name;
+          size_t      size;
+          int         allocs, frees;
+
+          fusion_core_cache_stat( fusion_core, cache, &name, &size, &allocs, &frees );
+
+          seq_printf(m, "%-24s %10zu %10d %10d %10d\n", name, size, allocs, frees, allocs - frees);
+     }
+
+     fusion_dev_lock( dev );
+
+     if (!dev->shutdown) {
+          Fusionee *fusionee;
+          int       packets   = 0;
+          int       callbacks = 0;
+
+          direct_list_foreach(fusionee, dev->fusionee.list) {
+               packets   += fusionee->free_packets.count;
+               callbacks += fusionee->free_callbacks.count;
+          }
+
+          seq_printf(m, "\npooled: %d packets, %d callbacks, %u executions\n",
+                     packets, callbacks, fusion_call_pooled_executions(dev));
+
+          fusion_call_print_pools(dev, m);
+     }
+
+     fusion_dev_unlock( dev );
+
+     return 0;
+}
+
+static int fusiondev_caches_proc_open(struct inode *inode, struct file *file)
+{
+     return single_open(file, fusiondev_caches_proc_show, PDE_DATA(inode));
+}
+
+static const struct file_operations fusiondev_caches_proc_fops = {
+     .open    = fusiondev_caches_proc_open,
+     .read    = seq_read,
+     .llseek  = seq_lseek,
+     .release = seq_release,
+};
+
 
 /******************************************************************************/
 
@@ -229,6 +284,9 @@ static int fusiondev_init(FusionDev * dev)
      proc_create_data("stat", 0, fusion_proc_dir[dev->index],
                        &fusiondev_stat_proc_fops, dev);
 
+     proc_create_data("caches", 0, fusion_proc_dir[dev->index],
+                       &fusiondev_caches_proc_fops, dev);
+
      return 0;
 
 error_call:
@@ -255,11 +313,12 @@ error_fusionee:
 
 static void fusiondev_deinit(FusionDev * dev)
 {
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
+     remove_proc_entry("caches", fusion_proc_dir[dev->index]);
      remove_proc_entry("stat", fusion_proc_dir[dev->index]);
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      fusion_call_deinit(dev);
      fusion_shmpool_deinit(dev);
@@ -301,10 +360,16 @@ static int fusion_open(struct inode *inode, struct file *file)
           memset( dev, 0, sizeof(FusionDev) );
 
           dev->index = minor;
+
+          fusion_core_mutex_init( fusion_core, &dev->lock );
      }
-     else {
+
+     fusion_dev_lock( dev );
+
+     if (dev->refs) {
           if (file->f_flags & O_EXCL) {
                if (dev->fusionee.last_id) {
+                    fusion_dev_unlock( dev );
                     fusion_core_unlock( fusion_core );
                     return -EBUSY;
                }
@@ -317,6 +382,11 @@ static int fusion_open(struct inode *inode, struct file *file)
 
           ret = fusiondev_init( dev );
           if (ret) {
+               fusion_dev_unlock( dev );
+
+               if (!dev->refs)
+                    fusion_core_mutex_deinit( fusion_core, &dev->lock );
+
                remove_proc_entry(buf, proc_fusion_dir);
                fusion_core_unlock( fusion_core );
                return ret;
@@ -328,11 +398,18 @@ static int fusion_open(struct inode *inode, struct file *file)
           if (!fusion_local_refs[dev->index]) {
                fusiondev_deinit( dev );
 
+               fusion_dev_unlock( dev );
+
+               if (!dev->refs)
+                    fusion_core_mutex_deinit( fusion_core, &dev->lock );
+
                fusion_core_unlock( fusion_core );
                remove_proc_entry( buf, proc_fusion_dir );
           }
-          else
+          else {
+               fusion_dev_unlock( dev );
                fusion_core_unlock( fusion_core );
+          }
 
           return ret;
      }
@@ -341,6 +418,7 @@ static int fusion_open(struct inode *inode, struct file *file)
 
      dev->refs++;
 
+     fusion_dev_unlock( dev );
      fusion_core_unlock( fusion_core );
 
 	file->f_mode &= ~(FMODE_LSEEK | FMODE_PREAD | FMODE_PWRITE);
@@ -362,10 +440,18 @@ static int fusion_release(struct inode *inode, struct file *file)
 
      snprintf(buf, 4, "%d", minor);
 
-     fusion_core_lock( fusion_core );
+     /* Destroying the master waits for all others to leave, which
+        requires them to get through here, so not under the core lock. */
+     fusion_dev_lock( dev );
 
      fusionee_destroy( dev, fusionee );
 
+     fusion_dev_unlock( dev );
+
+
+     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
+
      dev->refs--;
 
      fusion_local_refs[dev->index]--;
@@ -375,15 +461,22 @@ static int fusion_release(struct inode *inode, struct file *file)
 
           fusiondev_deinit( dev );
 
-          fusion_core_unlock( fusion_core );
+          /* Proc readers only take the world lock. */
+          fusion_dev_unlock( dev );
 
           remove_proc_entry( buf, proc_fusion_dir );
 
-          fusion_core_lock( fusion_core );
+          fusion_dev_lock( dev );
 
           dev->shutdown = 0;
      }
 
+     fusion_dev_unlock( dev );
+
+     /* The next open initializes the world again, see fusion_open(). */
+     if (!dev->refs)
+          fusion_core_mutex_deinit( fusion_core, &dev->lock );
+
      fusion_core_unlock( fusion_core );
 
      return 0;
@@ -405,11 +498,11 @@ fusion_flush(struct file *file)
                   atomic_long_read(&file->f_count), fusionee_id(fusionee), fusion_core_pid( fusion_core ));
 
      if (current->flags & PF_EXITING) {
-          fusion_core_lock( fusion_core );
+          fusion_dev_lock( dev );
 
-          fusion_skirmish_dismiss_all_from_pid(dev, fusion_core_pid( fusion_core ));
+          fusion_skirmish_dismiss_all_from_pid(dev, fusionee, fusion_core_pid( fusion_core ));
 
-          fusion_core_unlock( fusion_core );
+          fusion_dev_unlock( dev );
      }
 
      return 0;
@@ -425,11 +518,11 @@ fusion_read(struct file *file, char *buf, size_t count, loff_t * ppos)
      FUSION_DEBUG("fusion_read( %p, %ld, %zu )\n", file, atomic_long_read(&file->f_count),
                   count);
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      ret = fusionee_get_messages(dev, fusionee, buf, count, !(file->f_flags & O_NONBLOCK));
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
 
      if (ret > 0)
@@ -446,11 +539,81 @@ static unsigned int fusion_poll(struct file *file, poll_table * wait)
 
      FUSION_DEBUG("fusion_poll( %p, %ld )\n", file, atomic_long_read(&file->f_count));
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      ret = fusionee_poll(dev, fusionee, file, wait);
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
+
+     return ret;
+}
+
+static int fusion_ioctl_locked(FusionDev * dev, Fusionee * fusionee,
+                               unsigned int cmd, unsigned long arg);
+
+static int check_entry_permission(FusionEntries * entries, Fusionee * fusionee,
+                                  unsigned int cmd, int entry_id);
+
+#define FUSION_BATCH_CHUNK 8
+
+static int
+fusion_batch(FusionDev * dev, Fusionee * fusionee, FusionBatch * user_batch)
+{
+     int              ret = 0;
+     FusionBatch      batch;
+     FusionBatchEntry entries[FUSION_BATCH_CHUNK];
+     unsigned int     i, num = 0;
+
+     if (unlocked_copy_from_user(&batch, user_batch, sizeof(batch)))
+          return -EFAULT;
+
+     if (batch.num_entries > FUSION_BATCH_MAX)
+          return -EINVAL;
+
+     while (num < batch.num_entries) {
+          unsigned int count = batch.num_entries - num;
+
+          if (count > FUSION_BATCH_CHUNK)
+               count = FUSION_BATCH_CHUNK;
+
+          /* Let others into the world between chunks. */
+          if (num) {
+               fusion_dev_unlock( dev );
+               cond_resched();
+               fusion_dev_lock( dev );
+          }
+
+          if (unlocked_copy_from_user(entries, batch.entries + num, sizeof(FusionBatchEntry) * count)) {
+               ret = -EFAULT;
+               goto out;
+          }
+
+          for (i = 0; i < count; i++) {
+               int result;
+
+               /* No nesting. */
+               if (_IOC_TYPE(entries[i].cmd) == FT_LOUNGE && _IOC_NR(entries[i].cmd) == _IOC_NR(FUSION_BATCH))
+                    result = -EINVAL;
+               else
+                    result = fusion_ioctl_locked(dev, fusionee, entries[i].cmd,
+                                                 (unsigned long) entries[i].arg);
+
+               num++;
+
+               if (put_user(result, &batch.entries[num - 1].result)) {
+                    ret = -EFAULT;
+                    goto out;
+               }
+
+               if (result == -EINTR || (result && (batch.flags & FUSION_BATCH_STOP_ON_ERROR)))
+                    goto out;
+          }
+     }
+
+out:
+     /* Also after a fault, so that it is known which entries have been run. */
+     if (put_user(num, &user_batch->num_done))
+          return -EFAULT;
 
      return ret;
 }
@@ -504,6 +667,12 @@ lounge_ioctl(FusionDev * dev, Fusionee * fusionee,
           case _IOC_NR(FUSION_SYNC):
                return fusionee_sync( dev, fusionee );
 
+          case _IOC_NR(FUSION_DISPATCHER_ENTER):
+               return fusionee_enter_dispatcher( dev, fusionee );
+
+          case _IOC_NR(FUSION_DISPATCHER_LEAVE):
+               return fusionee_leave_dispatcher( dev, fusionee );
+
           case _IOC_NR(FUSION_ENTRY_SET_INFO):
                if (unlocked_copy_from_user
                    (&info, (FusionEntryInfo *) arg, sizeof(info)))
@@ -647,6 +816,9 @@ lounge_ioctl(FusionDev * dev, Fusionee * fusionee,
 
                return 0;
           }
+
+          case _IOC_NR(FUSION_BATCH):
+               return fusion_batch(dev, fusionee, (FusionBatch *) arg);
      }
 
      return -ENOSYS;
@@ -691,8 +863,10 @@ call_ioctl(FusionDev * dev, Fusionee * fusionee,
      FusionCallExecute2  execute2;
      FusionCallExecute3  execute3;
      FusionCallExecute3 *execute3_bin;
+     size_t              execute3_size;
      FusionCallReturn    call_ret;
      FusionCallReturn3   call_ret3;
+     FusionCallReturnReceive ret_recv;
      FusionCallGetOwner  get_owner;
      FusionCallSetQuota  set_quota;
      FusionID            fusion_id = fusionee_id(fusionee);
@@ -764,18 +938,30 @@ call_ioctl(FusionDev * dev, Fusionee * fusionee,
                return 0;
 
           case _IOC_NR(FUSION_CALL_EXECUTE3):
-               execute3_bin = (FusionCallExecute3 *) arg;
+               execute3_bin  = (FusionCallExecute3 *) arg;
+               execute3_size = _IOC_SIZE(cmd);
+
+               /* Binaries built before the timeout was added pass the shorter struct. */
+               if (execute3_size > sizeof(execute3))
+                    execute3_size = sizeof(execute3);
+               else if (execute3_size < offsetof(FusionCallExecute3, timeout_ms))
+                    return -EINVAL;
+
+               memset( &execute3, 0, sizeof(execute3) );
 
                while (1) {
-                    if (unlocked_copy_from_user(&execute3, execute3_bin, sizeof(execute3)))
+                    if (unlocked_copy_from_user(&execute3, execute3_bin, execute3_size))
                          return -EFAULT;
 
+                    if (execute3.flags & FCEF_TIMEOUT && execute3_size < sizeof(execute3))
+                         return -EINVAL;
+
                     if (!(execute3.flags & FCEF_DONE)) {
                          if (execute3.flags & FCEF_ERROR) {
                               printk( KERN_ERR "fusion: FUSION_CALL_EXECUTE3 with errorneous call (failed on previous ioctl call), "
                                                "call id %d, flags 0x%08x, arg %d, length %u, serial %u,  %ld\n",
                                       execute3.call_id, execute3.flags, execute3.call_arg, execute3.length, execute3.ret_length,
-                                      (execute3_bin - (FusionCallExecute3 *) arg) );
+                                      (long) (((char *) execute3_bin - (char *) arg) / _IOC_SIZE(cmd)) );
                               return -EIO;
                          }
 
@@ -785,7 +971,7 @@ call_ioctl(FusionDev * dev, Fusionee * fusionee,
                                    execute3.flags |= FCEF_ERROR;
 
                               // TODO: OPTIMIZE: copy whole array at once outside of while loop
-                              if (unlocked_copy_to_user(execute3_bin, &execute3, sizeof(execute3)))
+                              if (unlocked_copy_to_user(execute3_bin, &execute3, execute3_size))
                                    return -EFAULT;
 
                               return ret;
@@ -794,14 +980,14 @@ call_ioctl(FusionDev * dev, Fusionee * fusionee,
                          execute3.flags |= FCEF_DONE;
 
                          // TODO: OPTIMIZE: copy whole array at once outside of while loop
-                         if (unlocked_copy_to_user(execute3_bin, &execute3, sizeof(execute3)))
+                         if (unlocked_copy_to_user(execute3_bin, &execute3, execute3_size))
                               return -EFAULT;
                     }
 
-                    if (!(execute3_bin->flags & FCEF_FOLLOW))
+                    if (!(execute3.flags & FCEF_FOLLOW))
                          break;
 
-                    execute3_bin++;
+                    execute3_bin = (FusionCallExecute3 *) ((char *) execute3_bin + _IOC_SIZE(cmd));
                }
                return 0;
 
@@ -812,6 +998,35 @@ call_ioctl(FusionDev * dev, Fusionee * fusionee,
 
                return fusion_call_return3(dev, fusion_id, &call_ret3);
 
+          case _IOC_NR(FUSION_CALL_RETURN_AND_RECEIVE):
+               if (unlocked_copy_from_user
+                   (&ret_recv, (FusionCallReturnReceive *) arg, sizeof(ret_recv)))
+                    return -EFAULT;
+
+               ret_recv.ret_result = 0;
+
+               /* The first one of a dispatcher has nothing to return. */
+               if (ret_recv.ret.call_id) {
+                    if (dev->secure) {
+                         ret = check_entry_permission( &dev->call, fusionee, cmd, ret_recv.ret.call_id );
+                         if (ret)
+                              return ret;
+                    }
+
+                    ret_recv.ret_result = fusion_call_return3(dev, fusion_id, &ret_recv.ret);
+               }
+
+               ret = fusionee_get_messages(dev, fusionee, ret_recv.buf, ret_recv.buf_size,
+                                           !(ret_recv.flags & FCRRF_NONBLOCK));
+
+               ret_recv.received = ret > 0 ? ret : 0;
+
+               if (put_user(ret_recv.ret_result, &((FusionCallReturnReceive *) arg)->ret_result) ||
+                   put_user(ret_recv.received, &((FusionCallReturnReceive *) arg)->received))
+                    return -EFAULT;
+
+               return ret < 0 ? ret : 0;
+
           case _IOC_NR(FUSION_CALL_GET_OWNER):
                if (unlocked_copy_from_user
                    (&get_owner, (FusionCallGetOwner *) arg, sizeof(get_owner)))
@@ -850,8 +1065,12 @@ ref_ioctl(FusionDev * dev, Fusionee * fusionee,
      FusionRefWatch   watch;
      FusionRefInherit inherit;
      FusionRefThrow   throw_;
+     FusionRefGetCounter counter;
      FusionID         fusion_id = fusionee_id(fusionee);
 
+     /* Each ref operation comes after the changes logged before, by any fusionee. */
+     fusion_ref_apply_all_deltas(dev);
+
      switch (_IOC_NR(cmd)) {
           case _IOC_NR(FUSION_REF_NEW):
                ret = fusion_ref_new(dev, fusionee, &id);
@@ -937,6 +1156,12 @@ ref_ioctl(FusionDev * dev, Fusionee * fusionee,
 
                return fusion_ref_set_sync(dev, id);
 
+          case _IOC_NR(FUSION_REF_SET_BATCH):
+               if (get_user(id, (int *)arg))
+                    return -EFAULT;
+
+               return fusion_ref_set_batch(dev, id);
+
           case _IOC_NR(FUSION_REF_DESTROY):
                if (get_user(id, (int *)arg))
                     return -EFAULT;
@@ -955,6 +1180,24 @@ ref_ioctl(FusionDev * dev, Fusionee * fusionee,
                     return -EFAULT;
 
                return fusion_ref_throw(dev, throw_.id, fusion_id, throw_.catcher);
+
+          case _IOC_NR(FUSION_REF_GET_COUNTER):
+               if (unlocked_copy_from_user
+                   (&counter, (FusionRefGetCounter *) arg, sizeof(counter)))
+                    return -EFAULT;
+
+               ret = fusion_ref_get_counter(dev, counter.id, &counter.index);
+               if (ret)
+                    return ret;
+
+               if (put_user(counter.index, &((FusionRefGetCounter *) arg)->index))
+                    return -EFAULT;
+
+               return 0;
+
+          case _IOC_NR(FUSION_REF_APPLY_DELTAS):
+               /* Done above. */
+               return 0;
      }
 
      return -ENOSYS;
@@ -968,6 +1211,7 @@ skirmish_ioctl(FusionDev * dev, Fusionee * fusionee,
      int ret;
      int lock_count;
      FusionSkirmishWait wait;
+     FusionSkirmishWord word;
      FusionID fusion_id = fusionee_id(fusionee);
 
      switch (_IOC_NR(cmd)) {
@@ -1034,6 +1278,20 @@ skirmish_ioctl(FusionDev * dev, Fusionee * fusionee,
                     return -EFAULT;
 
                return fusion_skirmish_notify_(dev, id, fusion_id);
+
+          case _IOC_NR(FUSION_SKIRMISH_GET_WORD):
+               if (unlocked_copy_from_user
+                   (&word, (FusionSkirmishWord *) arg, sizeof(word)))
+                    return -EFAULT;
+
+               ret = fusion_skirmish_get_word(dev, word.id, fusionee, &word.index);
+               if (ret)
+                    return ret;
+
+               if (put_user(word.index, &((FusionSkirmishWord *) arg)->index))
+                    return -EFAULT;
+
+               return 0;
      }
 
      return -ENOSYS;
@@ -1133,7 +1391,7 @@ reactor_ioctl(FusionDev * dev, Fusionee * fusionee,
                }
 
                return fusion_reactor_attach(dev, attach.reactor_id,
-                                            attach.channel, fusion_id);
+                                            attach.channel, fusionee);
 
           case _IOC_NR(FUSION_REACTOR_DETACH):
                if (dev->api.major <= 4) {
@@ -1229,7 +1487,7 @@ shmpool_ioctl(FusionDev * dev, Fusionee * fusionee,
                                   (FusionSHMPoolAttach *) arg, sizeof(attach)))
                     return -EFAULT;
 
-               ret = fusion_shmpool_attach(dev, &attach, fusion_id);
+               ret = fusion_shmpool_attach(dev, &attach, fusionee);
                if (ret)
                     return ret;
 
@@ -1271,23 +1529,37 @@ shmpool_ioctl(FusionDev * dev, Fusionee * fusionee,
      return -ENOSYS;
 }
 
+static int
+check_entry_permission( FusionEntries *entries,
+                        Fusionee      *fusionee,
+                        unsigned int   cmd,
+                        int            entry_id )
+{
+     FusionID fusion_id = fusionee_id( fusionee );
+
+     /* Master can do everything */
+     if (fusion_id == FUSION_ID_MASTER)
+          return 0;
+
+     /* Lookup entry and check permission bits */
+     return fusion_entry_check_permissions( entries, entry_id, fusion_id, _IOC_NR( cmd ) );
+}
+
 static int
 check_permission( FusionEntries *entries,
                   Fusionee      *fusionee,
                   unsigned int   cmd,
                   unsigned long  arg )
 {
-     int      ret;
-     FusionID fusion_id = fusionee_id( fusionee );
-     int      nr        = _IOC_NR( cmd );
-     int      entry_id;
+     int ret;
+     int entry_id;
 
      /* Master can do everything */
-     if (fusion_id == FUSION_ID_MASTER)
+     if (fusionee_id( fusionee ) == FUSION_ID_MASTER)
           return 0;
 
      /* Allow _NEW for now */
-     if (!nr)
+     if (!_IOC_NR( cmd ))
           return 0;
 
      /* Get Entry ID */
@@ -1295,28 +1567,17 @@ check_permission( FusionEntries *entries,
      if (ret)
           return ret;
 
-     /* Lookup entry and check permission bits */
-     return fusion_entry_check_permissions( entries, entry_id, fusion_id, nr );
+     return check_entry_permission( entries, fusionee, cmd, entry_id );
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
-static long
-fusion_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
-#else
+/*
+ * Called with the world locked and a reference to the fusionee.
+ */
 static int
-fusion_ioctl(struct inode *inode, struct file *file,
-             unsigned int cmd, unsigned long arg)
-#endif
+fusion_ioctl_locked(FusionDev * dev, Fusionee * fusionee,
+                    unsigned int cmd, unsigned long arg)
 {
-     int        ret      = -ENOSYS;
-     Fusionee  *fusionee = file->private_data;
-     FusionDev *dev      = fusionee->fusion_dev;
-
-//     FUSION_DEBUG("fusion_ioctl (0x%08x)\n", cmd);
-
-     fusion_core_lock( fusion_core );
-
-     fusionee_ref( fusionee );
+     int ret = -ENOSYS;
 
      switch (_IOC_TYPE(cmd)) {
           case FT_LOUNGE:
@@ -1328,7 +1589,8 @@ fusion_ioctl(struct inode *inode, struct file *file,
                break;
 
           case FT_CALL:
-               if (dev->secure) {
+               /* FUSION_CALL_RETURN_AND_RECEIVE is checked on the copy in call_ioctl(). */
+               if (dev->secure && _IOC_NR(cmd) != _IOC_NR(FUSION_CALL_RETURN_AND_RECEIVE)) {
                     ret = check_permission( &dev->call, fusionee, cmd, arg );
                     if (ret)
                          break;
@@ -1337,7 +1599,7 @@ fusion_ioctl(struct inode *inode, struct file *file,
                break;
 
           case FT_REF:
-               if (dev->secure) {
+               if (dev->secure && _IOC_NR(cmd) != _IOC_NR(FUSION_REF_APPLY_DELTAS)) {
                     ret = check_permission( &dev->ref, fusionee, cmd, arg );
                     if (ret)
                          break;
@@ -1382,9 +1644,33 @@ fusion_ioctl(struct inode *inode, struct file *file,
                break;
      }
 
+     return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+static long
+fusion_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+#else
+static int
+fusion_ioctl(struct inode *inode, struct file *file,
+             unsigned int cmd, unsigned long arg)
+#endif
+{
+     int        ret;
+     Fusionee  *fusionee = file->private_data;
+     FusionDev *dev      = fusionee->fusion_dev;
+
+//     FUSION_DEBUG("fusion_ioctl (0x%08x)\n", cmd);
+
+     fusion_dev_lock( dev );
+
+     fusionee_ref( fusionee );
+
+     ret = fusion_ioctl_locked(dev, fusionee, cmd, arg);
+
      fusionee_unref( fusionee );
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      return ret;
 }
@@ -1397,7 +1683,39 @@ static int fusion_mmap(struct file *file, struct vm_area_struct *vma)
      Fusionee     *fusionee = file->private_data;
      FusionDev    *dev      = fusionee->fusion_dev;
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
+
+     if (vma->vm_pgoff == FUSION_MMAP_RECEIVE_RING) {
+          ret = fusionee_map_ring(dev, fusionee, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
+     if (vma->vm_pgoff == FUSION_MMAP_SKIRMISH_WORDS) {
+          ret = fusion_skirmish_map_words(dev, fusionee, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
+     if (vma->vm_pgoff == FUSION_MMAP_REF_COUNTERS) {
+          ret = fusion_ref_map_counters(dev, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
+     if (vma->vm_pgoff == FUSION_MMAP_REF_DELTAS) {
+          ret = fusion_ref_map_deltas(dev, fusionee, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
 
      // FIXME: compile switch!
      vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
@@ -1408,19 +1726,19 @@ static int fusion_mmap(struct file *file, struct vm_area_struct *vma)
      else {
           size = vma->vm_end - vma->vm_start;
           if (!size || size > PAGE_SIZE) {
-               fusion_core_unlock( fusion_core );
+               fusion_dev_unlock( dev );
                return -EINVAL;
           }
 
           if (!dev->shared_area) {
                if (fusionee_id(fusionee) != FUSION_ID_MASTER) {
-                    fusion_core_unlock( fusion_core );
+                    fusion_dev_unlock( dev );
                     return -EPERM;
                }
 
                dev->shared_area = fusion_core_malloc( fusion_core, PAGE_SIZE );
                if (!dev->shared_area) {
-                    fusion_core_unlock( fusion_core );
+                    fusion_dev_unlock( dev );
                     return -ENOMEM;
                }
           }
@@ -1437,7 +1755,7 @@ static int fusion_mmap(struct file *file, struct vm_area_struct *vma)
 #endif
      }
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      return ret;
 }
@@ -1449,6 +1767,46 @@ static int fusion_mmap(struct file *file, struct vm_area_struct *vma)
      FusionDev *dev      = fusionee->fusion_dev;
      unsigned int size;
 
+     if (vma->vm_pgoff == FUSION_MMAP_RECEIVE_RING) {
+          fusion_dev_lock( dev );
+
+          ret = fusionee_map_ring(dev, fusionee, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
+     if (vma->vm_pgoff == FUSION_MMAP_SKIRMISH_WORDS) {
+          fusion_dev_lock( dev );
+
+          ret = fusion_skirmish_map_words(dev, fusionee, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
+     if (vma->vm_pgoff == FUSION_MMAP_REF_COUNTERS) {
+          fusion_dev_lock( dev );
+
+          ret = fusion_ref_map_counters(dev, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
+     if (vma->vm_pgoff == FUSION_MMAP_REF_DELTAS) {
+          fusion_dev_lock( dev );
+
+          ret = fusion_ref_map_deltas(dev, fusionee, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
      if (vma->vm_pgoff != 0)
           return -EINVAL;
 
@@ -1459,17 +1817,17 @@ static int fusion_mmap(struct file *file, struct vm_area_struct *vma)
      if (fusionee_id(fusionee) != FUSION_ID_MASTER && (vma->vm_flags & VM_WRITE))
           return -EPERM;
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      if (!dev->shared_area) {
           if (fusionee_id(fusionee) != FUSION_ID_MASTER) {
-               fusion_core_unlock( fusion_core );
+               fusion_dev_unlock( dev );
                return -EPERM;
           }
 
           dev->shared_area = get_zeroed_page(GFP_ATOMIC);
           if (!dev->shared_area) {
-               fusion_core_unlock( fusion_core );
+               fusion_dev_unlock( dev );
                return -ENOMEM;
           }
 
@@ -1486,7 +1844,7 @@ static int fusion_mmap(struct file *file, struct vm_area_struct *vma)
                                PAGE_SIZE, vma->vm_page_prot);
 #endif
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      return ret;
 }
@@ -1602,6 +1960,49 @@ ulong cpu;
 module_param( cpu, ulong, 0 );
 MODULE_PARM_DESC( cpu, "CPU index");
 
+static int __init fusion_caches_init(void)
+{
+     int ret;
+
+     ret = fusionee_caches_init();
+     if (ret)
+          goto error_fusionee;
+
+     ret = fusion_call_caches_init();
+     if (ret)
+          goto error_call;
+
+     ret = fusion_reactor_caches_init();
+     if (ret)
+          goto error_reactor;
+
+     ret = fusion_ref_caches_init();
+     if (ret)
+          goto error_ref;
+
+     return 0;
+
+error_ref:
+     fusion_reactor_caches_deinit();
+
+error_reactor:
+     fusion_call_caches_deinit();
+
+error_call:
+     fusionee_caches_deinit();
+
+error_fusionee:
+     return ret;
+}
+
+static void fusion_caches_deinit(void)
+{
+     fusion_ref_caches_deinit();
+     fusion_reactor_caches_deinit();
+     fusion_call_caches_deinit();
+     fusionee_caches_deinit();
+}
+
 int __init fusion_init(void)
 {
      int ret;
@@ -1634,10 +2035,16 @@ int __init fusion_init(void)
           fusion_core_set_pointer( fusion_core, 0, shared );
      }
 
-     ret = register_devices();
+     ret = fusion_caches_init();
      if (ret)
           return ret;
 
+     ret = register_devices();
+     if (ret) {
+          fusion_caches_deinit();
+          return ret;
+     }
+
      proc_fusion_dir = proc_mkdir("fusion", NULL);
 
      return 0;
@@ -1698,6 +2105,8 @@ void __exit fusion_exit(void)
 
      remove_proc_entry("fusion", NULL);
 
+     fusion_caches_deinit();
+
      fusion_core_free( fusion_core, shared );
 
      fusion_core_exit( fusion_core );
@@ -28,14 +28,19 @@
 #define NUM_MINORS  32
 #define NUM_CLASSES 8
 
-#define CACHE_EXECUTIONS_NUM      10
-#define CACHE_EXECUTIONS_DATA_LEN 20
+#define CACHE_EXECUTIONS_NUM      10      /* free executions kept per CPU and size class */
+#define CACHE_EXECUTIONS_CLASSES  4       /* size classes of return data, see call.c */
 
 typedef struct __Fusion_FusionShared FusionShared;
+typedef struct __Fusion_SkirmishWords SkirmishWords;
+typedef struct __Fusion_RefCounters RefCounters;
+typedef struct __Fusion_ExecutionPool ExecutionPool;
 
 struct __Fusion_FusionDev {
      FusionShared *shared;
 
+     FusionMutex lock;      /* protects the whole world, see fusion_dev_lock() */
+
      int refs;
      int index;
      struct {
@@ -67,6 +72,7 @@ struct __Fusion_FusionDev {
 
           int ref_catch;
           int ref_throw;
+          int ref_push;            /* inheritors told about a ref reaching or leaving zero */
 
           int skirmish_prevail_swoop;
           int skirmish_dismiss;
@@ -80,6 +86,7 @@ struct __Fusion_FusionDev {
      struct {
           int last_id;
           FusionLink *list;
+          FusionHash *hash;             /* id -> Fusionee, once entered */
           FusionWaitQueue wait;
      } fusionee;
 
@@ -90,8 +97,21 @@ struct __Fusion_FusionDev {
      FusionEntries shmpool;
      FusionEntries skirmish;
 
-     FusionLink   *execution_free_list;
-     unsigned int  execution_free_list_num;
+     SkirmishWords *skirmish_words;     /* lock words shared with user space, see skirmish.c */
+
+     RefCounters   *ref_counters;       /* ref counters shared with user space, see ref.c */
+
+     struct {
+          bool        active;               /* in fusion_ref_clear_all_local() */
+          FusionLink *list;                 /* zero notifications of each call, see ref.c */
+     } ref_batch;
+
+     struct {
+          FusionHash *hash;                 /* pid -> skirmishs held or transferred, see skirmish.c */
+          int         lost;                 /* out of memory, index is incomplete */
+     } skirmish_holders;
+
+     ExecutionPool *execution_pools;    /* free executions per CPU, see call.c */
 
      unsigned int  next_class_index;
 
@@ -121,4 +141,21 @@ extern struct proc_dir_entry *fusion_proc_dir[NUM_MINORS];
 extern unsigned long fusion_shm_base;
 extern unsigned long fusion_shm_size;
 
+
+/*
+ * Each world has its own lock, fusion_core_lock() is only used for
+ * opening and releasing worlds. Lock order is core -> dev.
+ */
+static inline void
+fusion_dev_lock( FusionDev *dev )
+{
+     fusion_core_mutex_lock( fusion_core, &dev->lock );
+}
+
+static inline void
+fusion_dev_unlock( FusionDev *dev )
+{
+     fusion_core_mutex_unlock( fusion_core, &dev->lock );
+}
+
 #endif
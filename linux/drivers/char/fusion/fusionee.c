@@ -26,7 +26,10 @@
 #include <linux/smp_lock.h>
 #endif
 #include <linux/sched.h>
+#include <linux/mm.h>
+#include <linux/module.h>
 #include <asm/uaccess.h>
+#include <asm/io.h>
 
 #include <linux/fusion.h>
 
@@ -35,6 +38,7 @@
 #include "list.h"
 #include "fusiondev.h"
 #include "fusionee.h"
+#include "hash.h"
 #include "property.h"
 #include "reactor.h"
 #include "ref.h"
@@ -58,20 +62,211 @@ typedef struct {
      int                    param;
 } MessageCallback;
 
+/*
+ * Messages are queued in packets of up to FUSION_MAX_PACKET_SIZE bytes, larger
+ * messages get a packet of their own. The data is kept in a chain of chunks of
+ * different size classes, so small messages don't pin a large buffer.
+ */
 #define FUSION_MAX_PACKET_SIZE	16384
 
+#define PACKET_CHUNK_CLASSES     4
+
+static const size_t packet_chunk_sizes[PACKET_CHUNK_CLASSES] = { 256, 1024, 4096, 16384 };
+static const char  *packet_chunk_names[PACKET_CHUNK_CLASSES] = { "fusion_chunk_256",  "fusion_chunk_1k",
+                                                                 "fusion_chunk_4k",   "fusion_chunk_16k" };
+
+/* Shared message data of at least this size is referenced instead of copied. */
+#define PACKET_SHARE_MIN         256
+
+struct __Fusion_MessageData {
+     int                  refs;          /* protected by the world lock */
+     int                  size;
+
+     /* data follows */
+};
+
+#define MESSAGE_DATA(data)  ((char*)((data) + 1))
+
+typedef struct {
+     FusionLink           link;
+
+     int                  klass;         /* -1 if referencing shared data */
+     size_t               size;          /* capacity */
+     size_t               length;        /* bytes written */
+
+     MessageData         *shared;
+
+     /* data follows, unless shared */
+} PacketChunk;
+
+#define PACKET_CHUNK_DATA(chunk)  ((chunk)->shared ? MESSAGE_DATA((chunk)->shared) : (char*)((chunk) + 1))
+
 typedef struct {
      FusionLink           link;
 
      int                  magic;
 
-     char                 buf[FUSION_MAX_PACKET_SIZE];
+     FusionLink          *chunks;
      size_t               size;
      bool                 flush;
+     int                  prio;          /* real time priority of an urgent call */
+
+     FusionID             sender;        /* of the first message, zero for fusion */
+     bool                 senders;       /* messages from others follow */
 
      FusionFifo           callbacks;
 } Packet;
 
+/*
+ * A dispatcher keeps the packets it has read until it comes back for more. Threads
+ * registered with FUSION_DISPATCHER_ENTER have their own, all others share one, like
+ * a single reader. With more than one, a packet is only handed out if none of its
+ * messages has the type and ID of one being processed by another dispatcher, so the
+ * messages of each call, reactor etc. are still processed in order.
+ */
+typedef struct {
+     FusionLink           link;
+
+     pid_t                pid;           /* fusion_core_pid() of the thread, the last reader if shared */
+     struct pid          *tid;           /* reference to the thread */
+     bool                 shared;        /* used by all threads that have not registered */
+
+     FusionFifo           packets;       /* read and being processed */
+} Dispatcher;
+
+/******************************************************************************/
+
+static FusionCache packet_cache;
+static FusionCache chunk_caches[PACKET_CHUNK_CLASSES];
+static FusionCache chunk_ref_cache;
+static FusionCache callback_cache;
+
+/* Number of free packets/callbacks each fusionee keeps for reuse. */
+static int fusion_packet_pool   = 12;
+static int fusion_callback_pool = 32;
+
+module_param( fusion_packet_pool, int, S_IRUGO | S_IWUSR );
+MODULE_PARM_DESC( fusion_packet_pool, "Number of free packets kept per fusionee" );
+
+module_param( fusion_callback_pool, int, S_IRUGO | S_IWUSR );
+MODULE_PARM_DESC( fusion_callback_pool, "Number of free message callbacks kept per fusionee" );
+
+int fusionee_caches_init(void)
+{
+     int i;
+
+     if (fusion_core_cache_init( fusion_core, &packet_cache, "fusion_packet", sizeof(Packet) ))
+          return -ENOMEM;
+
+     for (i = 0; i < PACKET_CHUNK_CLASSES; i++) {
+          if (fusion_core_cache_init( fusion_core, &chunk_caches[i], packet_chunk_names[i],
+                                      sizeof(PacketChunk) + packet_chunk_sizes[i] ))
+               goto error_chunks;
+     }
+
+     if (fusion_core_cache_init( fusion_core, &chunk_ref_cache, "fusion_chunk_ref", sizeof(PacketChunk) ))
+          goto error_chunks;
+
+     if (fusion_core_cache_init( fusion_core, &callback_cache, "fusion_callback", sizeof(MessageCallback) ))
+          goto error_callback;
+
+     return 0;
+
+error_callback:
+     fusion_core_cache_deinit( fusion_core, &chunk_ref_cache );
+
+error_chunks:
+     while (i--)
+          fusion_core_cache_deinit( fusion_core, &chunk_caches[i] );
+
+     fusion_core_cache_deinit( fusion_core, &packet_cache );
+
+     return -ENOMEM;
+}
+
+void fusionee_caches_deinit(void)
+{
+     int i;
+
+     fusion_core_cache_deinit( fusion_core, &callback_cache );
+     fusion_core_cache_deinit( fusion_core, &chunk_ref_cache );
+
+     for (i = 0; i < PACKET_CHUNK_CLASSES; i++)
+          fusion_core_cache_deinit( fusion_core, &chunk_caches[i] );
+
+     fusion_core_cache_deinit( fusion_core, &packet_cache );
+}
+
+/******************************************************************************/
+
+/*
+ * Returns a chunk of the smallest class holding 'need' bytes, or the largest one.
+ */
+static PacketChunk *
+PacketChunk_New( size_t need )
+{
+     int          klass;
+     PacketChunk *chunk;
+
+     for (klass = 0; klass < PACKET_CHUNK_CLASSES - 1; klass++) {
+          if (packet_chunk_sizes[klass] >= need)
+               break;
+     }
+
+     chunk = fusion_core_cache_alloc( fusion_core, &chunk_caches[klass] );
+     if (!chunk)
+          return NULL;
+
+     chunk->link.magic = 0;
+     chunk->link.prev  = NULL;
+     chunk->link.next  = NULL;
+
+     chunk->klass  = klass;
+     chunk->size   = packet_chunk_sizes[klass];
+     chunk->length = 0;
+     chunk->shared = NULL;
+
+     return chunk;
+}
+
+/*
+ * Returns a chunk referencing the shared data.
+ */
+static PacketChunk *
+PacketChunk_NewShared( MessageData *data )
+{
+     PacketChunk *chunk;
+
+     chunk = fusion_core_cache_alloc( fusion_core, &chunk_ref_cache );
+     if (!chunk)
+          return NULL;
+
+     chunk->link.magic = 0;
+     chunk->link.prev  = NULL;
+     chunk->link.next  = NULL;
+
+     chunk->klass  = -1;
+     chunk->size   = data->size;
+     chunk->length = data->size;
+     chunk->shared = data;
+
+     data->refs++;
+
+     return chunk;
+}
+
+static void
+PacketChunk_Free( PacketChunk *chunk )
+{
+     if (chunk->shared) {
+          fusionee_message_data_unref( chunk->shared );
+
+          fusion_core_cache_free( fusion_core, &chunk_ref_cache, chunk );
+     }
+     else
+          fusion_core_cache_free( fusion_core, &chunk_caches[chunk->klass], chunk );
+}
+
 /******************************************************************************/
 
 static Packet *
@@ -81,7 +276,7 @@ Packet_New( void )
 
      FUSION_DEBUG( "%s()\n", __FUNCTION__ );
 
-     packet = fusion_core_malloc( fusion_core, sizeof(Packet) );
+     packet = fusion_core_cache_alloc( fusion_core, &packet_cache );
      if (!packet)
           return NULL;
 
@@ -89,8 +284,11 @@ Packet_New( void )
      packet->link.prev  = NULL;
      packet->link.next  = NULL;
 
+     packet->chunks    = NULL;
      packet->size      = 0;
      packet->flush     = false;
+     packet->prio      = 0;
+     packet->senders   = false;
 
      fusion_fifo_reset( &packet->callbacks );
 
@@ -99,6 +297,30 @@ Packet_New( void )
      return packet;
 }
 
+/*
+ * Drops all data, keeping the first chunk if it's one of the smallest.
+ */
+static void
+Packet_Reset( Packet *packet )
+{
+     PacketChunk *chunk, *next;
+
+     D_MAGIC_ASSERT( packet, Packet );
+
+     direct_list_foreach_safe (chunk, next, packet->chunks) {
+          if (chunk == (PacketChunk *) packet->chunks && chunk->klass == 0) {
+               chunk->length = 0;
+               continue;
+          }
+
+          direct_list_remove( &packet->chunks, &chunk->link );
+
+          PacketChunk_Free( chunk );
+     }
+
+     packet->size = 0;
+}
+
 static void
 Packet_Free( Packet *packet )
 {
@@ -116,10 +338,161 @@ Packet_Free( Packet *packet )
      while ((callback = (MessageCallback *) fusion_fifo_get(&packet->callbacks)) != NULL) {
           D_MAGIC_ASSERT( packet, Packet );
 
-          fusion_core_free( fusion_core,  callback );
+          fusion_core_cache_free( fusion_core, &callback_cache, callback );
+     }
+
+     while (packet->chunks) {
+          PacketChunk *chunk = (PacketChunk *) packet->chunks;
+
+          direct_list_remove( &packet->chunks, &chunk->link );
+
+          PacketChunk_Free( chunk );
+     }
+
+     fusion_core_cache_free( fusion_core, &packet_cache, packet );
+}
+
+/*
+ * Appends data, allocating chunks as needed. The 'need' bytes still to be
+ * written by the caller (at least 'length') are used to pick the chunk size.
+ */
+static int
+Packet_Append( Packet     *packet,
+               const void *data,
+               size_t      length,
+               size_t      need,
+               bool        from_user )
+{
+     const char *src = data;
+
+     while (length) {
+          PacketChunk *chunk = (PacketChunk *) direct_list_last( packet->chunks );
+          size_t       bytes;
+
+          if (!chunk || chunk->length == chunk->size) {
+               /* Grow along with the packet. */
+               chunk = PacketChunk_New( need > packet->size ? need : packet->size );
+               if (!chunk)
+                    return -ENOMEM;
+
+               direct_list_append( &packet->chunks, &chunk->link );
+          }
+
+          bytes = chunk->size - chunk->length;
+          if (bytes > length)
+               bytes = length;
+
+          if (from_user) {
+               if (copy_from_user( PACKET_CHUNK_DATA(chunk) + chunk->length, src, bytes ))
+                    return -EFAULT;
+          }
+          else
+               memcpy( PACKET_CHUNK_DATA(chunk) + chunk->length, src, bytes );
+
+          chunk->length += bytes;
+          packet->size  += bytes;
+
+          src    += bytes;
+          length -= bytes;
+          need   -= bytes;
+     }
+
+     return 0;
+}
+
+static int
+Packet_AppendShared( Packet      *packet,
+                     MessageData *data )
+{
+     PacketChunk *chunk;
+
+     chunk = PacketChunk_NewShared( data );
+     if (!chunk)
+          return -ENOMEM;
+
+     direct_list_append( &packet->chunks, &chunk->link );
+
+     packet->size += chunk->length;
+
+     return 0;
+}
+
+/*
+ * Cuts the packet back to 'size' bytes, e.g. after a failed Packet_Write().
+ */
+static void
+Packet_Truncate( Packet *packet,
+                 size_t  size )
+{
+     while (packet->size > size) {
+          PacketChunk *chunk = (PacketChunk *) direct_list_last( packet->chunks );
+
+          D_ASSERT( chunk != NULL );
+
+          if (packet->size - chunk->length >= size) {
+               packet->size -= chunk->length;
+
+               direct_list_remove( &packet->chunks, &chunk->link );
+
+               PacketChunk_Free( chunk );
+          }
+          else {
+               chunk->length -= packet->size - size;
+               packet->size   = size;
+          }
      }
+}
+
+/*
+ * Copies 'length' bytes at 'offset' out of the packet.
+ */
+static void
+Packet_Read( Packet *packet,
+             size_t  offset,
+             void   *dst,
+             size_t  length )
+{
+     char        *buf = dst;
+     PacketChunk *chunk;
+
+     direct_list_foreach (chunk, packet->chunks) {
+          size_t bytes;
+
+          if (!length)
+               break;
 
-     fusion_core_free( fusion_core,  packet );
+          if (offset >= chunk->length) {
+               offset -= chunk->length;
+               continue;
+          }
+
+          bytes = chunk->length - offset;
+          if (bytes > length)
+               bytes = length;
+
+          memcpy( buf, PACKET_CHUNK_DATA(chunk) + offset, bytes );
+
+          buf    += bytes;
+          length -= bytes;
+          offset  = 0;
+     }
+}
+
+static int
+Packet_CopyToUser( Packet *packet,
+                   void   *buf )
+{
+     char        *dst = buf;
+     PacketChunk *chunk;
+
+     direct_list_foreach (chunk, packet->chunks) {
+          if (copy_to_user( dst, PACKET_CHUNK_DATA(chunk), chunk->length ))
+               return -EFAULT;
+
+          dst += chunk->length;
+     }
+
+     return 0;
 }
 
 static int
@@ -129,48 +502,77 @@ Packet_Write( Packet     *packet,
               int         channel,
               const void *msg_data,
               int         msg_size,
+              MessageData *shared,
               const void *extra_data,
               int         extra_size,
               bool        from_user )
 {
+     int                ret;
      size_t             total   = sizeof(FusionReadMessage) + msg_size + extra_size;
      size_t             aligned = (total + 3) & ~3;
-     FusionReadMessage *header  = (FusionReadMessage *)( packet->buf + packet->size );
+     FusionReadMessage  header;
+     static const char  padding[4];
 
      FUSION_DEBUG( "%s( %p, msg_id %d, channel %d, size %d, extra %d, total %zu )\n",
                    __FUNCTION__, packet, msg_id, channel, msg_size, extra_size, total );
 
      D_MAGIC_ASSERT( packet, Packet );
 
-     FUSION_ASSERT( packet->size + aligned <= FUSION_MAX_PACKET_SIZE );
+     header.msg_type    = type;
+     header.msg_id      = msg_id;
+     header.msg_channel = channel;
+     header.msg_size    = msg_size + extra_size;
 
-     header->msg_type    = type;
-     header->msg_id      = msg_id;
-     header->msg_channel = channel;
-     header->msg_size    = msg_size + extra_size;
+     ret = Packet_Append( packet, &header, sizeof(header), aligned, false );
+     if (ret)
+          return ret;
 
-     if (from_user) {
-          if (copy_from_user( header + 1, msg_data, msg_size ))
-               return -EFAULT;
-     }
+     if (shared && msg_size >= PACKET_SHARE_MIN)
+          ret = Packet_AppendShared( packet, shared );
      else
-          memcpy( header + 1, msg_data, msg_size );
+          ret = Packet_Append( packet, msg_data, msg_size, aligned - sizeof(header), from_user );
+     if (ret)
+          return ret;
 
      if (extra_data && extra_size) {
-          if (copy_from_user( (char*)(header + 1) + msg_size, extra_data, extra_size ))
-               return -EFAULT;
+          ret = Packet_Append( packet, extra_data, extra_size, aligned - sizeof(header) - msg_size, true );
+          if (ret)
+               return ret;
      }
 
-     while (total < aligned)
-          packet->buf[packet->size + total++] = 0;
+     return Packet_Append( packet, padding, aligned - total, aligned - total, false );
+}
 
-     packet->size += aligned;
+static MessageCallback *
+Fusionee_GetCallback( Fusionee *fusionee )
+{
+     MessageCallback *callback;
 
-     return 0;
+     callback = (MessageCallback *) fusion_fifo_get( &fusionee->free_callbacks );
+     if (!callback) {
+          callback = fusion_core_cache_alloc( fusion_core, &callback_cache );
+          if (!callback)
+               return NULL;
+     }
+
+     memset( callback, 0, sizeof(MessageCallback) );
+
+     return callback;
+}
+
+static void
+Fusionee_PutCallback( Fusionee        *fusionee,
+                      MessageCallback *callback )
+{
+     if (fusionee->free_callbacks.count >= fusion_callback_pool)
+          fusion_core_cache_free( fusion_core, &callback_cache, callback );
+     else
+          fusion_fifo_put( &fusionee->free_callbacks, &callback->link );
 }
 
 static int
-Packet_AddCallback( Packet                *packet,
+Packet_AddCallback( Fusionee              *fusionee,
+                    Packet                *packet,
                     int                    msg_id,
                     FusionMessageCallback  func,
                     void                  *ctx,
@@ -182,7 +584,17 @@ Packet_AddCallback( Packet                *packet,
 
      D_MAGIC_ASSERT( packet, Packet );
 
-     callback = fusion_core_malloc( fusion_core, sizeof(MessageCallback) );
+     /* Quota callbacks for the same caller just add up. */
+     if (func == FMC_CALL_QUOTA && packet->callbacks.count) {
+          callback = (MessageCallback *) direct_list_last( packet->callbacks.items );
+
+          if (callback->func_index == func && callback->ctx == ctx && callback->msg_id == msg_id) {
+               callback->param += param;
+               return 0;
+          }
+     }
+
+     callback = Fusionee_GetCallback( fusionee );
      if (!callback)
           return -ENOMEM;
 
@@ -198,6 +610,7 @@ Packet_AddCallback( Packet                *packet,
 
 static int
 Packet_RunCallbacks( FusionDev *dev,
+                     Fusionee  *fusionee,
                      Packet    *packet )
 {
      MessageCallback *callback;
@@ -215,7 +628,7 @@ Packet_RunCallbacks( FusionDev *dev,
                fusion_message_callbacks[callback->func_index]( dev, callback->msg_id, callback->ctx, callback->param );
           }
 
-          fusion_core_free( fusion_core,  callback );
+          Fusionee_PutCallback( fusionee, callback );
      }
 
      return 0;
@@ -226,20 +639,259 @@ Packet_Search( Packet              *packet,
                FusionMessageType    msg_type,
                int                  msg_id )
 {
-     char   *buf = packet->buf;
-     size_t  pos = 0;
+     size_t pos = 0;
 
      FUSION_DEBUG( "%s( %p )\n", __FUNCTION__, packet );
 
      D_MAGIC_ASSERT( packet, Packet );
 
      while (pos < packet->size) {
-          FusionReadMessage *header = (FusionReadMessage *) &buf[pos];
+          FusionReadMessage header;
+
+          Packet_Read( packet, pos, &header, sizeof(header) );
+
+          if (header.msg_type == msg_type && header.msg_id == msg_id)
+               return true;
+
+          pos += sizeof(FusionReadMessage) + ((header.msg_size + 3) & ~3);
+     }
+
+     return false;
+}
+
+/*
+ * Searches a message of that type and ID, having 'value' in the word at 'offset' within the message data.
+ */
+static bool
+Packet_SearchWord( Packet              *packet,
+                   FusionMessageType    msg_type,
+                   int                  msg_id,
+                   size_t               offset,
+                   unsigned int         value )
+{
+     size_t pos = 0;
+
+     D_MAGIC_ASSERT( packet, Packet );
+
+     while (pos < packet->size) {
+          FusionReadMessage header;
+          unsigned int      word;
+
+          Packet_Read( packet, pos, &header, sizeof(header) );
+
+          if (header.msg_type == msg_type && header.msg_id == msg_id && offset + sizeof(word) <= header.msg_size) {
+               Packet_Read( packet, pos + sizeof(FusionReadMessage) + offset, &word, sizeof(word) );
+
+               if (word == value)
+                    return true;
+          }
+
+          pos += sizeof(FusionReadMessage) + ((header.msg_size + 3) & ~3);
+     }
+
+     return false;
+}
+
+/*
+ * Checks if the other packet has a message of the same type and ID as one in the packet.
+ */
+static bool
+Packet_Conflicts( Packet *packet,
+                  Packet *other )
+{
+     size_t pos = 0;
+
+     D_MAGIC_ASSERT( packet, Packet );
+
+     while (pos < packet->size) {
+          FusionReadMessage header;
+
+          Packet_Read( packet, pos, &header, sizeof(header) );
+
+          if (Packet_Search( other, header.msg_type, header.msg_id ))
+               return true;
+
+          pos += sizeof(FusionReadMessage) + ((header.msg_size + 3) & ~3);
+     }
+
+     return false;
+}
+
+/*
+ * Checks if the packet holds nothing but the message of that type and ID,
+ * having 'value' in the word at 'offset' within the message data.
+ */
+static bool
+Packet_IsOnly( Packet              *packet,
+               FusionMessageType    msg_type,
+               int                  msg_id,
+               size_t               offset,
+               unsigned int         value )
+{
+     FusionReadMessage header;
+     unsigned int      word;
+
+     D_MAGIC_ASSERT( packet, Packet );
+
+     if (packet->size < sizeof(FusionReadMessage))
+          return false;
+
+     Packet_Read( packet, 0, &header, sizeof(header) );
+
+     if (header.msg_type != msg_type || header.msg_id != msg_id)
+          return false;
+
+     if (packet->size != sizeof(FusionReadMessage) + ((header.msg_size + 3) & ~3))
+          return false;
+
+     if (offset + sizeof(word) > header.msg_size)
+          return false;
+
+     Packet_Read( packet, sizeof(FusionReadMessage) + offset, &word, sizeof(word) );
+
+     return word == value;
+}
+
+/******************************************************************************/
+
+static Packet *
+Fusionee_NewPacket( Fusionee *fusionee )
+{
+     Packet *packet;
+
+     if (fusionee->free_packets.count) {
+          packet = (Packet*) fusion_fifo_get( &fusionee->free_packets );
+
+          D_MAGIC_ASSERT( packet, Packet );
+     }
+     else
+          packet = Packet_New();
+
+     if (packet) {
+          D_ASSERT( packet->link.prev == NULL );
+          D_ASSERT( packet->link.next == NULL );
+     }
+
+     return packet;
+}
+
+static int
+Fusionee_GetPacket( Fusionee  *fusionee,
+                    size_t     size,
+                    Packet   **ret_packet )
+{
+     Packet *packet;
+
+     FUSION_DEBUG( "%s( %p )\n", __FUNCTION__, fusionee );
+
+     packet = (Packet*) direct_list_last( fusionee->packets.items );
+
+     D_MAGIC_ASSERT_IF( packet, Packet );
+
+     /*
+      * Large messages get a packet of their own. With several dispatchers, so do flushed
+      * ones, as each packet is read by one of them.
+      */
+     if (!packet || (packet->size && packet->size + size > FUSION_MAX_PACKET_SIZE) ||
+         (packet->flush && fusionee->num_dispatchers > 1)) {
+          if (packet) {
+               packet->flush = true;
+
+//               fusion_core_wq_wake( fusion_core, &fusionee->wait_receive);
+               wake_up_interruptible_sync_poll( &fusionee->wait_receive.queue, POLLIN | POLLRDNORM );
+          }
+
+          packet = Fusionee_NewPacket( fusionee );
+          if (!packet)
+               return -ENOMEM;
+
+          fusion_fifo_put( &fusionee->packets, &packet->link );
+     }
+
+     D_MAGIC_ASSERT( packet, Packet );
+
+     *ret_packet = packet;
+
+     return 0;
+}
+
+static void
+Fusionee_PutPacket( Fusionee *fusionee,
+                    Packet   *packet )
+{
+     FUSION_DEBUG( "%s( %p )\n", __FUNCTION__, fusionee );
+
+     D_MAGIC_ASSERT( packet, Packet );
+
+     D_ASSERT( packet->link.prev == NULL );
+     D_ASSERT( packet->link.next == NULL );
+
+     if (fusionee->free_packets.count >= fusion_packet_pool)
+          Packet_Free( packet );
+     else {
+          Packet_Reset( packet );
+
+          packet->flush   = false;
+          packet->prio    = 0;
+          packet->senders = false;
+
+          fusion_fifo_reset( &packet->callbacks );
+
+          fusion_fifo_put( &fusionee->free_packets, &packet->link );
+     }
+}
+
+/*
+ * Returns a new packet for an urgent call, read before all other packets,
+ * but after urgent calls of the same or higher priority.
+ */
+static int
+Fusionee_GetUrgentPacket( Fusionee  *fusionee,
+                          int        prio,
+                          Packet   **ret_packet )
+{
+     Packet *packet;
+     Packet *before;
+
+     FUSION_DEBUG( "%s( %p, prio %d )\n", __FUNCTION__, fusionee, prio );
+
+     packet = Fusionee_NewPacket( fusionee );
+     if (!packet)
+          return -ENOMEM;
+
+     packet->prio = prio;
+
+     direct_list_foreach (before, fusionee->urgent.items) {
+          if (before->prio < prio)
+               break;
+     }
+
+     direct_list_insert( &fusionee->urgent.items, &packet->link, before ? &before->link : NULL );
+
+     fusionee->urgent.count++;
+
+     *ret_packet = packet;
+
+     return 0;
+}
+
+/*
+ * Checks if a message of the sender is queued, which an urgent call must not overtake.
+ */
+static bool
+Fusionee_SenderQueued( Fusionee *fusionee,
+                       FusionID  sender )
+{
+     Packet *packet;
 
-          if (header->msg_type == msg_type && header->msg_id == msg_id)
+     direct_list_foreach (packet, fusionee->urgent.items) {
+          if (packet->size && (packet->senders || packet->sender == sender))
                return true;
+     }
 
-          pos += sizeof(FusionReadMessage) + ((header->msg_size + 3) & ~3);
+     direct_list_foreach (packet, fusionee->packets.items) {
+          if (packet->size && (packet->senders || packet->sender == sender))
+               return true;
      }
 
      return false;
@@ -247,85 +899,124 @@ Packet_Search( Packet              *packet,
 
 /******************************************************************************/
 
+static bool
+Fusionee_RingPending( Fusionee *fusionee )
+{
+     return fusionee->ring.header && fusionee->ring.head != fusionee->ring.header->tail;
+}
+
+/*
+ * Returns -ENOSPC if the message has to be queued as a packet.
+ */
 static int
-Fusionee_GetPacket( Fusionee  *fusionee,
-                    size_t     size,
-                    Packet   **ret_packet )
+Fusionee_WriteRing( Fusionee   *fusionee,
+                    int         type,
+                    int         msg_id,
+                    int         channel,
+                    const void *msg_data,
+                    int         msg_size,
+                    const void *extra_data,
+                    int         extra_size,
+                    bool        from_user )
 {
-     Packet *packet;
+     FusionReadMessage *header;
+     unsigned int       size    = fusionee->ring.size;
+     unsigned int       head    = fusionee->ring.head;
+     unsigned int       used    = head - fusionee->ring.header->tail;
+     unsigned int       offset  = head & (size - 1);
+     size_t             total   = sizeof(FusionReadMessage) + msg_size + extra_size;
+     size_t             aligned = (total + 3) & ~3;
+     size_t             skip    = 0;
 
-     FUSION_DEBUG( "%s( %p )\n", __FUNCTION__, fusionee );
+     FUSION_DEBUG( "%s( %p, msg_id %d, channel %d, size %d, extra %d, used %u )\n",
+                   __FUNCTION__, fusionee, msg_id, channel, msg_size, extra_size, used );
 
-     if (size > FUSION_MAX_PACKET_SIZE)
-          return -E2BIG;
+     /* Tail is written by user space. */
+     if (used > size)
+          return -ENOSPC;
 
-     packet = (Packet*) direct_list_last( fusionee->packets.items );
+     if (offset + aligned > size)
+          skip = size - offset;
 
-     D_MAGIC_ASSERT_IF( packet, Packet );
+     if (used + skip + aligned > size)
+          return -ENOSPC;
 
-     if (!packet || packet->size + size > FUSION_MAX_PACKET_SIZE) {
-          if (packet) {
-               packet->flush = true;
+     if (skip >= sizeof(FusionReadMessage)) {
+          header = (FusionReadMessage *)( fusionee->ring.data + offset );
 
-//               fusion_core_wq_wake( fusion_core, &fusionee->wait_receive);
-               wake_up_interruptible_sync_poll( &fusionee->wait_receive.queue, POLLIN | POLLRDNORM );
-          }
+          header->msg_type    = 0;
+          header->msg_id      = 0;
+          header->msg_channel = 0;
+          header->msg_size    = FUSION_RING_WRAP;
+     }
 
-          if (fusionee->free_packets.count) {
-               packet = (Packet*) fusion_fifo_get( &fusionee->free_packets );
+     header = (FusionReadMessage *)( fusionee->ring.data + ((head + skip) & (size - 1)) );
 
-               D_MAGIC_ASSERT( packet, Packet );
-          }
-          else
-               packet = Packet_New();
-          if (!packet)
-               return -ENOMEM;
+     header->msg_type    = type;
+     header->msg_id      = msg_id;
+     header->msg_channel = channel;
+     header->msg_size    = msg_size + extra_size;
 
-          D_ASSERT( packet->link.prev == NULL );
-          D_ASSERT( packet->link.next == NULL );
+     if (from_user) {
+          if (copy_from_user( header + 1, msg_data, msg_size ))
+               return -EFAULT;
+     }
+     else
+          memcpy( header + 1, msg_data, msg_size );
 
-          fusion_fifo_put( &fusionee->packets, &packet->link );
+     if (extra_data && extra_size) {
+          if (copy_from_user( (char*)(header + 1) + msg_size, extra_data, extra_size ))
+               return -EFAULT;
      }
 
-     D_MAGIC_ASSERT( packet, Packet );
+     while (total < aligned)
+          ((char*) header)[total++] = 0;
 
-     *ret_packet = packet;
+     /* Publish the record after its contents. */
+     smp_wmb();
+
+     fusionee->ring.head         = head + skip + aligned;
+     fusionee->ring.header->head = fusionee->ring.head;
+
+     if (!used)
+          wake_up_interruptible_sync_poll( &fusionee->wait_receive.queue, POLLIN | POLLRDNORM );
 
      return 0;
 }
 
 static void
-Fusionee_PutPacket( Fusionee *fusionee,
-                    Packet   *packet )
+Fusionee_FreeRing( Fusionee *fusionee )
 {
-     FUSION_DEBUG( "%s( %p )\n", __FUNCTION__, fusionee );
+     unsigned long addr;
 
-     D_MAGIC_ASSERT( packet, Packet );
+     if (!fusionee->ring.header)
+          return;
 
-     D_ASSERT( packet->link.prev == NULL );
-     D_ASSERT( packet->link.next == NULL );
+     for (addr = (unsigned long) fusionee->ring.data;
+          addr < (unsigned long) fusionee->ring.data + fusionee->ring.size; addr += PAGE_SIZE)
+          ClearPageReserved( virt_to_page( (void*) addr ) );
 
-     if (fusionee->free_packets.count > 11)
-          Packet_Free( packet );
-     else {
-          packet->size  = 0;
-          packet->flush = false;
+     free_pages( (unsigned long) fusionee->ring.data, get_order( fusionee->ring.size ) );
 
-          fusion_fifo_reset( &packet->callbacks );
+     ClearPageReserved( virt_to_page( fusionee->ring.header ) );
 
-          fusion_fifo_put( &fusionee->free_packets, &packet->link );
-     }
+     free_page( (unsigned long) fusionee->ring.header );
+
+     fusionee->ring.header = NULL;
+     fusionee->ring.data   = NULL;
 }
 
 /******************************************************************************/
 
 static int lookup_fusionee(FusionDev * dev, FusionID id,
                            Fusionee ** ret_fusionee);
-static int lock_fusionee(FusionDev * dev, FusionID id,
-                         Fusionee ** ret_fusionee);
 
 static void flush_packets(Fusionee *fusionee, FusionDev * dev, FusionFifo * fifo);
 static void free_packets(Fusionee *fusionee, FusionDev * dev, FusionFifo * fifo);
+static void flush_dispatchers(Fusionee *fusionee, FusionDev * dev, FusionLink ** dispatchers);
+static void free_dispatchers(Fusionee *fusionee, FusionDev * dev);
+static Dispatcher *Fusionee_LookupDispatcher(Fusionee *fusionee, pid_t pid);
+static void free_callbacks(Fusionee *fusionee);
 
 /******************************************************************************/
 
@@ -335,21 +1026,21 @@ fusionees_proc_show(struct seq_file *m, void *v)
      Fusionee *fusionee;
      FusionDev *dev = m->private;
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      if (!dev->shutdown) {
           direct_list_foreach(fusionee, dev->fusionee.list) {
                seq_printf(m,
                        "(%5d) 0x%08lx (%4d packets waiting, %7ld received, %7ld sent) - wcq 0x%x - '%s'\n",
                        fusionee->pid, fusionee->id,
-                       fusionee->packets.count, atomic_long_read(&fusionee->rcv_total),
+                       fusionee->packets.count + fusionee->urgent.count, atomic_long_read(&fusionee->rcv_total),
                        atomic_long_read(&fusionee->snd_total),
                        fusionee->wait_on_call_quota,
                        fusionee->exe_file);
           }
      }
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      return 0;
 }
@@ -367,8 +1058,13 @@ static const struct file_operations fusionees_proc_fops = {
 
 int fusionee_init(FusionDev * dev)
 {
-     if (!dev->refs)
+     if (!dev->refs) {
+          int ret = fusion_hash_create( FHT_INT, FHT_PTR, 17, &dev->fusionee.hash );
+          if (ret)
+               return ret;
+
           fusion_core_wq_init( fusion_core, &dev->fusionee.wait);
+     }
 
      proc_create_data("fusionees", 0, fusion_proc_dir[dev->index],
                        &fusionees_proc_fops, dev);
@@ -380,11 +1076,11 @@ void fusionee_deinit(FusionDev * dev)
 {
      Fusionee *fusionee, *next;
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      remove_proc_entry( "fusionees", fusion_proc_dir[dev->index] );
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      if (!dev->refs) {
           direct_list_foreach_safe (fusionee, next, dev->fusionee.list) {
@@ -394,8 +1090,19 @@ void fusionee_deinit(FusionDev * dev)
                     Packet_Free( packet );
                }
 
+               free_packets( fusionee, dev, &fusionee->urgent );
+
+               free_dispatchers( fusionee, dev );
+
+               free_packets( fusionee, dev, &fusionee->free_packets );
+               free_callbacks( fusionee );
+
                fusion_core_free( fusion_core, fusionee);
           }
+
+          fusion_hash_destroy( dev->fusionee.hash );
+
+          dev->fusionee.hash = NULL;
      }
 }
 
@@ -473,11 +1180,13 @@ int fusionee_new(FusionDev * dev, bool force_slave, Fusionee ** ret_fusionee)
 
 int fusionee_enter(FusionDev * dev, FusionEnter * enter, Fusionee * fusionee)
 {
+     int ret;
+
      D_MAGIC_ASSERT( fusionee, Fusionee );
 
      if (dev->fusionee.last_id || fusionee->force_slave) {
           while (!dev->enter_ok) {
-               fusion_core_wq_wait( fusion_core, &dev->enter_wait, NULL, true );
+               fusion_core_wq_wait( fusion_core, &dev->enter_wait, &dev->lock, NULL, true );
 
                if (signal_pending(current))
                     return -EINTR;
@@ -504,8 +1213,17 @@ int fusionee_enter(FusionDev * dev, FusionEnter * enter, Fusionee * fusionee)
                return -ENOPROTOOPT;
      }
 
+     if (fusionee->id)
+          fusion_hash_remove( dev->fusionee.hash, (void*)(long) fusionee->id, NULL, NULL );
+
      fusionee->id = ++dev->fusionee.last_id;
 
+     ret = fusion_hash_insert( dev->fusionee.hash, (void*)(long) fusionee->id, fusionee );
+     if (ret) {
+          fusionee->id = 0;
+          return ret;
+     }
+
      enter->fusion_id = fusionee->id;
 
      return 0;
@@ -513,21 +1231,29 @@ int fusionee_enter(FusionDev * dev, FusionEnter * enter, Fusionee * fusionee)
 
 int fusionee_fork(FusionDev * dev, FusionFork * fork, Fusionee * fusionee)
 {
-     int ret;
+     int       ret;
+     Fusionee *from;
 
      D_MAGIC_ASSERT( fusionee, Fusionee );
 
-     ret = fusion_shmpool_fork_all(dev, fusionee->id, fork->fusion_id);
-     if (ret)
-          return ret;
+     /* Nothing to inherit if the parent has gone already. */
+     if (!lookup_fusionee(dev, fork->fusion_id, &from)) {
+          ret = fusion_shmpool_fork_all(dev, fusionee, from);
+          if (ret)
+               return ret;
 
-     ret = fusion_reactor_fork_all(dev, fusionee->id, fork->fusion_id);
-     if (ret)
-          return ret;
+          ret = fusion_reactor_fork_all(dev, fusionee, from);
+          if (ret)
+               return ret;
 
-     ret = fusion_ref_fork_all_local(dev, fusionee->id, fork->fusion_id);
-     if (ret)
-          return ret;
+          ret = fusion_ref_fork_all_local(dev, fusionee, from);
+          if (ret)
+               return ret;
+
+          ret = fusion_skirmish_fork_all(dev, fusionee, from);
+          if (ret)
+               return ret;
+     }
 
      fork->fusion_id = fusionee->id;
 
@@ -564,164 +1290,531 @@ fusionee_send_message(FusionDev * dev,
                       void *callback_ctx, int callback_param,
                       const void *extra_data, unsigned int extra_size )
 {
-     int                      ret;
-     Packet                  *packet;
-     Fusionee                *fusionee;
-     size_t                   size;
+     int       ret;
+     Fusionee *fusionee;
 
      ret = lookup_fusionee(dev, recipient, &fusionee);
      if (ret)
           return ret;
 
-     FUSION_DEBUG("fusionee_send_message (%ld -> %ld, type %d, id %d, size %d, extra %d)\n",
-                  fusionee ? fusionee->id : 0, recipient, msg_type, msg_id, msg_size, extra_size);
+     return fusionee_send_message2( dev, sender, fusionee, msg_type, msg_id, msg_channel,
+                                    msg_size, msg_data, callback, callback_ctx, callback_param,
+                                    extra_data, extra_size, true );
+}
+
+static int
+send_message(FusionDev * dev,
+             Fusionee *sender,
+             Fusionee *fusionee,
+             FusionMessageType msg_type,
+             int msg_id,
+             int msg_channel,
+             int msg_size,
+             const void *msg_data,
+             MessageData *shared,
+             FusionMessageCallback callback,
+             void *callback_ctx, int callback_param,
+             const void *extra_data, unsigned int extra_size,
+             bool flush,
+             int prio)
+{
+     int     ret;
+     Packet *packet;
+     size_t  size;
+     bool    urgent = (prio > 0 && flush && (msg_type == FMT_CALL || msg_type == FMT_CALL3) &&
+                       !Fusionee_SenderQueued( fusionee, sender ? sender->id : 0 ));
+     bool    from_user = (!shared && msg_type != FMT_CALL && msg_type != FMT_CALL3 &&
+                          msg_type != FMT_SHMPOOL && msg_type != FMT_LEAVE &&
+                          msg_type != FMT_CALL_RESULT);
+
+     FUSION_DEBUG("fusionee_send_message2 (%ld -> %ld, type %d, id %d, size %d, extra %d)\n",
+                  sender ? sender->id : 0, fusionee->id, msg_type, msg_id, msg_size, extra_size);
 
      D_MAGIC_ASSERT( fusionee, Fusionee );
 
-     while (fusionee->packets.count > 10 && sender && sender->id != FUSION_ID_MASTER &&
-            fusion_core_pid(fusion_core) != fusionee->dispatcher_pid && msg_type != FMT_LEAVE)
+     /*
+      * Queued packets would be older than anything written to the ring.
+      * The ring has a single reader, it's not used with several dispatchers.
+      */
+     if (fusionee->ring.header && flush && !callback && !fusionee->packets.count &&
+         !fusionee->urgent.count && !urgent &&
+         fusionee->num_dispatchers <= 1) {
+          ret = Fusionee_WriteRing( fusionee, msg_type, msg_id, msg_channel,
+                                    msg_data, msg_size, extra_data, extra_size, from_user );
+          if (ret != -ENOSPC) {
+               if (!ret) {
+                    atomic_long_inc(&fusionee->rcv_total);
+                    if (sender)
+                         atomic_long_inc(&sender->snd_total);
+               }
+
+               return ret;
+          }
+     }
+
+     while (!urgent && fusionee->packets.count > 10 && sender && sender->id != FUSION_ID_MASTER &&
+            !Fusionee_LookupDispatcher( fusionee, fusion_core_pid(fusion_core) ) && msg_type != FMT_LEAVE)
      {
-          fusion_core_wq_wait( fusion_core, &fusionee->wait_process, 0, true );
+          fusion_core_wq_wait( fusion_core, &fusionee->wait_process, &dev->lock, 0, true );
 
           if (signal_pending(current))
                return -EINTR;
      }
 
-     ret = Fusionee_GetPacket( fusionee, sizeof(FusionReadMessage) + msg_size + extra_size, &packet );
+     if (urgent)
+          ret = Fusionee_GetUrgentPacket( fusionee, prio, &packet );
+     else
+          ret = Fusionee_GetPacket( fusionee, sizeof(FusionReadMessage) + msg_size + extra_size, &packet );
      if (ret)
           return ret;
 
      D_MAGIC_ASSERT( packet, Packet );
 
 
-     /* keep size for error handling, the other way round we'd need to remove the callback :( */
-     size = packet->size;
-
-     ret = Packet_Write( packet, msg_type, msg_id, msg_channel,
-                         msg_data, msg_size, extra_data, extra_size,
-                         msg_type != FMT_CALL && msg_type != FMT_CALL3 && msg_type != FMT_SHMPOOL && msg_type != FMT_LEAVE );
-     if (ret)
-          return ret;
+     /* keep size for error handling, the other way round we'd need to remove the callback :( */
+     size = packet->size;
+
+     ret = Packet_Write( packet, msg_type, msg_id, msg_channel,
+                         msg_data, msg_size, shared, extra_data, extra_size, from_user );
+     if (ret)
+          goto error;
+
+
+
+     D_MAGIC_ASSERT( packet, Packet );
+
+     if (callback) {
+          ret = Packet_AddCallback( fusionee, packet, msg_id, callback, callback_ctx, callback_param );
+          if (ret)
+               goto error;
+     }
+
+     if (!size)
+          packet->sender = sender ? sender->id : 0;
+     else if (packet->sender != (sender ? sender->id : 0))
+          packet->senders = true;
+
+
+     atomic_long_inc(&fusionee->rcv_total);
+     if (sender)
+          atomic_long_inc(&sender->snd_total);
+
+     if (flush) {
+          packet->flush = true;
+//          fusion_core_wq_wake( fusion_core, &fusionee->wait_receive);
+          wake_up_interruptible_sync_poll( &fusionee->wait_receive.queue, POLLIN | POLLRDNORM );
+     }
+
+     return 0;
+
+
+error:
+     Packet_Truncate( packet, size );
+
+     if (urgent) {
+          direct_list_remove( &fusionee->urgent.items, &packet->link );
+
+          fusionee->urgent.count--;
+
+          Fusionee_PutPacket( fusionee, packet );
+     }
+
+     return ret;
+}
+
+int
+fusionee_send_message2(FusionDev * dev,
+                       Fusionee *sender,
+                       Fusionee *fusionee,
+                       FusionMessageType msg_type,
+                       int msg_id,
+                       int msg_channel,
+                       int msg_size,
+                       const void *msg_data,
+                       FusionMessageCallback callback,
+                       void *callback_ctx, int callback_param,
+                       const void *extra_data, unsigned int extra_size,
+                       bool flush)
+{
+     return send_message( dev, sender, fusionee, msg_type, msg_id, msg_channel,
+                          msg_size, msg_data, NULL, callback, callback_ctx, callback_param,
+                          extra_data, extra_size, flush, 0 );
+}
+
+int
+fusionee_send_message_prio(FusionDev * dev,
+                           Fusionee *sender,
+                           Fusionee *fusionee,
+                           FusionMessageType msg_type,
+                           int msg_id,
+                           int msg_channel,
+                           int msg_size,
+                           const void *msg_data,
+                           FusionMessageCallback callback,
+                           void *callback_ctx, int callback_param,
+                           const void *extra_data, unsigned int extra_size,
+                           bool flush,
+                           int prio)
+{
+     return send_message( dev, sender, fusionee, msg_type, msg_id, msg_channel,
+                          msg_size, msg_data, NULL, callback, callback_ctx, callback_param,
+                          extra_data, extra_size, flush, prio );
+}
+
+int
+fusionee_send_message_data(FusionDev * dev,
+                           Fusionee *sender,
+                           Fusionee *fusionee,
+                           FusionMessageType msg_type,
+                           int msg_id,
+                           int msg_channel,
+                           MessageData *data,
+                           FusionMessageCallback callback,
+                           void *callback_ctx, int callback_param,
+                           bool flush)
+{
+     return send_message( dev, sender, fusionee, msg_type, msg_id, msg_channel,
+                          data->size, MESSAGE_DATA(data), data, callback, callback_ctx, callback_param,
+                          NULL, 0, flush, 0 );
+}
+
+int
+fusionee_message_data_new(const void *msg_data, int msg_size, MessageData ** ret_data)
+{
+     MessageData *data;
+
+     if (msg_size < 0)
+          return -EINVAL;
+
+     data = fusion_core_malloc( fusion_core, sizeof(MessageData) + msg_size );
+     if (!data)
+          return -ENOMEM;
+
+     if (copy_from_user( MESSAGE_DATA(data), msg_data, msg_size )) {
+          fusion_core_free( fusion_core, data );
+          return -EFAULT;
+     }
+
+     data->refs = 1;
+     data->size = msg_size;
+
+     *ret_data = data;
+
+     return 0;
+}
+
+const void *
+fusionee_message_data(const MessageData * data)
+{
+     return data + 1;
+}
+
+void
+fusionee_message_data_unref(MessageData * data)
+{
+     FUSION_ASSERT( data->refs > 0 );
+
+     if (!--data->refs)
+          fusion_core_free( fusion_core, data );
+}
+
+static Dispatcher *
+Fusionee_LookupDispatcher( Fusionee *fusionee,
+                           pid_t     pid )
+{
+     Dispatcher *dispatcher;
+
+     direct_list_foreach (dispatcher, fusionee->dispatchers) {
+          if (dispatcher->pid == pid)
+               return dispatcher;
+     }
+
+     return NULL;
+}
+
+/*
+ * Drops the dispatchers of threads that have exited, the messages they've read count as processed.
+ */
+static void
+Fusionee_ReapDispatchers( FusionDev *dev,
+                          Fusionee  *fusionee )
+{
+     Dispatcher *dispatcher, *next;
+
+     direct_list_foreach_safe (dispatcher, next, fusionee->dispatchers) {
+          struct task_struct *task = get_pid_task( dispatcher->tid, PIDTYPE_PID );
+
+          if (task) {
+               put_task_struct( task );
+               continue;
+          }
+
+          FUSION_DEBUG( "%s( %p ) <- pid %d is gone\n", __FUNCTION__, fusionee, dispatcher->pid );
+
+          direct_list_remove( &fusionee->dispatchers, &dispatcher->link );
+
+          fusionee->num_dispatchers--;
+
+          flush_packets( fusionee, dev, &dispatcher->packets );
+
+          put_pid( dispatcher->tid );
+
+          fusion_core_free( fusion_core, dispatcher );
+     }
+}
+
+static Dispatcher *
+Fusionee_NewDispatcher( FusionDev *dev,
+                        Fusionee  *fusionee,
+                        bool       shared )
+{
+     Dispatcher *dispatcher;
+
+     Fusionee_ReapDispatchers( dev, fusionee );
+
+     dispatcher = fusion_core_malloc( fusion_core, sizeof(Dispatcher) );
+     if (!dispatcher)
+          return NULL;
+
+     dispatcher->pid    = fusion_core_pid( fusion_core );
+     dispatcher->tid    = get_pid( task_pid( current ) );
+     dispatcher->shared = shared;
+
+     direct_list_append( &fusionee->dispatchers, &dispatcher->link );
+
+     fusionee->num_dispatchers++;
+
+     FUSION_DEBUG( "%s( %p ) <- pid %d%s, %d dispatchers\n", __FUNCTION__, fusionee, dispatcher->pid,
+                   shared ? " (shared)" : "", fusionee->num_dispatchers );
+
+     return dispatcher;
+}
+
+/*
+ * Returns the dispatcher of the current thread, the shared one unless it has registered.
+ */
+static Dispatcher *
+Fusionee_GetDispatcher( FusionDev *dev,
+                        Fusionee  *fusionee )
+{
+     Dispatcher *dispatcher;
+     pid_t       pid = fusion_core_pid( fusion_core );
+
+     dispatcher = Fusionee_LookupDispatcher( fusionee, pid );
+     if (dispatcher)
+          return dispatcher;
+
+     direct_list_foreach (dispatcher, fusionee->dispatchers) {
+          if (dispatcher->shared)
+               break;
+     }
+
+     if (!dispatcher)
+          return Fusionee_NewDispatcher( dev, fusionee, true );
+
+     /* The shared dispatcher follows the thread reading, e.g. for boosting it. */
+     put_pid( dispatcher->tid );
+
+     dispatcher->pid = pid;
+     dispatcher->tid = get_pid( task_pid( current ) );
+
+     return dispatcher;
+}
+
+/*
+ * Returns the packet to be read next by the dispatcher, if any.
+ */
+static Packet *
+Fusionee_NextPacket( FusionDev   *dev,
+                     Fusionee    *fusionee,
+                     Dispatcher  *dispatcher,
+                     FusionFifo **ret_fifo )
+{
+     FusionFifo *fifo;
+     Packet     *packet;
+     Dispatcher *other;
+     bool        reaped = false;
+
+retry:
+     /* Urgent calls are read first. */
+     fifo   = fusionee->urgent.count ? &fusionee->urgent : &fusionee->packets;
+     packet = (Packet *) fifo->items;
+
+     if (!packet || !packet->flush)
+          return NULL;
+
+     D_MAGIC_ASSERT( packet, Packet );
+
+     /* Keep the order of messages being processed by other dispatchers. */
+     if (fusionee->num_dispatchers > 1) {
+          direct_list_foreach (other, fusionee->dispatchers) {
+               Packet *busy;
+
+               if (other == dispatcher)
+                    continue;
 
+               direct_list_foreach (busy, other->packets.items) {
+                    if (Packet_Conflicts( packet, busy )) {
+                         /* Unless the other thread has exited. */
+                         if (!reaped) {
+                              reaped = true;
 
+                              Fusionee_ReapDispatchers( dev, fusionee );
 
-     D_MAGIC_ASSERT( packet, Packet );
+                              goto retry;
+                         }
 
-     if (callback) {
-          ret = Packet_AddCallback( packet, msg_id, callback, callback_ctx, callback_param );
-          if (ret) {
-               packet->size = size;
-               return ret;
+                         return NULL;
+                    }
+               }
           }
      }
 
+     *ret_fifo = fifo;
 
-     atomic_long_inc(&fusionee->rcv_total);
-     if (sender)
-          atomic_long_inc(&sender->snd_total);
+     return packet;
+}
 
+static bool
+Fusionee_Processing( Fusionee *fusionee )
+{
+     Dispatcher *dispatcher;
 
-     packet->flush = true;
-//     fusion_core_wq_wake( fusion_core, &fusionee->wait_receive);
-     wake_up_interruptible_sync_poll( &fusionee->wait_receive.queue, POLLIN | POLLRDNORM );
+     direct_list_foreach (dispatcher, fusionee->dispatchers) {
+          if (dispatcher->packets.count)
+               return true;
+     }
 
-     return 0;
+     return false;
 }
 
-int
-fusionee_send_message2(FusionDev * dev,
-                       Fusionee *sender,
-                       Fusionee *fusionee,
-                       FusionMessageType msg_type,
-                       int msg_id,
-                       int msg_channel,
-                       int msg_size,
-                       const void *msg_data,
-                       FusionMessageCallback callback,
-                       void *callback_ctx, int callback_param,
-                       const void *extra_data, unsigned int extra_size,
-                       bool flush)
+/*
+ * Raises the thread to real time priority prio, only one thread of the fusionee at a time.
+ */
+static void
+Fusionee_Boost( Fusionee   *fusionee,
+                struct pid *tid,
+                int         prio )
 {
-     int     ret;
-     Packet *packet;
-     size_t  size;
+     struct task_struct *task;
+     struct sched_param  param;
 
-     FUSION_DEBUG("fusionee_send_message2 (%ld -> %ld, type %d, id %d, size %d, extra %d)\n",
-                  sender ? sender->id : 0, fusionee->id, msg_type, msg_id, msg_size, extra_size);
+     if (fusionee->boost.tid && (fusionee->boost.tid != tid || prio <= fusionee->boost.prio))
+          return;
 
-     D_MAGIC_ASSERT( fusionee, Fusionee );
+     task = get_pid_task( tid, PIDTYPE_PID );
+     if (!task)
+          return;
 
-     while (fusionee->packets.count > 10 && sender && sender->id != FUSION_ID_MASTER &&
-            fusion_core_pid(fusion_core) != fusionee->dispatcher_pid && msg_type != FMT_LEAVE)
-     {
-          fusion_core_wq_wait( fusion_core, &fusionee->wait_process, 0, true );
+     if (!fusionee->boost.tid) {
+          /* Nothing to do if the dispatcher has a higher priority anyway. */
+          if (rt_task( task ) && task->rt_priority >= prio) {
+               put_task_struct( task );
+               return;
+          }
 
-          if (signal_pending(current))
-               return -EINTR;
+          fusionee->boost.policy      = task->policy;
+          fusionee->boost.rt_priority = task->rt_priority;
      }
 
-     ret = Fusionee_GetPacket( fusionee, sizeof(FusionReadMessage) + msg_size + extra_size, &packet );
-     if (ret)
-          return ret;
+     FUSION_DEBUG( "%s( fusion_id %lu, pid %d ) <- prio %d\n", __FUNCTION__, fusionee->id, pid_vnr( tid ), prio );
 
-     D_MAGIC_ASSERT( packet, Packet );
+     param.sched_priority = prio;
 
+     if (!sched_setscheduler_nocheck( task, SCHED_FIFO, &param )) {
+          if (!fusionee->boost.tid)
+               fusionee->boost.tid = get_pid( tid );
 
-     /* keep size for error handling, the other way round we'd need to remove the callback :( */
-     size = packet->size;
+          fusionee->boost.prio = prio;
+     }
 
-     ret = Packet_Write( packet, msg_type, msg_id, msg_channel,
-                         msg_data, msg_size, extra_data, extra_size,
-                         msg_type != FMT_CALL && msg_type != FMT_CALL3 && msg_type != FMT_SHMPOOL && msg_type != FMT_LEAVE );
-     if (ret)
-          return ret;
+     put_task_struct( task );
+}
 
+static void
+Fusionee_Unboost( Fusionee *fusionee )
+{
+     struct task_struct *task;
+     struct sched_param  param;
 
+     if (!fusionee->boost.tid)
+          return;
 
-     D_MAGIC_ASSERT( packet, Packet );
+     FUSION_DEBUG( "%s( fusion_id %lu, pid %d )\n", __FUNCTION__, fusionee->id, pid_vnr( fusionee->boost.tid ) );
 
-     if (callback) {
-          ret = Packet_AddCallback( packet, msg_id, callback, callback_ctx, callback_param );
-          if (ret) {
-               packet->size = size;
-               return ret;
-          }
+     task = get_pid_task( fusionee->boost.tid, PIDTYPE_PID );
+     if (task) {
+          param.sched_priority = fusionee->boost.rt_priority;
+
+          sched_setscheduler_nocheck( task, fusionee->boost.policy, &param );
+
+          put_task_struct( task );
      }
 
+     put_pid( fusionee->boost.tid );
 
-     atomic_long_inc(&fusionee->rcv_total);
-     if (sender)
-          atomic_long_inc(&sender->snd_total);
+     fusionee->boost.tid  = NULL;
+     fusionee->boost.prio = 0;
+}
 
-     if (flush) {
-          packet->flush = true;
-//          fusion_core_wq_wake( fusion_core, &fusionee->wait_receive);
-          wake_up_interruptible_sync_poll( &fusionee->wait_receive.queue, POLLIN | POLLRDNORM );
-     }
+void
+fusionee_boost(FusionDev * dev, Fusionee * fusionee, int prio)
+{
+     D_MAGIC_ASSERT( fusionee, Fusionee );
 
-     return 0;
+     fusionee->boost.count++;
+
+     /* With several dispatchers, the one reading the call is boosted in fusionee_get_messages(). */
+     if (fusionee->num_dispatchers == 1)
+          Fusionee_Boost( fusionee, ((Dispatcher *) fusionee->dispatchers)->tid, prio );
+}
+
+void
+fusionee_unboost(FusionDev * dev, Fusionee * fusionee)
+{
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     FUSION_ASSERT( fusionee->boost.count > 0 );
+
+     /* The boost is kept at its highest level until all boosted executions are done. */
+     if (--fusionee->boost.count)
+          return;
+
+     Fusionee_Unboost( fusionee );
 }
 
 int
 fusionee_get_messages(FusionDev * dev,
                       Fusionee * fusionee, void *buf, int buf_size, bool block)
 {
-     int written = 0;
-     FusionFifo prev_packets;
+     int         written = 0;
+     FusionFifo  prev_packets;
+     FusionFifo *fifo;
+     Packet     *packet;
+     Dispatcher *dispatcher;
 
      FUSION_DEBUG( "%s()\n", __FUNCTION__ );
 
      D_MAGIC_ASSERT( fusionee, Fusionee );
 
-     fusionee->dispatcher_pid = fusion_core_pid( fusion_core );
+     dispatcher = Fusionee_GetDispatcher( dev, fusionee );
+     if (!dispatcher)
+          return -ENOMEM;
+
+     fusionee->dispatcher_pid = dispatcher->pid;
 
-     prev_packets = fusionee->prev_packets;
+     prev_packets = dispatcher->packets;
 
-     fusion_fifo_reset(&fusionee->prev_packets);
+     fusion_fifo_reset(&dispatcher->packets);
 
      fusion_core_wq_wake( fusion_core, &fusionee->wait_process);
 
-     while (!fusionee->packets.count || !((Packet *) fusionee->packets.items)->flush) {
+     /* Other dispatchers may wait for these to be processed. */
+     if (prev_packets.count && fusionee->num_dispatchers > 1)
+          fusion_core_wq_wake( fusion_core, &fusionee->wait_receive);
+
+     while (!Fusionee_RingPending( fusionee ) && !Fusionee_NextPacket( dev, fusionee, dispatcher, &fifo ))
+     {
           if (prev_packets.count) {
                flush_packets(fusionee, dev, &prev_packets);
           }
@@ -729,23 +1822,27 @@ fusionee_get_messages(FusionDev * dev,
                if (!block)
                     return -EAGAIN;
 
-               fusionee->waiting = true;
-               fusion_core_wq_wait( fusion_core, &fusionee->wait_receive, NULL, true );
-               fusionee->waiting = false;
+               fusionee->waiting++;
+               fusion_core_wq_wait( fusion_core, &fusionee->wait_receive, &dev->lock, NULL, true );
+               fusionee->waiting--;
 
                if (signal_pending(current))
                     return -EINTR;
           }
      }
 
-     while (fusionee->packets.count && ((Packet *) fusionee->packets.items)->flush) {
-          Packet *packet = (Packet *) fusionee->packets.items;
-          int     bytes  = packet->size;
+     /* The ring has to be consumed first. */
+     if (Fusionee_RingPending( fusionee )) {
+          flush_packets(fusionee, dev, &prev_packets);
+          return 0;
+     }
 
-          D_MAGIC_ASSERT( packet, Packet );
+     while ((packet = Fusionee_NextPacket( dev, fusionee, dispatcher, &fifo )) != NULL) {
+          int bytes = packet->size;
 
           if (bytes > buf_size) {
                if (!written) {
+                    /* Stays queued, the reader has to retry with a larger buffer. */
                     flush_packets(fusionee, dev, &prev_packets);
                     return -EMSGSIZE;
                }
@@ -753,7 +1850,7 @@ fusionee_get_messages(FusionDev * dev,
                break;
           }
 
-          if (copy_to_user(buf, packet->buf, packet->size)) {
+          if (Packet_CopyToUser( packet, buf )) {
                flush_packets(fusionee, dev, &prev_packets);
                return -EFAULT;
           }
@@ -762,14 +1859,23 @@ fusionee_get_messages(FusionDev * dev,
           buf += bytes;
           buf_size -= bytes;
 
-          fusion_fifo_get(&fusionee->packets);
+          fusion_fifo_get(fifo);
 
           D_MAGIC_ASSERT( packet, Packet );
 
-          if (packet->callbacks.count)
-               fusion_fifo_put(&fusionee->prev_packets, &packet->link);
+          /* The thread reading an urgent call runs at the priority of the caller. */
+          if (packet->prio && fusionee->boost.count)
+               Fusionee_Boost( fusionee, dispatcher->tid, packet->prio );
+
+          /* Other dispatchers need to know about every message being processed. */
+          if (packet->callbacks.count || fusionee->num_dispatchers > 1)
+               fusion_fifo_put(&dispatcher->packets, &packet->link);
           else
                Fusionee_PutPacket(fusionee, packet);
+
+          /* Leave the rest to the others. */
+          if (fusionee->num_dispatchers > 1)
+               break;
      }
 
      flush_packets(fusionee, dev, &prev_packets);
@@ -786,36 +1892,49 @@ fusionee_wait_processing(FusionDev * dev,
      do {
           int ret;
           Packet *packet;
+          Dispatcher *dispatcher;
 
-          ret = lock_fusionee(dev, fusion_id, &fusionee);
+          ret = lookup_fusionee(dev, fusion_id, &fusionee);
           if (ret)
                return ret;
 
           D_MAGIC_ASSERT( fusionee, Fusionee );
 
-          /* Search all pending packets. */
-          direct_list_foreach (packet, fusionee->packets.items) {
+          /* Search the urgent packets. */
+          direct_list_foreach (packet, fusionee->urgent.items) {
                if (Packet_Search( packet, msg_type, msg_id ))
                     break;
           }
 
-          /* Search packets being processed right now. */
+          /* Search all pending packets. */
           if (!packet) {
-               direct_list_foreach (packet, fusionee->prev_packets.items) {
+               direct_list_foreach (packet, fusionee->packets.items) {
                     if (Packet_Search( packet, msg_type, msg_id ))
                          break;
                }
           }
 
+          /* Search packets being processed right now. */
+          if (!packet) {
+               direct_list_foreach (dispatcher, fusionee->dispatchers) {
+                    direct_list_foreach (packet, dispatcher->packets.items) {
+                         if (Packet_Search( packet, msg_type, msg_id ))
+                              break;
+                    }
+
+                    if (packet)
+                         break;
+               }
+          }
+
           /* Really no more packet of that type and ID? */
           if (!packet)
                break;
 
-          if (fusionee->dispatcher_pid)
-               FUSION_ASSUME(fusionee->dispatcher_pid != fusion_core_pid( fusion_core ));
+          FUSION_ASSUME(!Fusionee_LookupDispatcher( fusionee, fusion_core_pid( fusion_core ) ));
 
           /* Otherwise unlock and wait. */
-          fusion_core_wq_wait( fusion_core, &fusionee->wait_process, 0, true );
+          fusion_core_wq_wait( fusion_core, &fusionee->wait_process, &dev->lock, 0, true );
 
           if (signal_pending(current))
                return -EINTR;
@@ -824,17 +1943,64 @@ fusionee_wait_processing(FusionDev * dev,
      return 0;
 }
 
+int
+fusionee_cancel_message(FusionDev * dev,
+                        Fusionee * fusionee,
+                        FusionMessageType msg_type, int msg_id,
+                        size_t offset, unsigned int value)
+{
+     Packet     *packet;
+     FusionFifo *fifo = &fusionee->urgent;
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     /* Search the urgent packets. */
+     direct_list_foreach (packet, fusionee->urgent.items) {
+          if (Packet_IsOnly( packet, msg_type, msg_id, offset, value ))
+               break;
+     }
+
+     /* Search all pending packets. */
+     if (!packet) {
+          fifo = &fusionee->packets;
+
+          direct_list_foreach (packet, fusionee->packets.items) {
+               if (Packet_IsOnly( packet, msg_type, msg_id, offset, value ))
+                    break;
+          }
+     }
+
+     /* Already read or sharing its packet with other messages. */
+     if (!packet)
+          return -ENOMSG;
+
+     FUSION_DEBUG( "%s( %p ) <- packet %p\n", __FUNCTION__, fusionee, packet );
+
+     direct_list_remove( &fifo->items, &packet->link );
+
+     fifo->count--;
+
+     Packet_RunCallbacks( dev, fusionee, packet );
+
+     Fusionee_PutPacket( fusionee, packet );
+
+     fusion_core_wq_wake( fusion_core, &fusionee->wait_process );
+
+     return 0;
+}
+
 int
 fusionee_remove_message_callbacks(Fusionee  *fusionee,
                                   void      *ctx)
 {
      Packet          *packet;
+     Dispatcher      *dispatcher;
      MessageCallback *callback, *next;
 
      D_MAGIC_ASSERT( fusionee, Fusionee );
 
-     /* Search all pending packets. */
-     direct_list_foreach (packet, fusionee->packets.items) {
+     /* Search the urgent packets. */
+     direct_list_foreach (packet, fusionee->urgent.items) {
           D_MAGIC_ASSERT( packet, Packet );
 
           direct_list_foreach_safe (callback, next, packet->callbacks.items) {
@@ -842,13 +2008,13 @@ fusionee_remove_message_callbacks(Fusionee  *fusionee,
                     fusion_list_remove( &packet->callbacks.items, &callback->link );
                     packet->callbacks.count--;
 
-                    fusion_core_free( fusion_core, callback );
+                    Fusionee_PutCallback( fusionee, callback );
                }
           }
      }
 
-     /* Search packets being processed right now. */
-     direct_list_foreach (packet, fusionee->prev_packets.items) {
+     /* Search all pending packets. */
+     direct_list_foreach (packet, fusionee->packets.items) {
           D_MAGIC_ASSERT( packet, Packet );
 
           direct_list_foreach_safe (callback, next, packet->callbacks.items) {
@@ -856,7 +2022,23 @@ fusionee_remove_message_callbacks(Fusionee  *fusionee,
                     fusion_list_remove( &packet->callbacks.items, &callback->link );
                     packet->callbacks.count--;
 
-                    fusion_core_free( fusion_core, callback );
+                    Fusionee_PutCallback( fusionee, callback );
+               }
+          }
+     }
+
+     /* Search packets being processed right now. */
+     direct_list_foreach (dispatcher, fusionee->dispatchers) {
+          direct_list_foreach (packet, dispatcher->packets.items) {
+               D_MAGIC_ASSERT( packet, Packet );
+
+               direct_list_foreach_safe (callback, next, packet->callbacks.items) {
+                    if (callback->ctx == ctx) {
+                         fusion_list_remove( &packet->callbacks.items, &callback->link );
+                         packet->callbacks.count--;
+
+                         Fusionee_PutCallback( fusionee, callback );
+                    }
                }
           }
      }
@@ -864,6 +2046,65 @@ fusionee_remove_message_callbacks(Fusionee  *fusionee,
      return 0;
 }
 
+int
+fusionee_map_ring( FusionDev              *dev,
+                   Fusionee               *fusionee,
+                   struct vm_area_struct  *vma )
+{
+     int            ret;
+     unsigned long  header;
+     unsigned long  data;
+     unsigned long  addr;
+     unsigned long  size = vma->vm_end - vma->vm_start;
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     if (fusionee->ring.header)
+          return -EBUSY;
+
+     /* Header page plus a power of two number of pages. */
+     if (size < 2 * PAGE_SIZE)
+          return -EINVAL;
+
+     size -= PAGE_SIZE;
+
+     if (size & (size - 1) || size > FUSION_RING_MAX_SIZE)
+          return -EINVAL;
+
+     header = get_zeroed_page( GFP_KERNEL );
+     if (!header)
+          return -ENOMEM;
+
+     data = __get_free_pages( GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN, get_order( size ) );
+     if (!data) {
+          free_page( header );
+          return -ENOMEM;
+     }
+
+     fusionee->ring.header = (FusionReceiveRing *) header;
+     fusionee->ring.data   = (char *) data;
+     fusionee->ring.size   = size;
+     fusionee->ring.head   = 0;
+
+     fusionee->ring.header->size = size;
+
+     SetPageReserved( virt_to_page( (void*) header ) );
+
+     for (addr = data; addr < data + size; addr += PAGE_SIZE)
+          SetPageReserved( virt_to_page( (void*) addr ) );
+
+     ret = remap_pfn_range( vma, vma->vm_start, virt_to_phys( (void*) header ) >> PAGE_SHIFT,
+                            PAGE_SIZE, vma->vm_page_prot );
+     if (!ret)
+          ret = remap_pfn_range( vma, vma->vm_start + PAGE_SIZE, virt_to_phys( (void*) data ) >> PAGE_SHIFT,
+                                 size, vma->vm_page_prot );
+
+     if (ret)
+          Fusionee_FreeRing( fusionee );
+
+     return ret;
+}
+
 unsigned int
 fusionee_poll( FusionDev                *dev,
                Fusionee                 *fusionee,
@@ -876,7 +2117,8 @@ fusionee_poll( FusionDev                *dev,
 
      unsigned int mask = 0;
 
-     if (fusionee->packets.count && ((Packet *) fusionee->packets.items)->flush)
+     if (Fusionee_RingPending( fusionee ) || fusionee->urgent.count ||
+         (fusionee->packets.count && ((Packet *) fusionee->packets.items)->flush))
           mask |= POLLIN | POLLRDNORM;
 
      return mask;
@@ -888,7 +2130,9 @@ fusionee_sync( FusionDev *dev,
 {
      D_MAGIC_ASSERT( fusionee, Fusionee );
 
-     while (fusionee->packets.count || fusionee->prev_packets.count || !fusionee->waiting) {
+     while (fusionee->packets.count || Fusionee_Processing( fusionee ) || fusionee->urgent.count ||
+            Fusionee_RingPending( fusionee ) || !fusionee->waiting)
+     {
           if (fusionee->packets.count) {
                Packet *packet = (Packet*) direct_list_last( fusionee->packets.items );
 
@@ -902,7 +2146,7 @@ fusionee_sync( FusionDev *dev,
                }
           }
 
-          fusion_core_wq_wait( fusion_core, &fusionee->wait_process, NULL, true );
+          fusion_core_wq_wait( fusion_core, &fusionee->wait_process, &dev->lock, NULL, true );
 
           if (signal_pending(current))
                return -EINTR;
@@ -970,12 +2214,12 @@ fusionee_kill(FusionDev * dev,
                          /* fall through */
 
                     default:
-                         fusion_core_wq_wait( fusion_core, &dev->fusionee.wait, &timeout, true );
+                         fusion_core_wq_wait( fusion_core, &dev->fusionee.wait, &dev->lock, &timeout, true );
                          break;
                }
           }
           else
-               fusion_core_wq_wait( fusion_core, &dev->fusionee.wait, NULL, true );
+               fusion_core_wq_wait( fusion_core, &dev->fusionee.wait, &dev->lock, NULL, true );
 
           if (signal_pending(current))
                return -EINTR;
@@ -1008,37 +2252,53 @@ fusionee_unref( Fusionee * fusionee )
 
 void fusionee_destroy(FusionDev * dev, Fusionee * fusionee)
 {
-     FusionFifo  prev_packets;
+     FusionLink *dispatchers;
      FusionFifo  packets;
+     FusionFifo  urgent;
      Fusionee   *other;
 
      D_MAGIC_ASSERT( fusionee, Fusionee );
 
      FUSION_ASSERT( fusionee->refs > 0 );
 
-     prev_packets = fusionee->prev_packets;
+     dispatchers  = fusionee->dispatchers;
      packets      = fusionee->packets;
+     urgent       = fusionee->urgent;
+
+     fusionee->dispatchers     = NULL;
+     fusionee->num_dispatchers = 0;
 
      /* Remove from list. */
      direct_list_remove(&dev->fusionee.list, &fusionee->link);
 
+     if (fusionee->id)
+          fusion_hash_remove( dev->fusionee.hash, (void*)(long) fusionee->id, NULL, NULL );
+
      /* Wake up waiting killer. */
      fusion_core_wq_wake( fusion_core, &dev->fusionee.wait);
 
      /* Release locks, references, ... */
-     fusion_skirmish_dismiss_all(dev, fusionee->id);
+     fusion_skirmish_dismiss_all(dev, fusionee);
      fusion_skirmish_return_all_from(dev, fusionee->id);
      fusion_call_destroy_all(dev, fusionee);
-     fusion_reactor_detach_all(dev, fusionee->id);
-     fusion_property_cede_all(dev, fusionee->id);
-     fusion_ref_clear_all_local(dev, fusionee->id);
-     fusion_shmpool_detach_all(dev, fusionee->id);
+     fusion_reactor_detach_all(dev, fusionee);
+     fusion_property_cede_all(dev, fusionee);
+     fusion_ref_clear_all_local(dev, fusionee);
+     fusion_shmpool_detach_all(dev, fusionee);
 
      /* Free all pending messages. */
-     flush_packets(fusionee, dev, &prev_packets);
+     flush_dispatchers(fusionee, dev, &dispatchers);
+     flush_packets(fusionee, dev, &urgent);
      flush_packets(fusionee, dev, &packets);
 
      free_packets(fusionee, dev, &fusionee->free_packets);
+     free_callbacks(fusionee);
+
+     /* No more mappings, the file is being released. */
+     Fusionee_FreeRing( fusionee );
+
+     /* Give the dispatcher its priority back, if it's still running. */
+     Fusionee_Unboost( fusionee );
 
      /* Free fusionee data. */
      fusionee_unref( fusionee );
@@ -1058,58 +2318,101 @@ FusionID fusionee_id(const Fusionee * fusionee)
      return fusionee->id;
 }
 
-pid_t fusionee_dispatcher_pid(FusionDev * dev, FusionID fusion_id)
+int fusionee_lookup(FusionDev * dev, FusionID id, Fusionee ** ret_fusionee)
 {
-     Fusionee *fusionee;
-     int ret = -EINVAL;
+     return lookup_fusionee(dev, id, ret_fusionee);
+}
 
-     direct_list_foreach(fusionee, dev->fusionee.list) {
-          D_MAGIC_ASSERT( fusionee, Fusionee );
+int fusionee_enter_dispatcher(FusionDev * dev, Fusionee * fusionee)
+{
+     Dispatcher *dispatcher;
 
-          if (fusionee->id == fusion_id) {
-               /* FIXME: wait for it? */
-               FUSION_ASSUME(fusionee->dispatcher_pid != 0);
+     D_MAGIC_ASSERT( fusionee, Fusionee );
 
-               ret = fusionee->dispatcher_pid;
-               break;
-          }
+     dispatcher = Fusionee_LookupDispatcher( fusionee, fusion_core_pid( fusion_core ) );
+     if (dispatcher) {
+          /* Keeps what it has read as the shared dispatcher. */
+          dispatcher->shared = false;
+
+          return 0;
      }
 
-     return ret;
+     if (!Fusionee_NewDispatcher( dev, fusionee, false ))
+          return -ENOMEM;
+
+     return 0;
 }
 
-/******************************************************************************/
+int fusionee_leave_dispatcher(FusionDev * dev, Fusionee * fusionee)
+{
+     Dispatcher *dispatcher;
 
-static int
-lookup_fusionee(FusionDev * dev, FusionID id, Fusionee ** ret_fusionee)
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     dispatcher = Fusionee_LookupDispatcher( fusionee, fusion_core_pid( fusion_core ) );
+     if (!dispatcher || dispatcher->shared)
+          return -ENOENT;
+
+     direct_list_remove( &fusionee->dispatchers, &dispatcher->link );
+
+     fusionee->num_dispatchers--;
+
+     /* The messages it has read count as processed. */
+     flush_packets( fusionee, dev, &dispatcher->packets );
+
+     put_pid( dispatcher->tid );
+
+     fusion_core_free( fusion_core, dispatcher );
+
+     /* Others may wait for these messages. */
+     fusion_core_wq_wake( fusion_core, &fusionee->wait_process );
+     fusion_core_wq_wake( fusion_core, &fusionee->wait_receive );
+
+     return 0;
+}
+
+bool fusionee_dispatching(FusionDev * dev, FusionID fusion_id, int call_id, unsigned int serial)
 {
-     Fusionee *fusionee;
+     Fusionee   *fusionee;
+     Dispatcher *dispatcher;
+     Packet     *packet;
 
-     direct_list_foreach(fusionee, dev->fusionee.list) {
-          D_MAGIC_ASSERT( fusionee, Fusionee );
+     if (lookup_fusionee(dev, fusion_id, &fusionee))
+          return false;
 
-          if (fusionee->id == id) {
-               *ret_fusionee = fusionee;
-               return 0;
-          }
+     /* FIXME: wait for it? */
+     FUSION_ASSUME(fusionee->dispatcher_pid != 0);
+
+     if (fusionee->num_dispatchers <= 1)
+          return fusionee->dispatcher_pid == fusion_core_pid( fusion_core );
+
+     /* Only the thread that has read the call. */
+     dispatcher = Fusionee_LookupDispatcher( fusionee, fusion_core_pid( fusion_core ) );
+     if (!dispatcher)
+          return false;
+
+     direct_list_foreach (packet, dispatcher->packets.items) {
+          if (Packet_SearchWord( packet, FMT_CALL3, call_id, offsetof(FusionCallMessage3, serial), serial ) ||
+              Packet_SearchWord( packet, FMT_CALL, call_id, offsetof(FusionCallMessage, serial), serial ))
+               return true;
      }
 
-     return -EINVAL;
+     return false;
 }
 
-static int lock_fusionee(FusionDev * dev, FusionID id, Fusionee ** ret_fusionee)
+/******************************************************************************/
+
+static int
+lookup_fusionee(FusionDev * dev, FusionID id, Fusionee ** ret_fusionee)
 {
-     int ret;
      Fusionee *fusionee;
 
-     ret = lookup_fusionee(dev, id, &fusionee);
-     if (ret)
-          return ret;
+     fusionee = fusion_hash_lookup( dev->fusionee.hash, (void*)(long) id );
+     if (!fusionee)
+          return -EINVAL;
 
      D_MAGIC_ASSERT( fusionee, Fusionee );
 
-     direct_list_move_to_front(&dev->fusionee.list, &fusionee->link);
-
      *ret_fusionee = fusionee;
 
      return 0;
@@ -1126,7 +2429,7 @@ static void flush_packets(Fusionee *fusionee, FusionDev * dev, FusionFifo * fifo
      while ((packet = (Packet *) fusion_fifo_get(fifo)) != NULL) {
           D_MAGIC_ASSERT( packet, Packet );
 
-          Packet_RunCallbacks( dev, packet );
+          Packet_RunCallbacks( dev, fusionee, packet );
 
           Fusionee_PutPacket( fusionee, packet );
      }
@@ -1144,3 +2447,49 @@ static void free_packets(Fusionee *fusionee, FusionDev * dev, FusionFifo * fifo)
           Packet_Free( packet );
      }
 }
+
+static void flush_dispatchers(Fusionee *fusionee, FusionDev * dev, FusionLink ** dispatchers)
+{
+     Dispatcher *dispatcher;
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     while ((dispatcher = (Dispatcher *) *dispatchers) != NULL) {
+          direct_list_remove( dispatchers, &dispatcher->link );
+
+          flush_packets( fusionee, dev, &dispatcher->packets );
+
+          put_pid( dispatcher->tid );
+
+          fusion_core_free( fusion_core, dispatcher );
+     }
+}
+
+static void free_dispatchers(Fusionee *fusionee, FusionDev * dev)
+{
+     Dispatcher *dispatcher;
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     while ((dispatcher = (Dispatcher *) fusionee->dispatchers) != NULL) {
+          direct_list_remove( &fusionee->dispatchers, &dispatcher->link );
+
+          free_packets( fusionee, dev, &dispatcher->packets );
+
+          put_pid( dispatcher->tid );
+
+          fusion_core_free( fusion_core, dispatcher );
+     }
+
+     fusionee->num_dispatchers = 0;
+}
+
+static void free_callbacks(Fusionee *fusionee)
+{
+     MessageCallback *callback;
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     while ((callback = (MessageCallback *) fusion_fifo_get(&fusionee->free_callbacks)) != NULL)
+          fusion_core_cache_free( fusion_core, &callback_cache, callback );
+}
@@ -23,6 +23,8 @@
 #include "types.h"
 
 
+typedef struct __Fusion_MessageData MessageData;
+
 struct __Fusion_Fusionee {
      FusionLink     link;
 
@@ -34,28 +36,68 @@ struct __Fusion_Fusionee {
      int            pid;
 
      FusionFifo packets;
-     FusionFifo prev_packets;
+
+     FusionLink *dispatchers;           /* threads reading messages, see fusionee_get_messages() */
+     int         num_dispatchers;
 
      FusionFifo free_packets;
+     FusionFifo free_callbacks;
 
      atomic_long_t  rcv_total;          /* Total number of messages received. */
      atomic_long_t  snd_total;          /* Total number of messages sent. */
 
      FusionWaitQueue wait_receive;
      FusionWaitQueue wait_process;
-     bool            waiting;
+     int             waiting;           /* dispatchers blocked in fusionee_get_messages() */
+     FusionFifo      urgent;            /* calls read before all other packets, see send_message() */
 
      bool force_slave;
 
      struct mm_struct *mm;
 
-     pid_t dispatcher_pid;
+     pid_t dispatcher_pid;              /* last dispatcher */
+
+     struct {
+          int            count;             /* executions that asked for a boost */
+          int            prio;              /* real time priority given to the dispatcher, zero if none */
+          struct pid    *tid;               /* boosted dispatcher, NULL if none */
+          int            policy;            /* scheduling policy and ... */
+          int            rt_priority;       /* ... priority to restore */
+     } boost;
 
      FusionDev *fusion_dev;
 
      char exe_file[PATH_MAX];
 
      int            wait_on_call_quota;
+
+     struct {
+          int            call_id;
+          int            quotas;            /* number of quotas the call had at lookup */
+          void          *quota;             /* NULL if not limited */
+     } call_quota;                          /* last quota looked up when executing a call */
+
+     struct {
+          FusionLink    *local_refs;        /* LocalRef of each ref with local references */
+          FusionLink    *ref_locks;         /* refs zero locked */
+          FusionLink    *reactor_nodes;     /* ReactorNode of each reactor attached */
+          FusionLink    *shmpool_nodes;     /* SHMPoolNode of each pool attached */
+          FusionLink    *properties;        /* properties leased or purchased */
+          FusionLink    *skirmish_holders;  /* SkirmishHolder of each task holding skirmishs */
+          FusionLink    *skirmish_words;    /* WordUser of each lock word got */
+     } held;                                /* released in fusionee_destroy() and copied in fusionee_fork() */
+
+     struct {
+          FusionReceiveRing *header;      /* mapped by the receiver */
+          char              *data;
+          unsigned int       size;
+          unsigned int       head;        /* don't trust the one in the header */
+     } ring;
+
+     struct {
+          FusionRefDeltaLog *log;         /* mapped by the fusionee, see ref.c */
+          unsigned int       tail;        /* don't trust the one in the log */
+     } ref_deltas;
 };
 
 
@@ -70,6 +112,9 @@ typedef enum {
 
 /* module init/cleanup */
 
+int fusionee_caches_init(void);
+void fusionee_caches_deinit(void);
+
 int fusionee_init(FusionDev * dev);
 void fusionee_deinit(FusionDev * dev);
 
@@ -111,6 +156,54 @@ int fusionee_send_message2(FusionDev * dev,
                            const void *extra_data, unsigned int extra_size,
                            bool flush);
 
+/*
+ * Message data copied from user space once and shared by the packets of all recipients.
+ */
+int fusionee_message_data_new(const void *msg_data, int msg_size,
+                              MessageData ** ret_data);
+
+const void *fusionee_message_data(const MessageData * data);
+
+void fusionee_message_data_unref(MessageData * data);
+
+int fusionee_send_message_data(FusionDev * dev,
+                               Fusionee * sender,
+                               Fusionee * recipient,
+                               FusionMessageType msg_type,
+                               int msg_id,
+                               int msg_channel,
+                               MessageData * data,
+                               FusionMessageCallback callback,
+                               void *callback_ctx, int callback_param,
+                               bool flush);
+
+/*
+ * Same as fusionee_send_message2(), but flushed calls from real time callers (prio > 0)
+ * are read before anything else queued for the recipient, unless the sender has
+ * queued messages as well.
+ */
+int fusionee_send_message_prio(FusionDev * dev,
+                               Fusionee * sender,
+                               Fusionee * recipient,
+                               FusionMessageType msg_type,
+                               int msg_id,
+                               int msg_channel,
+                               int msg_size,
+                               const void *msg_data,
+                               FusionMessageCallback callback,
+                               void *callback_ctx, int callback_param,
+                               const void *extra_data, unsigned int extra_size,
+                               bool flush,
+                               int prio);
+
+/*
+ * Lets the dispatcher run at real time priority prio (if higher) until every
+ * boost has been matched by fusionee_unboost().
+ */
+void fusionee_boost(FusionDev * dev, Fusionee * fusionee, int prio);
+
+void fusionee_unboost(FusionDev * dev, Fusionee * fusionee);
+
 int fusionee_get_messages(FusionDev * dev,
                           Fusionee * fusionee,
                           void *buf, int buf_size, bool block);
@@ -119,9 +212,21 @@ int fusionee_wait_processing(FusionDev * dev,
                              int fusion_id,
                              FusionMessageType msg_type, int msg_id);
 
+/*
+ * Drops a message that has not been read yet, if it's the only one in its packet.
+ * It is identified by type, id and the word at 'offset' within the message data.
+ */
+int fusionee_cancel_message(FusionDev * dev,
+                            Fusionee * fusionee,
+                            FusionMessageType msg_type, int msg_id,
+                            size_t offset, unsigned int value);
+
 int fusionee_remove_message_callbacks(Fusionee  *recipient,
                                       void      *ctx);
 
+int fusionee_map_ring(FusionDev * dev,
+                      Fusionee * fusionee, struct vm_area_struct *vma);
+
 unsigned
 int fusionee_poll(FusionDev * dev,
                   Fusionee * fusionee, struct file *file, poll_table * wait);
@@ -137,7 +242,20 @@ void fusionee_destroy(FusionDev * dev, Fusionee * fusionee);
 
 FusionID fusionee_id(const Fusionee * fusionee);
 
-pid_t fusionee_dispatcher_pid(FusionDev * dev, FusionID fusion_id);
+int fusionee_lookup(FusionDev * dev, FusionID id, Fusionee ** ret_fusionee);
+
+/*
+ * Registers the current thread as one of several dispatchers or removes it again,
+ * see FUSION_DISPATCHER_ENTER.
+ */
+int fusionee_enter_dispatcher(FusionDev * dev, Fusionee * fusionee);
+int fusionee_leave_dispatcher(FusionDev * dev, Fusionee * fusionee);
+
+/*
+ * Checks if the current thread dispatches the call of that serial, i.e. may lock skirmishs
+ * transferred for it. With a single dispatcher, it's any call of the fusionee.
+ */
+bool fusionee_dispatching(FusionDev * dev, FusionID fusion_id, int call_id, unsigned int serial);
 
 
 #endif
@@ -254,11 +254,11 @@ direct_list_move_to_front( DirectLink **list, DirectLink *link )
 #define direct_list_check_link( link )                      \
      ({                                                     \
           D_MAGIC_ASSERT_IF( link, DirectLink );            \
-          link != NULL;                                     \
+          (link) != NULL;                                   \
      })
 #else
 #define direct_list_check_link( link )                      \
-          (link != NULL)
+          ((link) != NULL)
 #endif
 
 #define direct_list_foreach(elem, list)                     \
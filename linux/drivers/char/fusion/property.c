@@ -47,8 +47,36 @@ typedef struct {
      unsigned long purchase_stamp;
      int lock_pid;
      int count;          /* lock counter */
+
+     FusionLink fusionee_link;  /* in held.properties of the fusionee */
+     Fusionee *fusionee;        /* NULL if available */
 } FusionProperty;
 
+/*
+ * Sets or clears the holder, keeping the index of the fusionee up to date.
+ */
+static void
+property_set_holder(FusionDev * dev, FusionProperty * property, int fusion_id)
+{
+     if (property->fusionee) {
+          fusion_list_remove(&property->fusionee->held.properties, &property->fusionee_link);
+
+          property->fusionee = NULL;
+     }
+
+     property->fusion_id = fusion_id;
+
+     if (fusion_id && !fusionee_lookup(dev, fusion_id, &property->fusionee))
+          fusion_list_prepend(&property->fusionee->held.properties, &property->fusionee_link);
+}
+
+static void fusion_property_destruct(FusionEntry * entry, void *ctx)
+{
+     FusionProperty *property = (FusionProperty *) entry;
+
+     property_set_holder(ctx, property, 0);
+}
+
 static void
 fusion_property_print(FusionEntry * entry, void *ctx, struct seq_file *p)
 {
@@ -66,7 +94,7 @@ fusion_property_print(FusionEntry * entry, void *ctx, struct seq_file *p)
      seq_printf(p, "\n");
 }
 
-FUSION_ENTRY_CLASS(FusionProperty, property, NULL, NULL, fusion_property_print)
+FUSION_ENTRY_CLASS(FusionProperty, property, NULL, fusion_property_destruct, fusion_property_print)
 
 /******************************************************************************/
 int fusion_property_init(FusionDev * dev)
@@ -108,7 +136,7 @@ int fusion_property_lease(FusionDev * dev, int id, int fusion_id)
           switch (property->state) {
                case FUSION_PROPERTY_AVAILABLE:
                     property->state = FUSION_PROPERTY_LEASED;
-                    property->fusion_id = fusion_id;
+                    property_set_holder(dev, property, fusion_id);
                     property->lock_pid = fusion_core_pid( fusion_core );
                     property->count = 1;
 
@@ -172,7 +200,7 @@ int fusion_property_purchase(FusionDev * dev, int id, int fusion_id)
           switch (property->state) {
                case FUSION_PROPERTY_AVAILABLE:
                     property->state = FUSION_PROPERTY_PURCHASED;
-                    property->fusion_id = fusion_id;
+                    property_set_holder(dev, property, fusion_id);
                     property->purchase_stamp = jiffies;
                     property->lock_pid = fusion_core_pid( fusion_core );
                     property->count = 1;
@@ -242,9 +270,10 @@ int fusion_property_cede(FusionDev * dev, int id, int fusion_id)
      purchased = (property->state == FUSION_PROPERTY_PURCHASED);
 
      property->state = FUSION_PROPERTY_AVAILABLE;
-     property->fusion_id = 0;
      property->lock_pid = 0;
 
+     property_set_holder(dev, property, 0);
+
      fusion_property_notify(property);
 
      return 0;
@@ -278,19 +307,16 @@ int fusion_property_destroy(FusionDev * dev, int id)
      return fusion_entry_destroy(&dev->properties, id);
 }
 
-void fusion_property_cede_all(FusionDev * dev, int fusion_id)
+void fusion_property_cede_all(FusionDev * dev, Fusionee * fusionee)
 {
-     FusionLink *l;
+     FusionProperty *property, *next;
 
-     fusion_list_foreach(l, dev->properties.list) {
-          FusionProperty *property = (FusionProperty *) l;
+     direct_list_foreach_via_safe(property, next, fusionee->held.properties, fusionee_link) {
+          property->state = FUSION_PROPERTY_AVAILABLE;
+          property->lock_pid = 0;
 
-          if (property->fusion_id == fusion_id) {
-               property->state = FUSION_PROPERTY_AVAILABLE;
-               property->fusion_id = 0;
-               property->lock_pid = 0;
+          property_set_holder(dev, property, 0);
 
-               fusion_core_wq_wake( fusion_core, &property->entry.wait);
-          }
+          fusion_core_wq_wake( fusion_core, &property->entry.wait);
      }
 }
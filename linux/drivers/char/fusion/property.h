@@ -39,6 +39,6 @@ int fusion_property_destroy(FusionDev * dev, int id);
 
 /* internal functions */
 
-void fusion_property_cede_all(FusionDev * dev, int fusion_id);
+void fusion_property_cede_all(FusionDev * dev, Fusionee * fusionee);
 
 #endif
@@ -34,14 +34,31 @@
 #include "reactor.h"
 #include "shmpool.h"
 
+typedef struct __Fusion_FusionReactor FusionReactor;
+typedef struct __Fusion_ReactorNode ReactorNode;
+
 typedef struct {
+     FusionLink link;     /* in the subscriptions of the channel */
+
+     ReactorNode *node;
+
+     int count;           /* number of attach calls */
+} ReactorSubscription;
+
+struct __Fusion_ReactorNode {
      FusionLink link;
 
      int fusion_id;
+     Fusionee *fusionee;  /* detached before the fusionee is destroyed */
 
-     int *counts;        /* number of attach calls */
-     int num_counts;
-} ReactorNode;
+     FusionLink fusionee_link;  /* in held.reactor_nodes of the fusionee */
+     FusionReactor *reactor;
+
+     ReactorSubscription **subscriptions;    /* per channel, if attached */
+     int num_subscriptions;
+
+     int attached;        /* number of channels attached */
+};
 
 typedef struct {
      int count;          /* number of recipients */
@@ -51,24 +68,70 @@ typedef struct {
      void *call_ptr;
 } ReactorDispatch;
 
-typedef struct {
+struct __Fusion_FusionReactor {
      FusionEntry entry;
 
      FusionLink *nodes;
 
+     FusionLink **channels;   /* subscriptions per channel */
+     int num_channels;
+
      int dispatch_count;
 
      bool destroyed;
 
      int call_id;
      void *call_ptr;
-} FusionReactor;
+};
 
 /******************************************************************************/
 
+static FusionCache node_cache;
+static FusionCache dispatch_cache;
+static FusionCache subscription_cache;
+
+int fusion_reactor_caches_init(void)
+{
+     if (fusion_core_cache_init( fusion_core, &node_cache, "fusion_reactor_node", sizeof(ReactorNode) ))
+          goto error_node;
+
+     if (fusion_core_cache_init( fusion_core, &dispatch_cache, "fusion_reactor_dispatch", sizeof(ReactorDispatch) ))
+          goto error_dispatch;
+
+     if (fusion_core_cache_init( fusion_core, &subscription_cache, "fusion_reactor_subscription", sizeof(ReactorSubscription) ))
+          goto error_subscription;
+
+     return 0;
+
+error_subscription:
+     fusion_core_cache_deinit( fusion_core, &dispatch_cache );
+
+error_dispatch:
+     fusion_core_cache_deinit( fusion_core, &node_cache );
+
+error_node:
+     return -ENOMEM;
+}
+
+void fusion_reactor_caches_deinit(void)
+{
+     fusion_core_cache_deinit( fusion_core, &subscription_cache );
+     fusion_core_cache_deinit( fusion_core, &dispatch_cache );
+     fusion_core_cache_deinit( fusion_core, &node_cache );
+}
+
+/******************************************************************************/
+
+static ReactorNode *new_node(FusionReactor * reactor, Fusionee * fusionee);
 static int fork_node(FusionReactor * reactor,
-                     FusionID fusion_id, FusionID from_id);
+                     Fusionee * fusionee, ReactorNode * node);
+
+static int subscribe(FusionReactor * reactor,
+                     ReactorNode * node, int channel, int count);
+static void unsubscribe(FusionReactor * reactor,
+                        ReactorNode * node, int channel);
 
+static void free_node(FusionReactor * reactor, ReactorNode * node);
 static void free_all_nodes(FusionReactor * reactor);
 
 /******************************************************************************/
@@ -137,11 +200,12 @@ int fusion_reactor_new(FusionDev * dev, Fusionee *fusionee, int *ret_id)
 }
 
 int
-fusion_reactor_attach(FusionDev * dev, int id, int channel, FusionID fusion_id)
+fusion_reactor_attach(FusionDev * dev, int id, int channel, Fusionee * fusionee)
 {
      int ret;
      ReactorNode *node;
      FusionReactor *reactor;
+     FusionID fusion_id = fusionee_id(fusionee);
 
      if (channel < 0 || channel > 1023)
           return -EINVAL;
@@ -157,47 +221,17 @@ fusion_reactor_attach(FusionDev * dev, int id, int channel, FusionID fusion_id)
 
      node = get_node(reactor, fusion_id);
      if (!node) {
-          int ncount = channel + 4;
-
-          node = fusion_core_malloc( fusion_core, sizeof(ReactorNode) );
+          node = new_node(reactor, fusionee);
           if (!node)
                return -ENOMEM;
-
-          node->counts = fusion_core_malloc( fusion_core, sizeof(int) * ncount );
-          if (!node->counts) {
-               fusion_core_free( fusion_core, node);
-               return -ENOMEM;
-          }
-
-          memset(node->counts, 0, sizeof(int) * ncount);
-
-          node->num_counts = ncount;
-          node->fusion_id = fusion_id;
-
-          node->counts[channel] = 1;
-
-          fusion_list_prepend(&reactor->nodes, &node->link);
      }
-     else {
-          if (node->num_counts <= channel) {
-               int ncount = channel + 4;
-               int *counts = fusion_core_malloc( fusion_core, sizeof(int) * ncount );
-
-               if (!counts)
-                    return -ENOMEM;
 
-               memcpy(counts, node->counts,
-                      sizeof(int) * node->num_counts);
-               memset(counts + node->num_counts, 0,
-                      sizeof(int) * (ncount - node->num_counts));
+     ret = subscribe(reactor, node, channel, 1);
+     if (ret) {
+          if (!node->attached)
+               free_node(reactor, node);
 
-               fusion_core_free( fusion_core, node->counts);
-
-               node->counts = counts;
-               node->num_counts = ncount;
-          }
-
-          node->counts[channel]++;
+          return ret;
      }
 
      return 0;
@@ -220,22 +254,14 @@ fusion_reactor_detach(FusionDev * dev, int id, int channel, FusionID fusion_id)
      dev->stat.reactor_detach++;
 
      node = get_node(reactor, fusion_id);
-     if (!node || node->num_counts <= channel)
+     if (!node || node->num_subscriptions <= channel || !node->subscriptions[channel])
           return -EIO;
 
-     if (!--node->counts[channel]) {
-          int i;
-
-          for (i = 0; i < node->num_counts; i++) {
-               if (node->counts[i])
-                    break;
-          }
+     if (!--node->subscriptions[channel]->count) {
+          unsubscribe(reactor, node, channel);
 
-          if (i == node->num_counts) {
-               fusion_list_remove(&reactor->nodes, &node->link);
-               fusion_core_free( fusion_core, node->counts);
-               fusion_core_free( fusion_core, node);
-          }
+          if (!node->attached)
+               free_node(reactor, node);
      }
 
      if (reactor->destroyed && !reactor->nodes)
@@ -247,36 +273,25 @@ fusion_reactor_detach(FusionDev * dev, int id, int channel, FusionID fusion_id)
 void
 fusion_reactor_dispatch_message_callback(FusionDev * dev, int id, void *ctx, int arg)
 {
-     FusionLink *l;
-     FusionReactor *reactor = NULL;
+     FusionReactor *reactor;
      ReactorDispatch *dispatch = ctx;
 
-     // FIXME: use entry lookup via hash table, or add reactor pointer to dispatch if possible
-     fusion_list_foreach(l, dev->reactor.list) {
-          reactor = (FusionReactor *) l;
-
-          if (reactor->entry.id == id) {
-               if (!--dispatch->count) {
-                    FusionCallExecute execute;
-
-                    execute.call_id = dispatch->call_id;
-                    execute.call_arg = dispatch->call_arg;
-                    execute.call_ptr = dispatch->call_ptr;
-                    execute.flags    = FCEF_ONEWAY;
+     if (--dispatch->count)
+          return;
 
-                    fusion_call_execute(dev, NULL, &execute);
+     /* The reactor may have been destroyed meanwhile. */
+     if (!fusion_reactor_lookup(&dev->reactor, id, &reactor)) {
+          FusionCallExecute execute;
 
-                    fusion_core_free( fusion_core, dispatch);
-               }
+          execute.call_id = dispatch->call_id;
+          execute.call_arg = dispatch->call_arg;
+          execute.call_ptr = dispatch->call_ptr;
+          execute.flags    = FCEF_ONEWAY;
 
-               break;
-          }
+          fusion_call_execute(dev, NULL, &execute);
      }
 
-     if (!reactor) {
-          if (!--dispatch->count)
-               fusion_core_free( fusion_core, dispatch);
-     }
+     fusion_core_cache_free( fusion_core, &dispatch_cache, dispatch);
 }
 
 int
@@ -284,9 +299,11 @@ fusion_reactor_dispatch(FusionDev * dev, int id, int channel,
                         Fusionee * fusionee, int msg_size, const void *msg_data)
 {
      int ret;
-     FusionLink *l;
      FusionReactor *reactor;
+     FusionLink *subscriptions = NULL;
+     ReactorSubscription *subscription;
      ReactorDispatch *dispatch = NULL;
+     MessageData *data = NULL;
      FusionID fusion_id = fusionee ? fusionee_id(fusionee) : 0;
 
      if (channel < 0 || channel > 1023)
@@ -299,12 +316,28 @@ fusion_reactor_dispatch(FusionDev * dev, int id, int channel,
      if (reactor->destroyed)
           return -EIDRM;
 
+     /* Only visit fusionees attached to the channel. */
+     if (channel < reactor->num_channels)
+          subscriptions = reactor->channels[channel];
+
+     /* Copy the message from user space once for all recipients. */
+     if (subscriptions || reactor->call_id) {
+          ret = fusionee_message_data_new( msg_data, msg_size, &data );
+          if (ret)
+               return ret;
+     }
+
      if (reactor->call_id) {
-          void *ptr = *(void **)msg_data;
+          void *ptr = NULL;
+
+          if (msg_size == sizeof(ptr))
+               memcpy( &ptr, fusionee_message_data( data ), sizeof(ptr) );
 
-          dispatch = fusion_core_malloc( fusion_core, sizeof(ReactorDispatch) );
-          if (!dispatch)
+          dispatch = fusion_core_cache_alloc( fusion_core, &dispatch_cache );
+          if (!dispatch) {
+               fusionee_message_data_unref( data );
                return -ENOMEM;
+          }
 
           dispatch->count = 0;
           dispatch->call_id = reactor->call_id;
@@ -322,33 +355,33 @@ fusion_reactor_dispatch(FusionDev * dev, int id, int channel,
 
      dev->stat.reactor_dispatch++;
 
-     fusion_list_foreach(l, reactor->nodes) {
-          ReactorNode *node = (ReactorNode *) l;
+     fusion_list_foreach(subscription, subscriptions) {
+          ReactorNode *node = subscription->node;
 
-          if (node->fusion_id == fusion_id || node->num_counts <= channel
-              || !node->counts[channel])
+          if (node->fusion_id == fusion_id)
                continue;
 
           if (dispatch) {
                dispatch->count++;
 
                ret =
-               fusionee_send_message(dev, fusionee,
-                                     node->fusion_id, FMT_REACTOR,
-                                     reactor->entry.id, channel,
-                                     msg_size, msg_data,
-                                     FMC_DISPATCH, dispatch,
-                                     reactor->entry.id, NULL, 0);
+               fusionee_send_message_data(dev, fusionee,
+                                          node->fusionee, FMT_REACTOR,
+                                          reactor->entry.id, channel, data,
+                                          FMC_DISPATCH, dispatch,
+                                          reactor->entry.id, true);
           }
           else
                ret =
-               fusionee_send_message(dev, fusionee,
-                                     node->fusion_id, FMT_REACTOR,
-                                     reactor->entry.id, channel,
-                                     msg_size, msg_data, FMC_NONE,
-                                     NULL, 0, NULL, 0);
+               fusionee_send_message_data(dev, fusionee,
+                                          node->fusionee, FMT_REACTOR,
+                                          reactor->entry.id, channel, data,
+                                          FMC_NONE, NULL, 0, true);
      }
 
+     if (data)
+          fusionee_message_data_unref( data );
+
      if (dispatch && !dispatch->count) {
           FusionCallExecute execute;
 
@@ -359,7 +392,7 @@ fusion_reactor_dispatch(FusionDev * dev, int id, int channel,
 
           fusion_call_execute(dev, NULL, &execute);
 
-          fusion_core_free( fusion_core, dispatch);
+          fusion_core_cache_free( fusion_core, &dispatch_cache, dispatch);
      }
 
      return 0;
@@ -405,23 +438,14 @@ int fusion_reactor_destroy(FusionDev * dev, int id)
      return 0;
 }
 
-void fusion_reactor_detach_all(FusionDev * dev, FusionID fusion_id)
+void fusion_reactor_detach_all(FusionDev * dev, Fusionee * fusionee)
 {
-     FusionLink *l, *n;
-
-     fusion_list_foreach_safe(l, n, dev->reactor.list) {
-          ReactorNode *node;
-          FusionReactor *reactor = (FusionReactor *) l;
-
-          fusion_list_foreach(node, reactor->nodes) {
-               if (node->fusion_id == fusion_id) {
-                    fusion_list_remove(&reactor->nodes,
-                                       &node->link);
-                    fusion_core_free( fusion_core, node->counts);
-                    fusion_core_free( fusion_core, node);
-                    break;
-               }
-          }
+     ReactorNode *node, *next;
+
+     direct_list_foreach_via_safe(node, next, fusionee->held.reactor_nodes, fusionee_link) {
+          FusionReactor *reactor = node->reactor;
+
+          free_node(reactor, node);
 
           if (reactor->destroyed && !reactor->nodes)
                fusion_entry_destroy_locked(&dev->reactor,
@@ -430,15 +454,13 @@ void fusion_reactor_detach_all(FusionDev * dev, FusionID fusion_id)
 }
 
 int
-fusion_reactor_fork_all(FusionDev * dev, FusionID fusion_id, FusionID from_id)
+fusion_reactor_fork_all(FusionDev * dev, Fusionee * fusionee, Fusionee * from)
 {
-     FusionLink *l;
+     ReactorNode *node;
      int ret = 0;
 
-     fusion_list_foreach(l, dev->reactor.list) {
-          FusionReactor *reactor = (FusionReactor *) l;
-
-          ret = fork_node(reactor, fusion_id, from_id);
+     direct_list_foreach_via(node, from->held.reactor_nodes, fusionee_link) {
+          ret = fork_node(node->reactor, fusionee, node);
           if (ret)
                break;
      }
@@ -449,49 +471,171 @@ fusion_reactor_fork_all(FusionDev * dev, FusionID fusion_id, FusionID from_id)
 /******************************************************************************/
 
 static int
-fork_node(FusionReactor * reactor, FusionID fusion_id, FusionID from_id)
+grow_subscriptions(ReactorNode * node, int channel)
+{
+     int ncount = channel + 4;
+     ReactorSubscription **subscriptions;
+
+     if (node->num_subscriptions > channel)
+          return 0;
+
+     subscriptions = fusion_core_malloc( fusion_core, sizeof(ReactorSubscription *) * ncount );
+     if (!subscriptions)
+          return -ENOMEM;
+
+     if (node->subscriptions) {
+          memcpy(subscriptions, node->subscriptions,
+                 sizeof(ReactorSubscription *) * node->num_subscriptions);
+
+          fusion_core_free( fusion_core, node->subscriptions);
+     }
+
+     node->subscriptions = subscriptions;
+     node->num_subscriptions = ncount;
+
+     return 0;
+}
+
+static int
+grow_channels(FusionReactor * reactor, int channel)
+{
+     int ncount = channel + 4;
+     FusionLink **channels;
+
+     if (reactor->num_channels > channel)
+          return 0;
+
+     channels = fusion_core_malloc( fusion_core, sizeof(FusionLink *) * ncount );
+     if (!channels)
+          return -ENOMEM;
+
+     if (reactor->channels) {
+          memcpy(channels, reactor->channels,
+                 sizeof(FusionLink *) * reactor->num_channels);
+
+          fusion_core_free( fusion_core, reactor->channels);
+     }
+
+     reactor->channels = channels;
+     reactor->num_channels = ncount;
+
+     return 0;
+}
+
+static int
+subscribe(FusionReactor * reactor, ReactorNode * node, int channel, int count)
+{
+     ReactorSubscription *subscription;
+
+     if (grow_subscriptions(node, channel) || grow_channels(reactor, channel))
+          return -ENOMEM;
+
+     subscription = node->subscriptions[channel];
+     if (!subscription) {
+          subscription = fusion_core_cache_alloc( fusion_core, &subscription_cache );
+          if (!subscription)
+               return -ENOMEM;
+
+          subscription->node = node;
+          subscription->count = 0;
+
+          fusion_list_prepend(&reactor->channels[channel], &subscription->link);
+
+          node->subscriptions[channel] = subscription;
+          node->attached++;
+     }
+
+     subscription->count += count;
+
+     return 0;
+}
+
+static void
+unsubscribe(FusionReactor * reactor, ReactorNode * node, int channel)
+{
+     ReactorSubscription *subscription = node->subscriptions[channel];
+
+     FUSION_ASSERT(subscription != NULL);
+
+     fusion_list_remove(&reactor->channels[channel], &subscription->link);
+
+     fusion_core_cache_free( fusion_core, &subscription_cache, subscription);
+
+     node->subscriptions[channel] = NULL;
+     node->attached--;
+}
+
+static ReactorNode *new_node(FusionReactor * reactor, Fusionee * fusionee)
 {
      ReactorNode *node;
 
-     fusion_list_foreach(node, reactor->nodes) {
-          if (node->fusion_id == from_id) {
-               ReactorNode *new_node;
+     node = fusion_core_cache_alloc( fusion_core, &node_cache );
+     if (!node)
+          return NULL;
+
+     memset(node, 0, sizeof(ReactorNode));
 
-               new_node = fusion_core_malloc( fusion_core, sizeof(ReactorNode) );
-               if (!new_node) {
-                    return -ENOMEM;
-               }
+     node->fusion_id = fusionee_id(fusionee);
+     node->fusionee = fusionee;
+     node->reactor = reactor;
 
-               new_node->counts = fusion_core_malloc( fusion_core, sizeof(int) * node->num_counts );
-               if (!new_node->counts) {
-                    fusion_core_free( fusion_core, new_node);
-                    return -ENOMEM;
-               }
+     fusion_list_prepend(&reactor->nodes, &node->link);
+     fusion_list_prepend(&fusionee->held.reactor_nodes, &node->fusionee_link);
 
-               new_node->fusion_id = fusion_id;
-               new_node->num_counts = node->num_counts;
+     return node;
+}
+
+static int
+fork_node(FusionReactor * reactor, Fusionee * fusionee, ReactorNode * node)
+{
+     int i;
+     int ret;
+     ReactorNode *fork;
 
-               memcpy(new_node->counts, node->counts,
-                      sizeof(int) * node->num_counts);
+     fork = new_node(reactor, fusionee);
+     if (!fork)
+          return -ENOMEM;
 
-               fusion_list_prepend(&reactor->nodes, &new_node->link);
+     for (i = 0; i < node->num_subscriptions; i++) {
+          if (!node->subscriptions[i])
+               continue;
 
-               break;
+          ret = subscribe(reactor, fork, i, node->subscriptions[i]->count);
+          if (ret) {
+               free_node(reactor, fork);
+               return ret;
           }
      }
 
      return 0;
 }
 
+static void free_node(FusionReactor * reactor, ReactorNode * node)
+{
+     int i;
+
+     for (i = 0; i < node->num_subscriptions && node->attached; i++) {
+          if (node->subscriptions[i])
+               unsubscribe(reactor, node, i);
+     }
+
+     fusion_list_remove(&reactor->nodes, &node->link);
+     fusion_list_remove(&node->fusionee->held.reactor_nodes, &node->fusionee_link);
+
+     fusion_core_free( fusion_core, node->subscriptions);
+     fusion_core_cache_free( fusion_core, &node_cache, node);
+}
+
 static void free_all_nodes(FusionReactor * reactor)
 {
      FusionLink *n;
      ReactorNode *node;
 
-     fusion_list_foreach_safe(node, n, reactor->nodes) {
-          fusion_core_free( fusion_core, node->counts);
-          fusion_core_free( fusion_core, node);
-     }
+     fusion_list_foreach_safe(node, n, reactor->nodes)
+          free_node(reactor, node);
+
+     fusion_core_free( fusion_core, reactor->channels);
 
-     reactor->nodes = NULL;
+     reactor->channels = NULL;
+     reactor->num_channels = 0;
 }
@@ -20,6 +20,9 @@
 
 /* module init/cleanup */
 
+int fusion_reactor_caches_init(void);
+void fusion_reactor_caches_deinit(void);
+
 int fusion_reactor_init(FusionDev * dev);
 void fusion_reactor_deinit(FusionDev * dev);
 
@@ -28,7 +31,7 @@ void fusion_reactor_deinit(FusionDev * dev);
 int fusion_reactor_new(FusionDev * dev, Fusionee *fusionee, int *id);
 
 int fusion_reactor_attach(FusionDev * dev,
-                          int id, int channel, FusionID fusion_id);
+                          int id, int channel, Fusionee * fusionee);
 
 int fusion_reactor_detach(FusionDev * dev,
                           int id, int channel, FusionID fusion_id);
@@ -46,10 +49,10 @@ int fusion_reactor_set_dispatch_callback(FusionDev * dev,
 
 /* internal functions */
 
-void fusion_reactor_detach_all(FusionDev * dev, FusionID fusion_id);
+void fusion_reactor_detach_all(FusionDev * dev, Fusionee * fusionee);
 
 int fusion_reactor_fork_all(FusionDev * dev,
-                            FusionID fusion_id, FusionID from_id);
+                            Fusionee * fusionee, Fusionee * from);
 
 
 
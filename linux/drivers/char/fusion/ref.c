@@ -24,12 +24,15 @@
 #endif
 #include <linux/sched.h>
 #include <linux/proc_fs.h>
+#include <linux/mm.h>
+#include <asm/io.h>
 
 #include <linux/fusion.h>
 
 #include "fusiondev.h"
 #include "fusionee.h"
 #include "list.h"
+#include "hash.h"
 #include "call.h"
 #include "ref.h"
 
@@ -39,12 +42,12 @@ typedef struct {
      FusionLink link;
      FusionID fusion_id;
      int refs;
-} LocalRef;
+     int throws;         /* thrown and not caught yet */
 
-typedef struct {
-     FusionLink link;
+     FusionLink fusionee_link;  /* in held.local_refs of the fusionee */
+     Fusionee *fusionee;
      FusionRef *ref;
-} Inheritor;
+} LocalRef;
 
 typedef struct {
      FusionLink link;
@@ -56,41 +59,213 @@ struct __Fusion_FusionRef {
      FusionEntry entry;
 
      int global;
-     int local;
+     int local;          /* own local references, see ref_local() for the inherited ones */
 
      int locked;         /* non-zero fusion id of lock owner */
+     FusionLink lock_link;    /* in held.ref_locks of the lock owner */
+     Fusionee *locker;
 
      bool watched;       /* true if watch has been installed */
      bool syncwatch;     /* true if watch is executed synchronously */
+     bool batchwatch;    /* true if watch may be executed along with others, see RefBatch */
      int call_id;        /* id of call registered with a watch */
      int call_arg;       /* optional call parameter */
 
      FusionRef *inherited;
+     FusionLink inherit_link; /* in inheritors of the ref inherited from */
+     bool inherits_local;     /* the ref inherited from has local references (own or inherited) */
      FusionLink *inheritors;
+     int pushed;              /* number of inheritors changes have been pushed to */
 
-     FusionLink *local_refs;
+     LocalRef local_ref;      /* first holder, valid if local_ref.fusionee is set */
+     FusionLink *local_refs;  /* other holders... */
+     FusionHash *local_hash;  /* ...by fusion id, created with the first of them */
 
      FusionLink *throws;
+
+     int counter;        /* index + 1 of the counter shared with user space, if any */
+};
+
+/*
+ * Local references including inherited ones are only counted on demand, each ref caches
+ * whether the one it inherits from has any, see push_local().
+ */
+static inline bool has_local(const FusionRef * ref)
+{
+     return ref->local || ref->inherits_local;
+}
+
+static int ref_local(const FusionRef * ref)
+{
+     int local = 0;
+
+     do {
+          local += ref->local;
+
+          if (!ref->inherits_local)
+               break;
+
+          ref = ref->inherited;
+     } while (ref);
+
+     return local;
+}
+
+/*
+ * Zero notifications of watches with the same call, collected while the local references
+ * of a fusionee are cleared and sent in a FusionCallBatchMessage.
+ */
+typedef struct {
+     FusionLink link;
+     int        call_id;
+     int        num;
+     int        call_args[FUSION_CALL_BATCH_MAX];
+} RefBatch;
+
+/**********************************************************************************************************************/
+
+static FusionCache local_cache;
+
+int fusion_ref_caches_init(void)
+{
+     if (fusion_core_cache_init( fusion_core, &local_cache, "fusion_local_ref", sizeof(LocalRef) ))
+          return -ENOMEM;
+
+     return 0;
+}
+
+void fusion_ref_caches_deinit(void)
+{
+     fusion_core_cache_deinit( fusion_core, &local_cache );
+}
+
+/**********************************************************************************************************************/
+
+/*
+ * Counters for reading in user space, see FusionRefCounter.
+ */
+#define REF_COUNTERS  (PAGE_SIZE / sizeof(FusionRefCounter))
+
+struct __Fusion_RefCounters {
+     FusionRefCounter *table;        /* mapped by user space */
+
+     FusionRef        *refs[REF_COUNTERS];
 };
 
+static RefCounters *
+counters_get(FusionDev * dev)
+{
+     RefCounters *counters = dev->ref_counters;
+
+     if (!counters) {
+          counters = fusion_core_malloc( fusion_core, sizeof(RefCounters) );
+          if (!counters)
+               return NULL;
+
+          memset( counters, 0, sizeof(RefCounters) );
+
+          counters->table = (FusionRefCounter *) get_zeroed_page( GFP_KERNEL );
+          if (!counters->table) {
+               fusion_core_free( fusion_core, counters );
+               return NULL;
+          }
+
+          SetPageReserved( virt_to_page( counters->table ) );
+
+          dev->ref_counters = counters;
+     }
+
+     return counters;
+}
+
+static void
+counters_free(FusionDev * dev)
+{
+     RefCounters *counters = dev->ref_counters;
+
+     if (!counters)
+          return;
+
+     ClearPageReserved( virt_to_page( counters->table ) );
+
+     free_page( (unsigned long) counters->table );
+
+     fusion_core_free( fusion_core, counters );
+
+     dev->ref_counters = NULL;
+}
+
+static void
+counter_write(FusionRefCounter * counter, int global, int local)
+{
+     counter->sequence++;
+     smp_wmb();
+
+     counter->global = global;
+     counter->local  = local;
+
+     smp_wmb();
+     counter->sequence++;
+}
+
+static void
+counter_publish(FusionDev * dev, FusionRef * ref)
+{
+     FusionRefCounter *counter;
+
+     if (!ref->counter)
+          return;
+
+     counter = &dev->ref_counters->table[ref->counter - 1];
+
+     counter_write(counter, ref->global, ref_local(ref));
+}
+
+/*
+ * Delta logs of local references, see FusionRefDeltaLog.
+ *
+ * Entries never take the count of the fusionee to or from zero, so the log of other
+ * fusionees doesn't matter when a ref is about to reach zero, nor for zero locking.
+ */
+#define REF_DELTAS  ((PAGE_SIZE - sizeof(FusionRefDeltaLog)) / sizeof(FusionRefDelta))
+
+static void
+deltas_free(Fusionee * fusionee)
+{
+     FusionRefDeltaLog *log = fusionee->ref_deltas.log;
+
+     if (!log)
+          return;
+
+     ClearPageReserved( virt_to_page( log ) );
+
+     free_page( (unsigned long) log );
+
+     fusionee->ref_deltas.log = NULL;
+}
+
 /**********************************************************************************************************************/
 
-static int get_local(FusionRef * ref, FusionID fusion_id);
-static int get_throws(FusionRef * ref, FusionID fusion_id);
+static LocalRef *lookup_local(FusionRef * ref, FusionID fusion_id);
 
-static int add_throw(FusionRef * ref, FusionID fusion_id, FusionID catcher);
+static int add_throw(FusionRef * ref, LocalRef * local, FusionID catcher);
 
-static int add_local(FusionRef * ref, FusionID fusion_id, int add);
-static void clear_local(FusionDev * dev, FusionRef * ref, FusionID fusion_id);
-static int fork_local(FusionDev * dev, FusionRef * ref, FusionID fusion_id,
-                      FusionID from_id);
+static int add_local(FusionDev * dev, FusionRef * ref, FusionID fusion_id, int add);
+static void clear_local(FusionDev * dev, LocalRef * local);
+static void free_local(FusionRef * ref, LocalRef * local);
 static void free_all_local(FusionRef * ref);
 
+static void set_locked(FusionDev * dev, FusionRef * ref, FusionID fusion_id);
+
+static int apply_delta(FusionDev * dev, Fusionee * fusionee, const FusionRefDelta * delta);
+
 static int propagate_local(FusionDev * dev, FusionRef * ref, int diff, bool async);
+static void push_local(FusionDev * dev, FusionRef * ref, bool async);
 
 static void notify_ref(FusionDev * dev, FusionRef * ref, bool async);
+static int batch_notify(FusionDev * dev, FusionRef * ref);
+static void flush_batch(FusionDev * dev, RefBatch * batch);
 
-static int add_inheritor(FusionRef * ref, FusionRef * from);
 static void remove_inheritor(FusionRef * ref, FusionRef * from);
 static void drop_inheritors(FusionDev * dev, FusionRef * ref);
 
@@ -101,8 +276,16 @@ static void fusion_ref_destruct(FusionEntry * entry, void *ctx)
      FusionRef *ref = (FusionRef *) entry;
      FusionDev *dev = (FusionDev *) ctx;
 
+     if (ref->counter) {
+          counter_write(&dev->ref_counters->table[ref->counter - 1], 0, 0);
+
+          dev->ref_counters->refs[ref->counter - 1] = NULL;
+     }
+
      drop_inheritors(dev, ref);
 
+     set_locked(dev, ref, 0);
+
      if (ref->inherited)
           remove_inheritor(ref, ref->inherited);
 
@@ -116,11 +299,17 @@ static void fusion_ref_print(FusionEntry * entry, void *ctx, struct seq_file *p)
 
      if (ref->locked) {
           seq_printf(p, "%2d %2d (locked by %d)\n", ref->global,
-                     ref->local, ref->locked);
+                     ref_local(ref), ref->locked);
           return;
      }
 
-     seq_printf(p, "%2d %2d", ref->global, ref->local);
+     seq_printf(p, "%2d %2d", ref->global, ref_local(ref));
+
+     if (ref->pushed)
+          seq_printf(p, "  (pushed %d)", ref->pushed);
+
+     if (ref->local_ref.fusionee && ref->local_ref.refs)
+          seq_printf(p, "  0x%08lx(%d)", ref->local_ref.fusion_id, ref->local_ref.refs);
 
      fusion_list_foreach(l, ref->local_refs) {
           LocalRef *local = (LocalRef *) l;
@@ -150,6 +339,9 @@ void fusion_ref_deinit(FusionDev * dev)
      fusion_entries_destroy_proc_entry( dev, "refs" );
 
      fusion_entries_deinit(&dev->ref);
+
+     if (!dev->refs)
+          counters_free(dev);
 }
 
 /**********************************************************************************************************************/
@@ -176,15 +368,18 @@ int fusion_ref_up(FusionDev * dev, int id, FusionID fusion_id)
      }
 
      if (fusion_id) {
-          ret = add_local(ref, fusion_id, 1);
+          ret = add_local(dev, ref, fusion_id, 1);
           if (ret)
                return ret;
 
           ret = propagate_local(dev, ref, 1, false);
      }
-     else
+     else {
           ref->global ++;
 
+          counter_publish(dev, ref);
+     }
+
      return 0;
 }
 
@@ -207,7 +402,7 @@ int fusion_ref_down(FusionDev * dev, int id, FusionID fusion_id)
           if (!ref->local)
                return ret;
 
-          ret = add_local(ref, fusion_id, -1);
+          ret = add_local(dev, ref, fusion_id, -1);
           if (ret)
                return ret;
 
@@ -219,7 +414,9 @@ int fusion_ref_down(FusionDev * dev, int id, FusionID fusion_id)
 
           ref->global --;
 
-          if (ref->local + ref->global == 0)
+          counter_publish(dev, ref);
+
+          if (!ref->global && !has_local(ref))
                notify_ref(dev, ref, false);
      }
 
@@ -243,14 +440,18 @@ int fusion_ref_catch(FusionDev * dev, int id, FusionID fusion_id)
 
      direct_list_foreach( throw_, ref->throws ) {
           if (throw_->catcher == fusion_id) {
-               FusionID thrower = throw_->fusion_id;
+               FusionID  thrower = throw_->fusion_id;
+               LocalRef *local;
 
                fusion_list_remove( &ref->throws, &throw_->link );
 
                fusion_core_free( fusion_core, throw_ );
 
+               local = lookup_local( ref, thrower );
+               if (local)
+                    local->throws--;
 
-               ret = add_local( ref, thrower, -1 );
+               ret = add_local( dev, ref, thrower, -1 );
                if (ret)
                     return ret;
 
@@ -266,8 +467,7 @@ int fusion_ref_catch(FusionDev * dev, int id, FusionID fusion_id)
 int fusion_ref_throw(FusionDev * dev, int id, FusionID fusion_id, FusionID catcher)
 {
      int        ret;
-     int        local;
-     int        throws;
+     LocalRef  *local;
      FusionRef *ref;
 
      ret = fusion_ref_lookup(&dev->ref, id, &ref);
@@ -279,16 +479,12 @@ int fusion_ref_throw(FusionDev * dev, int id, FusionID fusion_id, FusionID catch
      if (ref->locked)
           return -EAGAIN;
 
-     local = get_local( ref, fusion_id );
-     if (!local)
-          return -EIO;
-
-     throws = get_throws( ref, fusion_id );
-     if (throws == local)
+     local = lookup_local( ref, fusion_id );
+     if (!local || local->throws == local->refs)
           return -EIO;
 
      // FIXME: cleanup on release() of thrower/catcher, timeout?
-     ret = add_throw(ref, fusion_id, catcher);
+     ret = add_throw(ref, local, catcher);
      if (ret)
           return ret;
 
@@ -308,7 +504,7 @@ int fusion_ref_zero_lock(FusionDev * dev, int id, FusionID fusion_id)
           if (ref->locked)
                return ref->locked == fusion_id ? -EIO : -EAGAIN;
 
-          if (ref->global ||ref->local) {
+          if (ref->global || has_local(ref)) {
                ret = fusion_ref_wait(ref, NULL);
                if (ret)
                     return ret;
@@ -317,7 +513,7 @@ int fusion_ref_zero_lock(FusionDev * dev, int id, FusionID fusion_id)
                break;
      }
 
-     ref->locked = fusion_id;
+     set_locked(dev, ref, fusion_id);
 
      return 0;
 }
@@ -334,10 +530,10 @@ int fusion_ref_zero_trylock(FusionDev * dev, int id, FusionID fusion_id)
      if (ref->locked)
           return ref->locked == fusion_id ? -EIO : -EAGAIN;
 
-     if (ref->global ||ref->local)
+     if (ref->global || has_local(ref))
           ret = -ETOOMANYREFS;
      else
-          ref->locked = fusion_id;
+          set_locked(dev, ref, fusion_id);
 
      return ret;
 }
@@ -354,7 +550,7 @@ int fusion_ref_zero_unlock(FusionDev * dev, int id, FusionID fusion_id)
      if (ref->locked != fusion_id)
           return -EIO;
 
-     ref->locked = 0;
+     set_locked(dev, ref, 0);
 
      return 0;
 }
@@ -368,7 +564,7 @@ int fusion_ref_stat(FusionDev * dev, int id, int *refs)
      if (ret)
           return ret;
 
-     *refs = ref->global +ref->local;
+     *refs = ref->global + ref_local(ref);
 
      return 0;
 }
@@ -385,7 +581,7 @@ int fusion_ref_watch(FusionDev * dev, int id, int call_id, int call_arg)
      if (ref->entry.pid != fusion_core_pid( fusion_core ))
           return -EACCES;
 
-     if (ref->global +ref->local == 0)
+     if (!ref->global && !has_local(ref))
           return -EIO;
 
      if (ref->watched)
@@ -405,6 +601,7 @@ int fusion_ref_inherit(FusionDev * dev, int id, int from_id)
      int ret;
      FusionRef *ref;
      FusionRef *from = NULL;
+     FusionRef *ancestor;
 
      ret = fusion_ref_lookup(&dev->ref, id, &ref);
      if (ret)
@@ -420,16 +617,26 @@ int fusion_ref_inherit(FusionDev * dev, int id, int from_id)
      if (!from)
           return -EINVAL;
 
-     ret = add_inheritor(ref, from);
-     if (ret)
-          return ret;
-
-     ret = propagate_local(dev, ref, from->local, false);
-     if (ret)
-          return ret;
+     for (ancestor = from; ancestor; ancestor = ancestor->inherited) {
+          if (ancestor == ref)
+               return -ELOOP;
+     }
 
      ref->inherited = from;
 
+     fusion_list_prepend(&from->inheritors, &ref->inherit_link);
+
+     if (has_local(from)) {
+          bool had = has_local(ref);
+
+          ref->inherits_local = true;
+
+          counter_publish(dev, ref);
+
+          if (!had)
+               push_local(dev, ref, false);
+     }
+
      return 0;
 }
 
@@ -447,62 +654,232 @@ int fusion_ref_set_sync(FusionDev * dev, int id)
      return ret;
 }
 
+int fusion_ref_set_batch(FusionDev * dev, int id)
+{
+     int ret;
+     FusionRef *ref;
+
+     ret = fusion_ref_lookup(&dev->ref, id, &ref);
+     if (ret)
+          return ret;
+
+     ref->batchwatch = true;
+
+     return ret;
+}
+
 int fusion_ref_destroy(FusionDev * dev, int id)
 {
      return fusion_entry_destroy(&dev->ref, id);
 }
 
-void fusion_ref_clear_all_local(FusionDev * dev, FusionID fusion_id)
+int fusion_ref_get_counter(FusionDev * dev, int id, int *ret_index)
 {
+     int ret;
+     unsigned int i;
      FusionRef *ref;
+     RefCounters *counters;
+
+     ret = fusion_ref_lookup(&dev->ref, id, &ref);
+     if (ret)
+          return ret;
+
+     if (ref->counter) {
+          *ret_index = ref->counter - 1;
+          return 0;
+     }
+
+     counters = counters_get(dev);
+     if (!counters)
+          return -ENOMEM;
+
+     for (i = 0; i < REF_COUNTERS; i++) {
+          if (!counters->refs[i])
+               break;
+     }
+
+     if (i == REF_COUNTERS)
+          return -ENOSPC;
+
+     counters->refs[i] = ref;
+
+     ref->counter = i + 1;
 
-     fusion_list_foreach(ref, dev->ref.list)
-     clear_local(dev, ref, fusion_id);
+     counter_publish(dev, ref);
+
+     *ret_index = i;
+
+     return 0;
 }
 
-int
-fusion_ref_fork_all_local(FusionDev * dev, FusionID fusion_id, FusionID from_id)
+int fusion_ref_map_counters(FusionDev * dev, struct vm_area_struct *vma)
 {
-     FusionRef *ref;
-     int ret = 0;
+     RefCounters *counters;
 
-     fusion_list_foreach(ref, dev->ref.list) {
-          ret = fork_local(dev, ref, fusion_id, from_id);
-          if (ret)
-               break;
+     if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+          return -EINVAL;
+
+     if (vma->vm_flags & VM_WRITE)
+          return -EPERM;
+
+     counters = counters_get(dev);
+     if (!counters)
+          return -ENOMEM;
+
+     vma->vm_flags &= ~VM_MAYWRITE;
+
+     return remap_pfn_range( vma, vma->vm_start,
+                             virt_to_phys( counters->table ) >> PAGE_SHIFT,
+                             PAGE_SIZE, vma->vm_page_prot );
+}
+
+int fusion_ref_map_deltas(FusionDev * dev, Fusionee * fusionee,
+                          struct vm_area_struct *vma)
+{
+     int                ret;
+     FusionRefDeltaLog *log;
+
+     if (fusionee->ref_deltas.log)
+          return -EBUSY;
+
+     if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+          return -EINVAL;
+
+     log = (FusionRefDeltaLog *) get_zeroed_page( GFP_KERNEL );
+     if (!log)
+          return -ENOMEM;
+
+     log->size = REF_DELTAS;
+
+     SetPageReserved( virt_to_page( log ) );
+
+     ret = remap_pfn_range( vma, vma->vm_start,
+                            virt_to_phys( log ) >> PAGE_SHIFT,
+                            PAGE_SIZE, vma->vm_page_prot );
+     if (ret) {
+          ClearPageReserved( virt_to_page( log ) );
+
+          free_page( (unsigned long) log );
+
+          return ret;
      }
 
-     return ret;
+     fusionee->ref_deltas.log  = log;
+     fusionee->ref_deltas.tail = 0;
+
+     return 0;
 }
 
-/**********************************************************************************************************************/
+void fusion_ref_apply_deltas(FusionDev * dev, Fusionee * fusionee)
+{
+     FusionRefDeltaLog *log = fusionee->ref_deltas.log;
+     unsigned int       head;
+     unsigned int       tail;
+
+     if (!log)
+          return;
+
+     head = log->head;
+     tail = fusionee->ref_deltas.tail;
+
+     if (head == tail)
+          return;
+
+     /* Garbage, drop all. */
+     if (head - tail > REF_DELTAS) {
+          log->dropped += head - tail;
+          tail = head;
+     }
+
+     /* Read entries after the head. */
+     smp_rmb();
+
+     while (tail != head) {
+          FusionRefDelta delta = log->deltas[tail % REF_DELTAS];
+
+          if (apply_delta(dev, fusionee, &delta))
+               log->dropped++;
+
+          tail++;
+     }
+
+     fusionee->ref_deltas.tail = tail;
+
+     /* Entries have been read before the tail is seen. */
+     smp_mb();
+
+     log->tail = tail;
+}
+
+void fusion_ref_apply_all_deltas(FusionDev * dev)
+{
+     Fusionee *fusionee;
+
+     direct_list_foreach (fusionee, dev->fusionee.list)
+          fusion_ref_apply_deltas(dev, fusionee);
+}
 
-static int get_local( FusionRef * ref, FusionID fusion_id )
+void fusion_ref_clear_all_local(FusionDev * dev, Fusionee * fusionee)
+{
+     FusionRef *ref, *next_ref;
+     LocalRef  *local, *next;
+     RefBatch  *batch, *next_batch;
+
+     /* No more mappings, the file is being released. */
+     deltas_free(fusionee);
+
+     direct_list_foreach_via_safe(ref, next_ref, fusionee->held.ref_locks, lock_link) {
+          set_locked(dev, ref, 0);
+
+          fusion_core_wq_wake( fusion_core, &ref->entry.wait);
+     }
+
+     dev->ref_batch.active = true;
+
+     direct_list_foreach_via_safe(local, next, fusionee->held.local_refs, fusionee_link)
+          clear_local(dev, local);
+
+     dev->ref_batch.active = false;
+
+     direct_list_foreach_safe(batch, next_batch, dev->ref_batch.list) {
+          flush_batch(dev, batch);
+
+          fusion_core_free( fusion_core, batch );
+     }
+
+     dev->ref_batch.list = NULL;
+}
+
+/*
+ * The child's references are accounted to the local refs of the parent.
+ */
+int
+fusion_ref_fork_all_local(FusionDev * dev, Fusionee * fusionee, Fusionee * from)
 {
      LocalRef *local;
 
-     direct_list_foreach (local, ref->local_refs) {
-          if (local->fusion_id == fusion_id)
-               return local->refs;
+     direct_list_foreach_via(local, from->held.local_refs, fusionee_link) {
+          if (local->refs)
+               local->refs++;
      }
 
      return 0;
 }
 
-static int get_throws( FusionRef * ref, FusionID fusion_id )
+/**********************************************************************************************************************/
+
+static LocalRef *lookup_local( FusionRef * ref, FusionID fusion_id )
 {
-     Throw *throw_;
-     int    throws = 0;
+     if (ref->local_ref.fusionee && ref->local_ref.fusion_id == fusion_id)
+          return &ref->local_ref;
 
-     direct_list_foreach (throw_, ref->throws) {
-          if (throw_->fusion_id == fusion_id)
-               throws++;
-     }
+     if (ref->local_hash)
+          return fusion_hash_lookup( ref->local_hash, (void*)(long) fusion_id );
 
-     return throws;
+     return NULL;
 }
 
-static int add_throw(FusionRef * ref, FusionID fusion_id, FusionID catcher)
+static int add_throw(FusionRef * ref, LocalRef * local, FusionID catcher)
 {
      Throw *throw_;
 
@@ -510,107 +887,175 @@ static int add_throw(FusionRef * ref, FusionID fusion_id, FusionID catcher)
      if (!throw_)
           return -ENOMEM;
 
-     throw_->fusion_id = fusion_id;
+     throw_->fusion_id = local->fusion_id;
      throw_->catcher   = catcher;
 
      direct_list_append( &ref->throws, &throw_->link );
 
+     local->throws++;
+
      return 0;
 }
 
-static int add_local(FusionRef * ref, FusionID fusion_id, int add)
+static int add_local(FusionDev * dev, FusionRef * ref, FusionID fusion_id, int add)
 {
-     FusionLink *l;
+     int ret;
      LocalRef *local;
+     Fusionee *fusionee;
 
-     fusion_list_foreach(l, ref->local_refs) {
-          local = (LocalRef *) l;
-
-          if (local->fusion_id == fusion_id) {
-               fusion_list_move_to_front(&ref->local_refs, l);
-
-               if (local->refs + add < 0)
-                    return -EIO;
+     local = lookup_local(ref, fusion_id);
+     if (local) {
+          if (local->refs + add < 0)
+               return -EIO;
 
-               local->refs += add;
-               return 0;
-          }
+          local->refs += add;
+          return 0;
      }
 
      /* Can only create local node if value is positive. */
      if (add <= 0)
           return -EIO;
 
-     local = fusion_core_malloc( fusion_core, sizeof(LocalRef) );
-     if (!local)
-          return -ENOMEM;
+     ret = fusionee_lookup(dev, fusion_id, &fusionee);
+     if (ret)
+          return ret;
+
+     if (ref->local_ref.fusionee) {
+          if (!ref->local_hash) {
+               ret = fusion_hash_create(FHT_INT, FHT_PTR, FUSION_HASH_MIN_SIZE, &ref->local_hash);
+               if (ret)
+                    return ret;
+          }
+
+          local = fusion_core_cache_alloc( fusion_core, &local_cache );
+          if (!local)
+               return -ENOMEM;
+
+          ret = fusion_hash_insert(ref->local_hash, (void*)(long) fusion_id, local);
+          if (ret) {
+               fusion_core_cache_free( fusion_core, &local_cache, local);
+               return ret;
+          }
+
+          memset(local, 0, sizeof(LocalRef));
+
+          fusion_list_prepend(&ref->local_refs, &local->link);
+     }
+     else {
+          /* Most refs have a single holder, who doesn't need an allocation. */
+          local = &ref->local_ref;
+
+          memset(local, 0, sizeof(LocalRef));
+     }
 
      local->fusion_id = fusion_id;
      local->refs = add;
+     local->fusionee = fusionee;
+     local->ref = ref;
 
-     fusion_list_prepend(&ref->local_refs, &local->link);
+     fusion_list_prepend(&fusionee->held.local_refs, &local->fusionee_link);
 
      return 0;
 }
 
-static void clear_local(FusionDev * dev, FusionRef * ref, FusionID fusion_id)
+static void clear_local(FusionDev * dev, LocalRef * local)
 {
-     FusionLink *l;
+     FusionRef *ref  = local->ref;
+     int        refs = local->refs;
 
-     if (ref->locked == fusion_id) {
-          ref->locked = 0;
-          fusion_core_wq_wake( fusion_core, &ref->entry.wait);
+     free_local(ref, local);
+
+     if (refs)
+          propagate_local(dev, ref, -refs, true);
+}
+
+static void free_local(FusionRef * ref, LocalRef * local)
+{
+     fusion_list_remove(&local->fusionee->held.local_refs, &local->fusionee_link);
+
+     if (local == &ref->local_ref) {
+          local->fusionee = NULL;
+          return;
      }
 
-     fusion_list_foreach(l, ref->local_refs) {
-          LocalRef *local = (LocalRef *) l;
+     fusion_hash_remove(ref->local_hash, (void*)(long) local->fusion_id, NULL, NULL);
 
-          if (local->fusion_id == fusion_id) {
-               fusion_list_remove(&ref->local_refs, l);
+     fusion_list_remove(&ref->local_refs, &local->link);
 
-               if (local->refs)
-                    propagate_local(dev, ref, -local->refs, true);
+     fusion_core_cache_free( fusion_core, &local_cache, local);
+}
 
-               fusion_core_free( fusion_core, l);
-               break;
-          }
+static void free_all_local(FusionRef * ref)
+{
+     FusionLink *l, *n;
+
+     if (ref->local_ref.fusionee)
+          free_local(ref, &ref->local_ref);
+
+     fusion_list_foreach_safe(l, n, ref->local_refs)
+          free_local(ref, (LocalRef *) l);
+
+     if (ref->local_hash) {
+          fusion_hash_destroy(ref->local_hash);
+
+          ref->local_hash = NULL;
      }
 }
 
-static int
-fork_local(FusionDev * dev, FusionRef * ref, FusionID fusion_id,
-           FusionID from_id)
+static int apply_delta(FusionDev * dev, Fusionee * fusionee, const FusionRefDelta * delta)
 {
-     FusionLink *l;
-     int ret = 0;
+     int        ret;
+     FusionRef *ref;
+     LocalRef  *local;
+     FusionID   fusion_id = fusionee_id(fusionee);
 
-     fusion_list_foreach(l, ref->local_refs) {
-          LocalRef *local = (LocalRef *) l;
+     if (!delta->count)
+          return 0;
 
-          if (local->fusion_id == from_id) {
-               if (local->refs) {
-                    local->refs++;
-               }
-               break;
-          }
+     ret = fusion_ref_lookup(&dev->ref, delta->id, &ref);
+     if (ret)
+          return ret;
+
+     if (ref->locked)
+          return -EAGAIN;
+
+     if (dev->secure && fusion_id != FUSION_ID_MASTER) {
+          ret = fusion_entry_check_permissions(&dev->ref, delta->id, fusion_id,
+                                               delta->count > 0 ? _IOC_NR(FUSION_REF_UP) : _IOC_NR(FUSION_REF_DOWN));
+          if (ret)
+               return ret;
      }
 
-     return ret;
-}
+     /* Only while holding a reference before and after. */
+     local = lookup_local(ref, fusion_id);
+     if (!local || local->refs <= 0 || local->refs + delta->count <= 0)
+          return -EIO;
 
-static void free_all_local(FusionRef * ref)
-{
-     FusionLink *l = ref->local_refs;
+     if (delta->count > INT_MAX - local->refs)
+          return -EOVERFLOW;
 
-     while (l) {
-          FusionLink *next = l->next;
+     if (delta->count > 0)
+          dev->stat.ref_up++;
+     else
+          dev->stat.ref_down++;
+
+     local->refs += delta->count;
 
-          fusion_core_free( fusion_core, l);
+     return propagate_local(dev, ref, delta->count, true);
+}
+
+static void set_locked(FusionDev * dev, FusionRef * ref, FusionID fusion_id)
+{
+     if (ref->locker) {
+          fusion_list_remove(&ref->locker->held.ref_locks, &ref->lock_link);
 
-          l = next;
+          ref->locker = NULL;
      }
 
-     ref->local_refs = NULL;
+     ref->locked = fusion_id;
+
+     if (fusion_id && !fusionee_lookup(dev, fusion_id, &ref->locker))
+          fusion_list_prepend(&ref->locker->held.ref_locks, &ref->lock_link);
 }
 
 static void notify_ref(FusionDev * dev, FusionRef * ref, bool async)
@@ -618,6 +1063,9 @@ static void notify_ref(FusionDev * dev, FusionRef * ref, bool async)
      if (ref->watched) {
           FusionCallExecute execute;
 
+          if (async && ref->batchwatch && dev->ref_batch.active && !batch_notify(dev, ref))
+               return;
+
           execute.call_id = ref->call_id;
           execute.call_arg = ref->call_arg;
           execute.call_ptr = NULL;
@@ -629,75 +1077,142 @@ static void notify_ref(FusionDev * dev, FusionRef * ref, bool async)
           fusion_core_wq_wake( fusion_core, &ref->entry.wait);
 }
 
-static int propagate_local(FusionDev * dev, FusionRef * ref, int diff, bool async)
+static int batch_notify(FusionDev * dev, FusionRef * ref)
 {
-     FusionLink *l;
+     RefBatch *batch;
+
+     direct_list_foreach (batch, dev->ref_batch.list) {
+          if (batch->call_id == ref->call_id)
+               break;
+     }
+
+     if (!batch) {
+          batch = fusion_core_malloc( fusion_core, sizeof(RefBatch) );
+          if (!batch)
+               return -ENOMEM;
+
+          batch->call_id = ref->call_id;
+          batch->num     = 0;
 
-     /* Recurse into inheritors. */
-     fusion_list_foreach(l, ref->inheritors) {
-          FusionRef *inheritor = ((Inheritor *) l)->ref;
+          fusion_list_prepend( &dev->ref_batch.list, &batch->link );
+     }
+
+     batch->call_args[batch->num++] = ref->call_arg;
+
+     if (batch->num == FUSION_CALL_BATCH_MAX)
+          flush_batch(dev, batch);
+
+     return 0;
+}
+
+static void flush_batch(FusionDev * dev, RefBatch * batch)
+{
+     /* A single one is sent as usual. */
+     if (batch->num == 1) {
+          FusionCallExecute execute;
+
+          execute.call_id = batch->call_id;
+          execute.call_arg = batch->call_args[0];
+          execute.call_ptr = NULL;
+          execute.flags = FCEF_ONEWAY;
 
-          propagate_local(dev, inheritor, diff, async);
+          fusion_call_execute(dev, NULL, &execute);
      }
+     else if (batch->num)
+          fusion_call_execute_batch(dev, batch->call_id, batch->call_args, batch->num);
+
+     batch->num = 0;
+}
+
+static int propagate_local(FusionDev * dev, FusionRef * ref, int diff, bool async)
+{
+     bool had = has_local(ref);
 
      /* Apply difference. */
      ref->local += diff;
 
      FUSION_ASSERT( ref->local >= 0);
 
+     counter_publish(dev, ref);
+
+     /* Inheritors only care about the count reaching or leaving zero. */
+     if (has_local(ref) != had)
+          push_local(dev, ref, async);
+
      /* Notify zero count. */
-     if (ref->local + ref->global == 0)
+     if (!ref->global && !has_local(ref))
           notify_ref(dev, ref, async);
 
      return 0;
 }
 
-static int add_inheritor(FusionRef * ref, FusionRef * from)
+/*
+ * Tells the inheritors of the ref whether it has local references, walking down
+ * without recursion until reaching refs with local references of their own.
+ */
+static void push_local(FusionDev * dev, FusionRef * root, bool async)
 {
-     Inheritor *inheritor;
-
-     inheritor = fusion_core_malloc( fusion_core, sizeof(Inheritor) );
-     if (!inheritor)
-          return -ENOMEM;
+     bool        alive = has_local(root);
+     FusionLink *l     = root->inheritors;
+     int         count = 0;
 
-     inheritor->ref = ref;
+     while (l) {
+          FusionRef *ref = container_of(l, FusionRef, inherit_link);
 
-     fusion_list_prepend(&from->inheritors, &inheritor->link);
+          ref->inherits_local = alive;
 
-     return 0;
-}
+          counter_publish(dev, ref);
 
-static void remove_inheritor(FusionRef * ref, FusionRef * from)
-{
-     FusionLink *l;
+          count++;
 
-     fusion_list_foreach(l, from->inheritors) {
-          Inheritor *inheritor = (Inheritor *) l;
+          if (!ref->local) {
+               if (!alive && !ref->global)
+                    notify_ref(dev, ref, async);
 
-          if (inheritor->ref == ref) {
-               fusion_list_remove(&from->inheritors, &inheritor->link);
+               /* Descend, the change passes through. */
+               if (ref->inheritors) {
+                    l = ref->inheritors;
+                    continue;
+               }
+          }
 
-               fusion_core_free( fusion_core, l);
-               break;
+          /* Next sibling, or that of the closest ancestor below the root. */
+          while (!l->next && ref->inherited != root) {
+               ref = ref->inherited;
+               l   = &ref->inherit_link;
           }
+
+          l = l->next;
      }
+
+     root->pushed       += count;
+     dev->stat.ref_push += count;
+}
+
+static void remove_inheritor(FusionRef * ref, FusionRef * from)
+{
+     fusion_list_remove(&from->inheritors, &ref->inherit_link);
 }
 
 static void drop_inheritors(FusionDev * dev, FusionRef * ref)
 {
-     FusionLink *l = ref->inheritors;
+     FusionRef *inheritor, *next;
 
-     while (l) {
-          FusionLink *next = l->next;
-          FusionRef *inheritor = ((Inheritor *) l)->ref;
+     direct_list_foreach_via_safe(inheritor, next, ref->inheritors, inherit_link) {
+          inheritor->inherited = NULL;
 
-          propagate_local(dev, inheritor, -ref->local, true);
+          if (inheritor->inherits_local) {
+               inheritor->inherits_local = false;
 
-          inheritor->inherited = NULL;
+               counter_publish(dev, inheritor);
 
-          fusion_core_free( fusion_core, l);
+               if (!inheritor->local) {
+                    push_local(dev, inheritor, true);
 
-          l = next;
+                    if (!inheritor->global)
+                         notify_ref(dev, inheritor, true);
+               }
+          }
      }
 
      ref->inheritors = NULL;
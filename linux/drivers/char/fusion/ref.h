@@ -15,11 +15,16 @@
 #ifndef __FUSION__REF_H__
 #define __FUSION__REF_H__
 
+#include <linux/mm.h>
+
 #include "fusiondev.h"
 #include "types.h"
 
 /* module init/cleanup */
 
+int fusion_ref_caches_init(void);
+void fusion_ref_caches_deinit(void);
+
 int fusion_ref_init(FusionDev * dev);
 void fusion_ref_deinit(FusionDev * dev);
 
@@ -49,13 +54,35 @@ int fusion_ref_inherit(FusionDev * dev, int id, int from);
 
 int fusion_ref_set_sync(FusionDev * dev, int id);
 
+int fusion_ref_set_batch(FusionDev * dev, int id);
+
 int fusion_ref_destroy(FusionDev * dev, int id);
 
+int fusion_ref_get_counter(FusionDev * dev, int id, int *ret_index);
+
 /* internal functions */
 
-void fusion_ref_clear_all_local(FusionDev * dev, FusionID fusion_id);
+int fusion_ref_map_counters(FusionDev * dev, struct vm_area_struct *vma);
+
+int fusion_ref_map_deltas(FusionDev * dev, Fusionee * fusionee,
+                          struct vm_area_struct *vma);
+
+/*
+ * Applies the entries of the delta log written since the last call.
+ */
+void fusion_ref_apply_deltas(FusionDev * dev, Fusionee * fusionee);
+
+/*
+ * Applies the delta logs of all fusionees.
+ */
+void fusion_ref_apply_all_deltas(FusionDev * dev);
+
+/*
+ * Also drops the delta log, if any.
+ */
+void fusion_ref_clear_all_local(FusionDev * dev, Fusionee * fusionee);
 
 int fusion_ref_fork_all_local(FusionDev * dev,
-                              FusionID fusion_id, FusionID from_id);
+                              Fusionee * fusionee, Fusionee * from);
 
 #endif
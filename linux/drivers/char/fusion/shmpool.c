@@ -23,6 +23,7 @@
 #include <linux/smp_lock.h>
 #endif
 #include <linux/sched.h>
+#include <linux/spinlock.h>
 #include <linux/mm.h>
 #include <linux/proc_fs.h>
 
@@ -40,15 +41,21 @@ typedef struct {
      void *next_base;
 } AddrEntry;
 
+typedef struct __Fusion_FusionSHMPool FusionSHMPool;
+
 typedef struct {
      FusionLink link;
 
      FusionID fusion_id;
+     Fusionee *fusionee;  /* detached before the fusionee is destroyed */
+
+     FusionLink fusionee_link;  /* in held.shmpool_nodes of the fusionee */
+     FusionSHMPool *shmpool;
 
      int count;          /* number of attach calls */
 } SHMPoolNode;
 
-typedef struct {
+struct __Fusion_FusionSHMPool {
      FusionEntry entry;
 
      int max_size;
@@ -65,16 +72,14 @@ typedef struct {
 #ifdef FUSION_CORE_SHMPOOLS
      void *kernel_base;
 #endif
-} FusionSHMPool;
+};
 
 /******************************************************************************/
 
 static SHMPoolNode *get_node(FusionSHMPool * shmpool, FusionID fusion_id);
 
-static void remove_node(FusionSHMPool * shmpool, FusionID fusion_id);
-
-static int fork_node(FusionSHMPool * shmpool,
-                     FusionID fusion_id, FusionID from_id);
+static SHMPoolNode *new_node(FusionSHMPool * shmpool, Fusionee * fusionee, int count);
+static void free_node(FusionSHMPool * shmpool, SHMPoolNode * node);
 
 static void free_all_nodes(FusionSHMPool * shmpool);
 
@@ -82,22 +87,27 @@ static void free_all_nodes(FusionSHMPool * shmpool);
 
 #if FUSION_SHM_PER_WORLD_SPACE
 #define dev_shared (dev)
+
+#define addr_space_lock()    do {} while (0)
+#define addr_space_unlock()  do {} while (0)
 #else
 #define dev_shared (dev->shared)
+
+/* The address space is shared by all worlds, but each world has its own lock. */
+static DEFINE_SPINLOCK(addr_space);
+
+#define addr_space_lock()    spin_lock( &addr_space )
+#define addr_space_unlock()  spin_unlock( &addr_space )
 #endif
 
 /******************************************************************************/
 
-static AddrEntry *
-add_addr_entry( FusionDev *dev, void *next_base )
+static void
+add_addr_entry( FusionDev *dev, AddrEntry *entry, void *next_base )
 {
-     AddrEntry *entry = fusion_core_malloc( fusion_core, sizeof(AddrEntry) );
-
      entry->next_base = next_base;
 
      fusion_list_prepend( &dev_shared->addr_entries, &entry->link );
-
-     return entry;
 }
 
 /******************************************************************************/
@@ -108,19 +118,35 @@ fusion_shmpool_construct( FusionEntry * entry, void *ctx, void *create_ctx )
      FusionSHMPool    *shmpool = (FusionSHMPool *) entry;
      FusionDev        *dev     = (FusionDev *)ctx;
      FusionSHMPoolNew *poolnew = create_ctx;
+     AddrEntry        *addr_entry;
+
+     addr_entry = fusion_core_malloc( fusion_core, sizeof(AddrEntry) );
+     if (!addr_entry)
+          return -ENOMEM;
+
+#ifdef FUSION_CORE_SHMPOOLS
+     shmpool->kernel_base = fusion_core_malloc(fusion_core, poolnew->max_size);
+     if(!shmpool->kernel_base) {
+          fusion_core_free( fusion_core, addr_entry );
+          return -ENOMEM;
+     }
+#endif
+
+     addr_space_lock();
 
      if ((ulong) dev_shared->addr_base + poolnew->max_size >= dev->shm_base + fusion_shm_size) {
+          addr_space_unlock();
+
           printk(KERN_WARNING
                  "%s: virtual address space exhausted! (FIXME)\n",
                  __FUNCTION__);
-          return -ENOSPC;
-     }
 
 #ifdef FUSION_CORE_SHMPOOLS
-     shmpool->kernel_base = fusion_core_malloc(fusion_core, poolnew->max_size);
-     if(!shmpool->kernel_base)
-          return -ENOMEM;
+          fusion_core_free( fusion_core, shmpool->kernel_base );
 #endif
+          fusion_core_free( fusion_core, addr_entry );
+          return -ENOSPC;
+     }
 
      shmpool->max_size = poolnew->max_size;
      shmpool->addr_base = poolnew->addr_base = dev_shared->addr_base;
@@ -128,7 +154,11 @@ fusion_shmpool_construct( FusionEntry * entry, void *ctx, void *create_ctx )
      dev_shared->addr_base += PAGE_ALIGN(poolnew->max_size) + PAGE_SIZE;
      dev_shared->addr_base = (void*)((unsigned long)(dev_shared->addr_base + 0xffff) & ~0xffff);
 
-     shmpool->addr_entry = add_addr_entry( dev, dev_shared->addr_base );
+     add_addr_entry( dev, addr_entry, dev_shared->addr_base );
+
+     addr_space_unlock();
+
+     shmpool->addr_entry = addr_entry;
 
      return 0;
 }
@@ -142,21 +172,27 @@ fusion_shmpool_destruct( FusionEntry * entry, void *ctx )
 
      free_all_nodes(shmpool);
 
+     addr_space_lock();
+
      fusion_list_remove( &dev_shared->addr_entries, &shmpool->addr_entry->link );
 
      /*
       * free trailing address space
       */
-#ifdef FUSION_CORE_SHMPOOLS
-     fusion_core_free(fusion_core, shmpool->kernel_base);
-#endif
-
      dev_shared->addr_base = (void*) dev->shm_base + 0x80000;
 
      fusion_list_foreach(addr_entry, dev_shared->addr_entries) {
           if (addr_entry->next_base > dev_shared->addr_base)
                dev_shared->addr_base = addr_entry->next_base;
      }
+
+     addr_space_unlock();
+
+#ifdef FUSION_CORE_SHMPOOLS
+     fusion_core_free(fusion_core, shmpool->kernel_base);
+#endif
+
+     fusion_core_free( fusion_core, shmpool->addr_entry );
 }
 
 static void
@@ -211,11 +247,12 @@ int fusion_shmpool_new(FusionDev * dev, Fusionee *fusionee, FusionSHMPoolNew * p
 
 int
 fusion_shmpool_attach(FusionDev * dev,
-                      FusionSHMPoolAttach * attach, FusionID fusion_id)
+                      FusionSHMPoolAttach * attach, Fusionee * fusionee)
 {
      int ret;
      SHMPoolNode *node;
      FusionSHMPool *shmpool;
+     FusionID fusion_id = fusionee_id(fusionee);
 
      ret = fusion_shmpool_lookup( &dev->shmpool, attach->pool_id, &shmpool );
      if (ret)
@@ -225,14 +262,9 @@ fusion_shmpool_attach(FusionDev * dev,
 
      node = get_node(shmpool, fusion_id);
      if (!node) {
-          node = fusion_core_malloc( fusion_core, sizeof(SHMPoolNode) );
+          node = new_node(shmpool, fusionee, 1);
           if (!node)
                return -ENOMEM;
-
-          node->fusion_id = fusion_id;
-          node->count = 1;
-
-          fusion_list_prepend(&shmpool->nodes, &node->link);
      }
      else
           node->count++;
@@ -259,10 +291,8 @@ int fusion_shmpool_detach(FusionDev * dev, int id, FusionID fusion_id)
      if (!node)
           return -EIO;
 
-     if (!--node->count) {
-          fusion_list_remove(&shmpool->nodes, &node->link);
-          fusion_core_free( fusion_core, node);
-     }
+     if (!--node->count)
+          free_node(shmpool, node);
 
      return 0;
 }
@@ -297,9 +327,9 @@ fusion_shmpool_dispatch(FusionDev * dev,
           if (node->fusion_id == fusion_id)
                continue;
 
-          fusionee_send_message(dev, fusionee, node->fusion_id,
-                                FMT_SHMPOOL, shmpool->entry.id, 0,
-                                sizeof(message), &message, FMC_NONE, NULL, 0, NULL, 0);
+          fusionee_send_message2(dev, fusionee, node->fusionee,
+                                 FMT_SHMPOOL, shmpool->entry.id, 0,
+                                 sizeof(message), &message, FMC_NONE, NULL, 0, NULL, 0, true);
      }
 
      return 0;
@@ -310,32 +340,53 @@ int fusion_shmpool_destroy(FusionDev * dev, int id)
      return fusion_entry_destroy(&dev->shmpool, id);
 }
 
-void fusion_shmpool_detach_all(FusionDev * dev, FusionID fusion_id)
+void fusion_shmpool_detach_all(FusionDev * dev, Fusionee * fusionee)
 {
-     FusionLink *l;
+     SHMPoolNode *node, *next;
+
+     direct_list_foreach_via_safe(node, next, fusionee->held.shmpool_nodes, fusionee_link)
+          free_node(node->shmpool, node);
+}
 
-     fusion_list_foreach(l, dev->shmpool.list) {
-          FusionSHMPool *shmpool = (FusionSHMPool *) l;
+int
+fusion_shmpool_fork_all(FusionDev * dev, Fusionee * fusionee, Fusionee * from)
+{
+     SHMPoolNode *node;
 
-          remove_node(shmpool, fusion_id);
+     direct_list_foreach_via(node, from->held.shmpool_nodes, fusionee_link) {
+          if (!new_node(node->shmpool, fusionee, node->count))
+               return -ENOMEM;
      }
+
+     return 0;
 }
 
+/*
+ * Validates data referenced within a pool that both fusionees have attached.
+ */
 int
-fusion_shmpool_fork_all(FusionDev * dev, FusionID fusion_id, FusionID from_id)
+fusion_shmpool_check_ref(FusionDev * dev, const FusionSHMPoolRef * ref,
+                         FusionID fusion_id, FusionID other_id, void **ret_addr)
 {
-     FusionLink *l;
-     int ret = 0;
+     int ret;
+     FusionSHMPool *shmpool;
 
-     fusion_list_foreach(l, dev->shmpool.list) {
-          FusionSHMPool *shmpool = (FusionSHMPool *) l;
+     ret = fusion_shmpool_lookup( &dev->shmpool, ref->pool_id, &shmpool );
+     if (ret)
+          return ret;
 
-          ret = fork_node(shmpool, fusion_id, from_id);
-          if (ret)
-               break;
-     }
+     /* Only the part of the pool which is mapped right now. */
+     if (ref->offset > (unsigned int) shmpool->size ||
+         ref->length > (unsigned int) shmpool->size - ref->offset)
+          return -EINVAL;
 
-     return ret;
+     if (!get_node(shmpool, fusion_id) || !get_node(shmpool, other_id))
+          return -EACCES;
+
+     if (ret_addr)
+          *ret_addr = (char*) shmpool->addr_base + ref->offset;
+
+     return 0;
 }
 
 #ifdef FUSION_CORE_SHMPOOLS
@@ -379,44 +430,31 @@ static SHMPoolNode *get_node(FusionSHMPool * shmpool, FusionID fusion_id)
      return NULL;
 }
 
-static void remove_node(FusionSHMPool * shmpool, FusionID fusion_id)
-{
-     SHMPoolNode *node;
-
-     fusion_list_foreach(node, shmpool->nodes) {
-          if (node->fusion_id == fusion_id) {
-               fusion_list_remove(&shmpool->nodes, &node->link);
-               break;
-          }
-     }
-}
-
-static int
-fork_node(FusionSHMPool * shmpool, FusionID fusion_id, FusionID from_id)
+static SHMPoolNode *new_node(FusionSHMPool * shmpool, Fusionee * fusionee, int count)
 {
-     int ret = 0;
      SHMPoolNode *node;
 
-     fusion_list_foreach(node, shmpool->nodes) {
-          if (node->fusion_id == from_id) {
-               SHMPoolNode *new_node;
+     node = fusion_core_malloc( fusion_core, sizeof(SHMPoolNode) );
+     if (!node)
+          return NULL;
 
-               new_node = fusion_core_malloc( fusion_core, sizeof(SHMPoolNode) );
-               if (!new_node) {
-                    ret = -ENOMEM;
-                    break;
-               }
+     node->fusion_id = fusionee_id(fusionee);
+     node->fusionee = fusionee;
+     node->shmpool = shmpool;
+     node->count = count;
 
-               new_node->fusion_id = fusion_id;
-               new_node->count = node->count;
+     fusion_list_prepend(&shmpool->nodes, &node->link);
+     fusion_list_prepend(&fusionee->held.shmpool_nodes, &node->fusionee_link);
 
-               fusion_list_prepend(&shmpool->nodes, &new_node->link);
+     return node;
+}
 
-               break;
-          }
-     }
+static void free_node(FusionSHMPool * shmpool, SHMPoolNode * node)
+{
+     fusion_list_remove(&shmpool->nodes, &node->link);
+     fusion_list_remove(&node->fusionee->held.shmpool_nodes, &node->fusionee_link);
 
-     return ret;
+     fusion_core_free( fusion_core, node);
 }
 
 static void free_all_nodes(FusionSHMPool * shmpool)
@@ -424,9 +462,6 @@ static void free_all_nodes(FusionSHMPool * shmpool)
      FusionLink *n;
      SHMPoolNode *node;
 
-     fusion_list_foreach_safe(node, n, shmpool->nodes) {
-          fusion_core_free( fusion_core, node);
-     }
-
-     shmpool->nodes = NULL;
+     fusion_list_foreach_safe(node, n, shmpool->nodes)
+          free_node(shmpool, node);
 }
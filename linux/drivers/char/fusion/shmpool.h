@@ -56,7 +56,7 @@ void fusion_shmpool_deinit(FusionDev * dev);
 int fusion_shmpool_new(FusionDev * dev, Fusionee *fusionee, FusionSHMPoolNew * pool);
 
 int fusion_shmpool_attach(FusionDev * dev,
-                          FusionSHMPoolAttach * attach, FusionID fusion_id);
+                          FusionSHMPoolAttach * attach, Fusionee * fusionee);
 
 int fusion_shmpool_detach(FusionDev * dev, int id, FusionID fusion_id);
 
@@ -68,10 +68,13 @@ int fusion_shmpool_destroy(FusionDev * dev, int id);
 
 /* internal functions */
 
-void fusion_shmpool_detach_all(FusionDev * dev, FusionID fusion_id);
+void fusion_shmpool_detach_all(FusionDev * dev, Fusionee * fusionee);
 
 int fusion_shmpool_fork_all(FusionDev * dev,
-                            FusionID fusion_id, FusionID from_id);
+                            Fusionee * fusionee, Fusionee * from);
+
+int fusion_shmpool_check_ref(FusionDev * dev, const FusionSHMPoolRef * ref,
+                             FusionID fusion_id, FusionID other_id, void **ret_addr);
 
 #ifdef FUSION_CORE_SHMPOOLS
 int fusion_shmpool_map(FusionDev *dev, struct vm_area_struct *vma);
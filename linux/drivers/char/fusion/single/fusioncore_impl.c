@@ -44,6 +44,8 @@ fusion_core_enter( int          cpu_index,
 
      sema_init( &core->lock, 1 );
 
+     core->caches = NULL;
+
      D_MAGIC_SET( core, FusionCore );
 
      *ret_core = core;
@@ -56,6 +58,7 @@ fusion_core_exit( FusionCore *core )
 {
      D_MAGIC_ASSERT( core, FusionCore );
 
+     D_ASSERT( core->caches == NULL );
 
      D_MAGIC_CLEAR( core );
 
@@ -71,6 +74,15 @@ fusion_core_pid( FusionCore *core )
      return (core->cpu_index << 16) | current->pid;
 }
 
+pid_t
+fusion_core_pid_of( FusionCore *core,
+                    pid_t       tid )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+
+     return (core->cpu_index << 16) | tid;
+}
+
 
 void *
 fusion_core_malloc( FusionCore *core,
@@ -91,6 +103,146 @@ fusion_core_free( FusionCore *core,
 }
 
 
+FusionCoreResult
+fusion_core_cache_init( FusionCore  *core,
+                        FusionCache *cache,
+                        const char  *name,
+                        size_t       size )
+{
+     FUSION_DEBUG( "%s( %p, cache %p, name '%s', size %zu )\n", __FUNCTION__, core, cache, name, size );
+
+     D_MAGIC_ASSERT( core, FusionCore );
+
+     memset( cache, 0, sizeof(FusionCache) );
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 23)
+     cache->cache = kmem_cache_create( name, size, 0, SLAB_HWCACHE_ALIGN, NULL );
+#else
+     cache->cache = kmem_cache_create( name, size, 0, SLAB_HWCACHE_ALIGN, NULL, NULL );
+#endif
+     if (!cache->cache)
+          return FC_FAILURE;
+
+     cache->name = name;
+     cache->size = size;
+
+     atomic_set( &cache->allocs, 0 );
+     atomic_set( &cache->frees, 0 );
+
+     D_MAGIC_SET( cache, FusionCache );
+
+     down( &core->lock );
+
+     cache->next  = core->caches;
+     core->caches = cache;
+
+     up( &core->lock );
+
+     return FC_OK;
+}
+
+void
+fusion_core_cache_deinit( FusionCore  *core,
+                          FusionCache *cache )
+{
+     FusionCache **p;
+
+     FUSION_DEBUG( "%s( %p, cache %p )\n", __FUNCTION__, core, cache );
+
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( cache, FusionCache );
+
+     down( &core->lock );
+
+     for (p = &core->caches; *p; p = &(*p)->next) {
+          if (*p == cache) {
+               *p = cache->next;
+               break;
+          }
+     }
+
+     up( &core->lock );
+
+     if (atomic_read( &cache->allocs ) != atomic_read( &cache->frees ))
+          printk( KERN_WARNING "fusion: %d objects left in cache '%s'!\n",
+                  atomic_read( &cache->allocs ) - atomic_read( &cache->frees ), cache->name );
+
+     kmem_cache_destroy( cache->cache );
+
+     D_MAGIC_CLEAR( cache );
+}
+
+void *
+fusion_core_cache_alloc( FusionCore  *core,
+                         FusionCache *cache )
+{
+     void *ptr;
+
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( cache, FusionCache );
+
+     ptr = kmem_cache_alloc( cache->cache, GFP_KERNEL );
+     if (ptr)
+          atomic_inc( &cache->allocs );
+
+     return ptr;
+}
+
+void
+fusion_core_cache_free( FusionCore  *core,
+                        FusionCache *cache,
+                        void        *ptr )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( cache, FusionCache );
+
+     if (!ptr)
+          return;
+
+     atomic_inc( &cache->frees );
+
+     kmem_cache_free( cache->cache, ptr );
+}
+
+FusionCache *
+fusion_core_cache_next( FusionCore  *core,
+                        FusionCache *prev )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+
+     if (!prev)
+          return core->caches;
+
+     D_MAGIC_ASSERT( prev, FusionCache );
+
+     return prev->next;
+}
+
+void
+fusion_core_cache_stat( FusionCore   *core,
+                        FusionCache  *cache,
+                        const char  **ret_name,
+                        size_t       *ret_size,
+                        int          *ret_allocs,
+                        int          *ret_frees )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( cache, FusionCache );
+
+     if (ret_name)
+          *ret_name = cache->name;
+
+     if (ret_size)
+          *ret_size = cache->size;
+
+     if (ret_allocs)
+          *ret_allocs = atomic_read( &cache->allocs );
+
+     if (ret_frees)
+          *ret_frees = atomic_read( &cache->frees );
+}
+
+
 void
 fusion_core_set_pointer( FusionCore      *core,
                          unsigned int     index,
@@ -138,6 +290,52 @@ fusion_core_unlock( FusionCore *core )
 }
 
 
+FusionCoreResult
+fusion_core_mutex_init( FusionCore  *core,
+                        FusionMutex *mutex )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+
+     memset( mutex, 0, sizeof(FusionMutex) );
+
+     sema_init( &mutex->lock, 1 );
+
+     D_MAGIC_SET( mutex, FusionMutex );
+
+     return FC_OK;
+}
+
+void
+fusion_core_mutex_deinit( FusionCore  *core,
+                          FusionMutex *mutex )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( mutex, FusionMutex );
+
+     D_MAGIC_CLEAR( mutex );
+}
+
+void
+fusion_core_mutex_lock( FusionCore  *core,
+                        FusionMutex *mutex )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( mutex, FusionMutex );
+
+     down( &mutex->lock );
+}
+
+void
+fusion_core_mutex_unlock( FusionCore  *core,
+                          FusionMutex *mutex )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( mutex, FusionMutex );
+
+     up( &mutex->lock );
+}
+
+
 FusionCoreResult
 fusion_core_wq_init( FusionCore      *core,
                      FusionWaitQueue *queue )
@@ -166,6 +364,7 @@ fusion_core_wq_deinit( FusionCore      *core,
 void
 fusion_core_wq_wait( FusionCore      *core,
                      FusionWaitQueue *queue,
+                     FusionMutex     *mutex,
                      int             *timeout_ms,
                      bool             interruptible )
 {
@@ -174,10 +373,11 @@ fusion_core_wq_wait( FusionCore      *core,
 
      D_MAGIC_ASSERT( core, FusionCore );
      D_MAGIC_ASSERT( queue, FusionWaitQueue );
+     D_MAGIC_ASSERT( mutex, FusionMutex );
 
      prepare_to_wait( &queue->queue, &wait, interruptible ? TASK_INTERRUPTIBLE : TASK_UNINTERRUPTIBLE );
 
-     fusion_core_unlock( core );
+     fusion_core_mutex_unlock( core, mutex );
 
      if (timeout_ms)
           *timeout_ms = schedule_timeout(*timeout_ms);
@@ -186,12 +386,13 @@ fusion_core_wq_wait( FusionCore      *core,
 
      finish_wait( &queue->queue, &wait );
 
-     fusion_core_lock( core );
+     fusion_core_mutex_lock( core, mutex );
 #else
      wait_queue_t wait;
 
      D_MAGIC_ASSERT( core, FusionCore );
      D_MAGIC_ASSERT( queue, FusionWaitQueue );
+     D_MAGIC_ASSERT( mutex, FusionMutex );
 
      init_waitqueue_entry(&wait, current);
 
@@ -201,14 +402,14 @@ fusion_core_wq_wait( FusionCore      *core,
      __add_wait_queue( &queue->queue, &wait);
      write_unlock( &queue->queue.lock );
 
-     fusion_core_unlock( core );
+     fusion_core_mutex_unlock( core, mutex );
 
      if (timeout_ms)
           *timeout_ms = schedule_timeout(*timeout_ms);
      else
           schedule();
 
-     fusion_core_lock( core );
+     fusion_core_mutex_lock( core, mutex );
 
      write_lock( &queue->queue.lock );
      __remove_wait_queue( &queue->queue, &wait );
@@ -24,8 +24,12 @@
 #endif
 
 #include <linux/wait.h>
+#include <linux/slab.h>
+#include <asm/atomic.h>
 
 
+typedef struct __Fusion_FusionCache FusionCache;
+
 struct __Fusion_FusionCore {
      int                 magic;
 
@@ -34,9 +38,37 @@ struct __Fusion_FusionCore {
      struct semaphore    lock;
 
      void               *pointers[10];
+
+     FusionCache        *caches;
+};
+
+
+struct __Fusion_FusionCache {
+     int                 magic;
+
+     FusionCache        *next;
+
+     const char         *name;
+     size_t              size;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20)
+     struct kmem_cache  *cache;
+#else
+     kmem_cache_t       *cache;
+#endif
+
+     atomic_t            allocs;
+     atomic_t            frees;
 };
 
 
+typedef struct {
+     int                 magic;
+
+     struct semaphore    lock;
+} FusionMutex;
+
+
 typedef struct {
      int                 magic;
 
@@ -24,11 +24,14 @@
 #endif
 #include <linux/sched.h>
 #include <linux/proc_fs.h>
+#include <linux/mm.h>
+#include <asm/io.h>
 
 #include <linux/fusion.h>
 
 #include "fusiondev.h"
 #include "fusionee.h"
+#include "hash.h"
 #include "list.h"
 #include "skirmish.h"
 
@@ -37,6 +40,34 @@
 #define FUSION_SKIRMISH_LOG(x...)  do {} while (0)
 
 typedef struct __FUSION_FusionSkirmish FusionSkirmish;
+typedef struct __FUSION_SkirmishHolder SkirmishHolder;
+
+typedef enum {
+     SKIRMISH_HOLD_LOCK,
+     SKIRMISH_HOLD_TRANSFER,
+     SKIRMISH_HOLD_TRANSFER2,
+
+     _SKIRMISH_HOLD_NUM
+} SkirmishHoldType;
+
+typedef struct {
+     FusionLink      link;         /* in holder->holds */
+
+     FusionSkirmish *skirmish;
+     SkirmishHolder *holder;
+} SkirmishHold;
+
+/*
+ * All skirmishs locked by a task or transferred from it.
+ */
+struct __FUSION_SkirmishHolder {
+     FusionLink  link;             /* in held.skirmish_holders of the fusionee */
+
+     int         pid;
+     Fusionee   *fusionee;         /* fusionee of the first hold, NULL if gone */
+
+     FusionLink *holds;
+};
 
 struct __FUSION_FusionSkirmish {
      FusionEntry entry;
@@ -55,14 +86,23 @@ struct __FUSION_FusionSkirmish {
      FusionID transfer_from;
      int transfer_from_pid;
      int transfer_count;
-     unsigned int transfer_serial;
+     int transfer_call;       /* id of the call and ... */
+     unsigned int transfer_serial;  /* ... serial of its execution */
 
      FusionID transfer2_to;
      FusionID transfer2_from;
      int transfer2_from_pid;
      int transfer2_count;
+     int transfer2_call;
      unsigned int transfer2_serial;
 
+     int word;           /* index + 1 of the lock word, if any */
+
+     SkirmishHold holds[_SKIRMISH_HOLD_NUM];
+
+     FusionSkirmish *scan_next;
+     bool scanned;
+
 #ifdef FUSION_DEBUG_SKIRMISH_DEADLOCK
      int pre_acquis[MAX_PRE_ACQUISITIONS];
 
@@ -193,13 +233,523 @@ fusion_skirmish_print(FusionEntry * entry, void *ctx, struct seq_file *p)
      seq_printf(p, "\n");
 }
 
-FUSION_ENTRY_CLASS(FusionSkirmish, skirmish, NULL, NULL, fusion_skirmish_print)
+static void fusion_skirmish_destruct(FusionEntry * entry, void *ctx);
+
+FUSION_ENTRY_CLASS(FusionSkirmish, skirmish, NULL,
+                   fusion_skirmish_destruct, fusion_skirmish_print)
+
+/******************************************************************************/
+
+/*
+ * Each task keeps an index of the skirmishs it locked or transferred, so that transfer,
+ * reclaim, return and dismissal only visit those instead of all skirmishs of the world.
+ *
+ * The index is updated after each change of the lock state and may contain stale holds,
+ * the state of each skirmish found is checked as before. A holder is freed as soon as
+ * it has no holds left.
+ */
+static SkirmishHolder *
+holder_get(FusionDev * dev, int pid, FusionID fusion_id)
+{
+     SkirmishHolder *holder;
+
+     holder = fusion_hash_lookup( dev->skirmish_holders.hash, (void*)(long) pid );
+     if (holder) {
+          if (!holder->fusionee) {
+               if (!fusionee_lookup( dev, fusion_id, &holder->fusionee ))
+                    fusion_list_prepend( &holder->fusionee->held.skirmish_holders, &holder->link );
+          }
+          /* Task holding skirmishs for two fusionees, dismissal has to scan everything. */
+          else if (holder->fusionee->id != fusion_id)
+               dev->skirmish_holders.lost = 1;
+
+          return holder;
+     }
+
+     holder = fusion_core_malloc( fusion_core, sizeof(SkirmishHolder) );
+     if (!holder)
+          return NULL;
+
+     memset( holder, 0, sizeof(SkirmishHolder) );
+
+     holder->pid = pid;
+
+     if (fusion_hash_insert( dev->skirmish_holders.hash, (void*)(long) pid, holder )) {
+          fusion_core_free( fusion_core, holder );
+          return NULL;
+     }
+
+     if (!fusionee_lookup( dev, fusion_id, &holder->fusionee ))
+          fusion_list_prepend( &holder->fusionee->held.skirmish_holders, &holder->link );
+
+     return holder;
+}
+
+static void
+holder_unlink(SkirmishHolder * holder)
+{
+     if (holder->fusionee) {
+          fusion_list_remove( &holder->fusionee->held.skirmish_holders, &holder->link );
+
+          holder->fusionee = NULL;
+     }
+}
+
+static void
+holder_free(FusionDev * dev, SkirmishHolder * holder)
+{
+     FUSION_ASSERT( holder->holds == NULL );
+
+     holder_unlink( holder );
+
+     fusion_hash_remove( dev->skirmish_holders.hash, (void*)(long) holder->pid, NULL, NULL );
+
+     fusion_core_free( fusion_core, holder );
+}
+
+static void
+hold_set(FusionDev * dev, FusionSkirmish * skirmish, SkirmishHoldType type, int pid, FusionID fusion_id)
+{
+     SkirmishHold *hold = &skirmish->holds[type];
+
+     if (hold->holder) {
+          if (hold->holder->pid == pid)
+               return;
+
+          fusion_list_remove( &hold->holder->holds, &hold->link );
+
+          /* The task neither holds nor transferred anything anymore. */
+          if (!hold->holder->holds)
+               holder_free( dev, hold->holder );
+
+          hold->holder = NULL;
+     }
+
+     /* Returned locks have a pid of -1. */
+     if (pid <= 0)
+          return;
+
+     hold->holder = holder_get( dev, pid, fusion_id );
+     if (!hold->holder) {
+          dev->skirmish_holders.lost = 1;
+          return;
+     }
+
+     hold->skirmish = skirmish;
+
+     fusion_list_prepend( &hold->holder->holds, &hold->link );
+}
+
+static void
+holds_update(FusionDev * dev, FusionSkirmish * skirmish)
+{
+     hold_set( dev, skirmish, SKIRMISH_HOLD_LOCK, skirmish->lock_pid, skirmish->lock_fid );
+     hold_set( dev, skirmish, SKIRMISH_HOLD_TRANSFER, skirmish->transfer_to ? skirmish->transfer_from_pid : 0, skirmish->transfer_from );
+     hold_set( dev, skirmish, SKIRMISH_HOLD_TRANSFER2, skirmish->transfer2_to ? skirmish->transfer2_from_pid : 0, skirmish->transfer2_from );
+}
+
+static void
+scan_add(FusionSkirmish ** chain, FusionSkirmish * skirmish)
+{
+     if (skirmish->scanned)
+          return;
+
+     skirmish->scanned   = true;
+     skirmish->scan_next = *chain;
+
+     *chain = skirmish;
+}
+
+static FusionSkirmish *
+scan_pop(FusionSkirmish ** chain)
+{
+     FusionSkirmish *skirmish = *chain;
+
+     if (skirmish) {
+          *chain = skirmish->scan_next;
+
+          skirmish->scan_next = NULL;
+          skirmish->scanned   = false;
+     }
+
+     return skirmish;
+}
+
+static void
+scan_holder(SkirmishHolder * holder, FusionSkirmish ** chain)
+{
+     SkirmishHold *hold;
+
+     fusion_list_foreach (hold, holder->holds)
+          scan_add( chain, hold->skirmish );
+}
+
+static bool
+scan_holder_iterator(FusionHash * hash, void *key, void *value, void *ctx)
+{
+     scan_holder( value, ctx );
+
+     return false;
+}
+
+/*
+ * Returns all skirmishs held or transferred by the task with the pid given, or by any task if zero.
+ * The chain has to be consumed using scan_pop().
+ */
+static FusionSkirmish *
+scan_holds(FusionDev * dev, int pid)
+{
+     FusionSkirmish *chain = NULL;
+
+     if (dev->skirmish_holders.lost) {
+          FusionSkirmish *skirmish;
+
+          fusion_list_foreach (skirmish, dev->skirmish.list)
+               scan_add( &chain, skirmish );
+     }
+     else if (pid) {
+          SkirmishHolder *holder = fusion_hash_lookup( dev->skirmish_holders.hash, (void*)(long) pid );
+
+          if (holder)
+               scan_holder( holder, &chain );
+     }
+     else
+          fusion_hash_iterate( dev->skirmish_holders.hash, scan_holder_iterator, &chain );
+
+     return chain;
+}
+
+/*
+ * Returns all skirmishs held or transferred by the tasks of the fusionee given.
+ * The chain has to be consumed using scan_pop().
+ */
+static FusionSkirmish *
+scan_fusionee(FusionDev * dev, Fusionee * fusionee)
+{
+     FusionSkirmish *chain = NULL;
+     SkirmishHolder *holder;
+
+     if (dev->skirmish_holders.lost)
+          return scan_holds( dev, 0 );
+
+     fusion_list_foreach (holder, fusionee->held.skirmish_holders)
+          scan_holder( holder, &chain );
+
+     return chain;
+}
+
+static bool
+holder_free_iterator(FusionHash * hash, void *key, void *value, void *ctx)
+{
+     fusion_core_free( fusion_core, value );
+
+     return false;
+}
+
+/******************************************************************************/
+
+/*
+ * Lock words for locking in user space, see FusionSkirmishWord.
+ *
+ * Without FUSION_SKIRMISH_WORD_KERNEL in the word, the skirmish is free or locked by user space
+ * and the lock state of the skirmish is unused. Each operation adopts the word first, making the
+ * state valid again, and publishes the result at the end, giving the word back if it's idle.
+ */
+#define SKIRMISH_WORDS  (PAGE_SIZE / sizeof(u32))
+
+struct __Fusion_SkirmishWords {
+     u32            *table;        /* mapped by user space */
+
+     FusionSkirmish *skirmishs[SKIRMISH_WORDS];
+     FusionLink     *users[SKIRMISH_WORDS];     /* WordUser of each fusionee that got the word */
+};
+
+/*
+ * A fusionee that got the index of a lock word. Only its threads are taken into
+ * account as owners of the word, see word_owner().
+ */
+typedef struct {
+     FusionLink      link;          /* in held.skirmish_words of the fusionee */
+     FusionLink      word_link;     /* in users of the word */
+
+     Fusionee       *fusionee;
+     unsigned int    index;
+} WordUser;
+
+static SkirmishWords *
+words_get(FusionDev * dev)
+{
+     SkirmishWords *words = dev->skirmish_words;
+
+     if (!words) {
+          words = fusion_core_malloc( fusion_core, sizeof(SkirmishWords) );
+          if (!words)
+               return NULL;
+
+          words->table = (u32 *) get_zeroed_page( GFP_KERNEL );
+          if (!words->table) {
+               fusion_core_free( fusion_core, words );
+               return NULL;
+          }
+
+          SetPageReserved( virt_to_page( words->table ) );
+
+          dev->skirmish_words = words;
+     }
+
+     return words;
+}
+
+static void
+words_free(FusionDev * dev)
+{
+     SkirmishWords *words = dev->skirmish_words;
+
+     if (!words)
+          return;
+
+     ClearPageReserved( virt_to_page( words->table ) );
+
+     free_page( (unsigned long) words->table );
+
+     fusion_core_free( fusion_core, words );
+
+     dev->skirmish_words = NULL;
+}
+
+static int
+word_user_add(FusionDev * dev, Fusionee * fusionee, unsigned int index)
+{
+     WordUser      *user;
+     SkirmishWords *words = dev->skirmish_words;
+
+     direct_list_foreach_via (user, words->users[index], word_link) {
+          if (user->fusionee == fusionee)
+               return 0;
+     }
+
+     user = fusion_core_malloc( fusion_core, sizeof(WordUser) );
+     if (!user)
+          return -ENOMEM;
+
+     user->fusionee = fusionee;
+     user->index    = index;
+
+     fusion_list_prepend( &fusionee->held.skirmish_words, &user->link );
+     fusion_list_prepend( &words->users[index], &user->word_link );
+
+     return 0;
+}
+
+static void
+word_user_free(SkirmishWords * words, WordUser * user)
+{
+     fusion_list_remove( &user->fusionee->held.skirmish_words, &user->link );
+     fusion_list_remove( &words->users[user->index], &user->word_link );
+
+     fusion_core_free( fusion_core, user );
+}
+
+/*
+ * Returns the fusion id of the thread holding a lock word, or zero if it has gone.
+ */
+static FusionID
+word_owner(FusionDev * dev, unsigned int index, pid_t tid)
+{
+     struct task_struct *task;
+     struct mm_struct   *mm = NULL;
+     WordUser           *user;
+
+     rcu_read_lock();
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 24)
+     task = pid_task( find_vpid( tid ), PIDTYPE_PID );
+#else
+     task = find_task_by_pid( tid );
+#endif
+     if (task)
+          mm = task->mm;
+
+     rcu_read_unlock();
+
+     if (!mm)
+          return 0;
+
+     direct_list_foreach_via (user, dev->skirmish_words->users[index], word_link) {
+          if (user->fusionee->mm == mm)
+               return fusionee_id( user->fusionee );
+     }
+
+     return 0;
+}
+
+static void
+word_adopt(FusionDev * dev, FusionSkirmish * skirmish)
+{
+     u32  value;
+     u32 *word;
+     pid_t tid;
+     FusionID owner;
+
+     if (!skirmish->word)
+          return;
+
+     word = &dev->skirmish_words->table[skirmish->word - 1];
+
+     do {
+          value = *(volatile u32 *) word;
+
+          if (value & FUSION_SKIRMISH_WORD_KERNEL)
+               return;
+     } while (cmpxchg( word, value, value | FUSION_SKIRMISH_WORD_KERNEL ) != value);
+
+     if (!value)
+          return;
+
+     FUSION_ASSUME( skirmish->lock_pid == 0 );
+
+     tid   = value & FUSION_SKIRMISH_WORD_OWNER;
+     owner = word_owner( dev, skirmish->word - 1, tid );
+
+     /* Lock holder has gone, the skirmish is free. */
+     if (!owner)
+          return;
+
+     FUSION_DEBUG( "  -> lock_pid = %d (adopted)\n", fusion_core_pid_of( fusion_core, tid ) );
+
+     skirmish->lock_fid   = owner;
+     skirmish->lock_pid   = fusion_core_pid_of( fusion_core, tid );
+     skirmish->lock_count = 1;
+     skirmish->lock_time  = jiffies;
+
+     skirmish->lock_total++;
+
+     holds_update(dev, skirmish);
+}
+
+static void
+word_publish(FusionDev * dev, FusionSkirmish * skirmish)
+{
+     u32 *word;
+
+     if (!skirmish->word)
+          return;
+
+     word = &dev->skirmish_words->table[skirmish->word - 1];
+
+     /* Not adopted, still locked in user space. */
+     if (!(*(volatile u32 *) word & FUSION_SKIRMISH_WORD_KERNEL))
+          return;
+
+     if (skirmish->lock_pid || skirmish->transfer_to || skirmish->transfer2_to || skirmish->entry.waiters)
+          *(volatile u32 *) word = FUSION_SKIRMISH_WORD_KERNEL;
+     else
+          *(volatile u32 *) word = 0;
+}
+
+/*
+ * Called after each change of the lock state.
+ */
+static void
+skirmish_changed(FusionDev * dev, FusionSkirmish * skirmish)
+{
+     holds_update(dev, skirmish);
+
+     word_publish(dev, skirmish);
+}
+
+/*
+ * Adopts all words of the fusionee held by the thread with the pid given.
+ */
+static void
+words_adopt_pid(FusionDev * dev, Fusionee * fusionee, int pid)
+{
+     WordUser      *user;
+     SkirmishWords *words = dev->skirmish_words;
+
+     if (!words)
+          return;
+
+     direct_list_foreach (user, fusionee->held.skirmish_words) {
+          u32 value = *(volatile u32 *) &words->table[user->index];
+
+          if (!value || (value & FUSION_SKIRMISH_WORD_KERNEL))
+               continue;
+
+          if (fusion_core_pid_of( fusion_core, value & FUSION_SKIRMISH_WORD_OWNER ) == pid)
+               word_adopt( dev, words->skirmishs[user->index] );
+     }
+}
+
+/*
+ * Releases all words of the fusionee held by the thread with the pid given or, if zero,
+ * by any of its threads or any thread that has gone.
+ */
+static void
+words_release(FusionDev * dev, Fusionee * fusionee, int pid)
+{
+     WordUser      *user;
+     SkirmishWords *words = dev->skirmish_words;
+
+     if (!words)
+          return;
+
+     direct_list_foreach (user, fusionee->held.skirmish_words) {
+          u32   value = *(volatile u32 *) &words->table[user->index];
+          pid_t tid   = value & FUSION_SKIRMISH_WORD_OWNER;
+
+          if (!value || (value & FUSION_SKIRMISH_WORD_KERNEL))
+               continue;
+
+          if (pid) {
+               if (fusion_core_pid_of( fusion_core, tid ) != pid)
+                    continue;
+          }
+          else {
+               FusionID owner = word_owner( dev, user->index, tid );
+
+               if (owner && owner != fusionee_id( fusionee ))
+                    continue;
+          }
+
+          /* Nobody can be waiting without the kernel flag. */
+          cmpxchg( &words->table[user->index], value, 0 );
+     }
+}
+
+static void fusion_skirmish_destruct(FusionEntry * entry, void *ctx)
+{
+     FusionSkirmish *skirmish = (FusionSkirmish *) entry;
+     FusionDev      *dev      = ctx;
+
+     int             i;
+
+     if (skirmish->word) {
+          SkirmishWords *words = dev->skirmish_words;
+          WordUser      *user, *next;
+
+          direct_list_foreach_via_safe (user, next, words->users[skirmish->word - 1], word_link)
+               word_user_free( words, user );
+
+          words->table[skirmish->word - 1]     = 0;
+          words->skirmishs[skirmish->word - 1] = NULL;
+     }
+
+     for (i = 0; i < _SKIRMISH_HOLD_NUM; i++)
+          hold_set( dev, skirmish, i, 0, 0 );
+}
 
 /******************************************************************************/
 int fusion_skirmish_init(FusionDev * dev)
 {
      FUSION_DEBUG("%s \n", __FUNCTION__);
 
+     if (!dev->refs) {
+          int ret = fusion_hash_create( FHT_INT, FHT_PTR, 17, &dev->skirmish_holders.hash );
+          if (ret)
+               return ret;
+     }
+
      fusion_entries_init(&dev->skirmish, &skirmish_class, dev, dev);
 
      fusion_entries_create_proc_entry(dev, "skirmishs", &dev->skirmish);
@@ -214,6 +764,16 @@ void fusion_skirmish_deinit(FusionDev * dev)
      fusion_entries_destroy_proc_entry( dev, "skirmishs" );
 
      fusion_entries_deinit(&dev->skirmish);
+
+     if (!dev->refs) {
+          words_free(dev);
+
+          fusion_hash_iterate( dev->skirmish_holders.hash, holder_free_iterator, NULL );
+          fusion_hash_destroy( dev->skirmish_holders.hash );
+
+          dev->skirmish_holders.hash = NULL;
+          dev->skirmish_holders.lost = 0;
+     }
 }
 
 /******************************************************************************/
@@ -223,23 +783,16 @@ int fusion_skirmish_new(FusionDev * dev, Fusionee *fusionee, int *ret_id)
      return fusion_entry_create(&dev->skirmish, ret_id, NULL, fusionee_id(fusionee));
 }
 
-int fusion_skirmish_prevail(FusionDev * dev, int id, int fusion_id)
+static int
+skirmish_prevail(FusionDev * dev, FusionSkirmish * skirmish, int id, int fusion_id)
 {
      int ret;
-     FusionSkirmish *skirmish;
 #ifdef FUSION_DEBUG_SKIRMISH_DEADLOCK
      FusionSkirmish *s;
      int i;
      bool outer = true;
 #endif
 
-     FUSION_DEBUG( "%s( id %d, fusion_id %d )\n", __FUNCTION__, id, fusion_id);
-     dev->stat.skirmish_prevail_swoop++;
-
-     ret = fusion_skirmish_lookup(&dev->skirmish, id, &skirmish);
-     if (ret)
-          return ret;
-
      if (skirmish->lock_pid == fusion_core_pid( fusion_core )) {
           skirmish->lock_count++;
           skirmish->lock_total++;
@@ -312,9 +865,9 @@ int fusion_skirmish_prevail(FusionDev * dev, int id, int fusion_id)
      while (   skirmish->lock_pid
                || (    (skirmish->transfer2_to == 0)
                        &&  skirmish->transfer_to
-                       && (fusionee_dispatcher_pid(dev, skirmish-> transfer_to) != fusion_core_pid( fusion_core )))
+                       && !fusionee_dispatching(dev, skirmish->transfer_to, skirmish->transfer_call, skirmish->transfer_serial))
                || (     skirmish->transfer2_to
-                        && (fusionee_dispatcher_pid(dev, skirmish-> transfer2_to) != fusion_core_pid( fusion_core ))) ) {
+                        && !fusionee_dispatching(dev, skirmish->transfer2_to, skirmish->transfer2_call, skirmish->transfer2_serial)) ) {
           ret = fusion_skirmish_wait(skirmish, NULL);
           if (ret)
                return ret;
@@ -332,6 +885,29 @@ int fusion_skirmish_prevail(FusionDev * dev, int id, int fusion_id)
      return 0;
 }
 
+int fusion_skirmish_prevail(FusionDev * dev, int id, int fusion_id)
+{
+     int ret;
+     FusionSkirmish *skirmish;
+
+     FUSION_DEBUG( "%s( id %d, fusion_id %d )\n", __FUNCTION__, id, fusion_id);
+     dev->stat.skirmish_prevail_swoop++;
+
+     ret = fusion_skirmish_lookup(&dev->skirmish, id, &skirmish);
+     if (ret)
+          return ret;
+
+     word_adopt(dev, skirmish);
+
+     ret = skirmish_prevail(dev, skirmish, id, fusion_id);
+
+     /* Unless destroyed while waiting. */
+     if (ret != -EIDRM)
+          skirmish_changed(dev, skirmish);
+
+     return ret;
+}
+
 int fusion_skirmish_swoop(FusionDev * dev, int id, int fusion_id)
 {
      int ret;
@@ -345,18 +921,22 @@ int fusion_skirmish_swoop(FusionDev * dev, int id, int fusion_id)
 
      dev->stat.skirmish_prevail_swoop++;
 
+     word_adopt(dev, skirmish);
+
      if (   skirmish->lock_fid
             || (    (skirmish->transfer2_to == 0)
                     &&  skirmish->transfer_to
-                    && (fusionee_dispatcher_pid(dev, skirmish->transfer_to) != fusion_core_pid( fusion_core )))
+                    && !fusionee_dispatching(dev, skirmish->transfer_to, skirmish->transfer_call, skirmish->transfer_serial))
             || (     skirmish->transfer2_to
-                     && (fusionee_dispatcher_pid(dev, skirmish-> transfer2_to) != fusion_core_pid( fusion_core ))) ) {
+                     && !fusionee_dispatching(dev, skirmish->transfer2_to, skirmish->transfer2_call, skirmish->transfer2_serial)) ) {
           if (skirmish->lock_pid == fusion_core_pid( fusion_core )) {
                skirmish->lock_count++;
                skirmish->lock_total++;
+               skirmish_changed(dev, skirmish);
                return 0;
           }
 
+          skirmish_changed(dev, skirmish);
           return -EAGAIN;
      }
 
@@ -368,6 +948,8 @@ int fusion_skirmish_swoop(FusionDev * dev, int id, int fusion_id)
 
      skirmish->lock_total++;
 
+     skirmish_changed(dev, skirmish);
+
      return 0;
 }
 
@@ -382,6 +964,8 @@ fusion_skirmish_lock_count(FusionDev * dev, int id, int fusion_id,
      if (ret)
           return ret;
 
+     word_adopt(dev, skirmish);
+
      if (skirmish->lock_fid == fusion_id &&
          skirmish->lock_pid == fusion_core_pid( fusion_core )) {
           *ret_lock_count = skirmish->lock_count;
@@ -390,6 +974,8 @@ fusion_skirmish_lock_count(FusionDev * dev, int id, int fusion_id,
           *ret_lock_count = 0;
      }
 
+     skirmish_changed(dev, skirmish);
+
      return 0;
 }
 
@@ -407,8 +993,12 @@ int fusion_skirmish_dismiss(FusionDev * dev, int id, int fusion_id)
 
      dev->stat.skirmish_dismiss++;
 
-     if (skirmish->lock_pid != fusion_core_pid( fusion_core ))
+     word_adopt(dev, skirmish);
+
+     if (skirmish->lock_pid != fusion_core_pid( fusion_core )) {
+          skirmish_changed(dev, skirmish);
           return -EIO;
+     }
 
      if (--skirmish->lock_count == 0) {
           FUSION_DEBUG( "  -> lock_pid = 0\n" );
@@ -421,6 +1011,8 @@ int fusion_skirmish_dismiss(FusionDev * dev, int id, int fusion_id)
           fusion_skirmish_notify(skirmish);
      }
 
+     skirmish_changed(dev, skirmish);
+
      return 0;
 }
 
@@ -454,33 +1046,11 @@ int fusion_skirmish_destroy(FusionDev * dev, int id)
      return 0;
 }
 
-int
-fusion_skirmish_wait_(FusionDev * dev, FusionSkirmishWait * wait,
-                      FusionID fusion_id)
+static int
+skirmish_wait(FusionDev * dev, FusionSkirmish * skirmish,
+              FusionSkirmishWait * wait, FusionID fusion_id)
 {
-     int ret, ret2;
-     FusionSkirmish *skirmish;
-
-     FUSION_DEBUG( "%s( fusion_id %ld )\n", __FUNCTION__, fusion_id);
-
-     FUSION_SKIRMISH_LOG
-     ("FusionSkirmish: %s( 0x%x, lock count %u, notify count %u, timeout %u ) called...\n",
-      __FUNCTION__, wait->id, wait->lock_count, wait->notify_count,
-      wait->timeout);
-
-     /* Lookup and lock the entry. */
-     ret = fusion_skirmish_lookup(&dev->skirmish, wait->id, &skirmish);
-     if (ret) {
-          FUSION_SKIRMISH_LOG
-          ("FusionSkirmish: Failed to lookup skirmish with id 0x%x!\n",
-           wait->id);
-          return ret;
-     }
-
-     FUSION_SKIRMISH_LOG("FusionSkirmish: Found entry at %p!\n", skirmish);
-
-     /* Statistics... */
-     dev->stat.skirmish_wait++;
+     int ret = 0, ret2;
 
      /* Check if not a resumed call. */
      if (!wait->lock_count) {
@@ -594,6 +1164,45 @@ fusion_skirmish_wait_(FusionDev * dev, FusionSkirmishWait * wait,
      return ret;
 }
 
+int
+fusion_skirmish_wait_(FusionDev * dev, FusionSkirmishWait * wait,
+                      FusionID fusion_id)
+{
+     int ret;
+     FusionSkirmish *skirmish;
+
+     FUSION_DEBUG( "%s( fusion_id %ld )\n", __FUNCTION__, fusion_id);
+
+     FUSION_SKIRMISH_LOG
+     ("FusionSkirmish: %s( 0x%x, lock count %u, notify count %u, timeout %u ) called...\n",
+      __FUNCTION__, wait->id, wait->lock_count, wait->notify_count,
+      wait->timeout);
+
+     /* Lookup and lock the entry. */
+     ret = fusion_skirmish_lookup(&dev->skirmish, wait->id, &skirmish);
+     if (ret) {
+          FUSION_SKIRMISH_LOG
+          ("FusionSkirmish: Failed to lookup skirmish with id 0x%x!\n",
+           wait->id);
+          return ret;
+     }
+
+     FUSION_SKIRMISH_LOG("FusionSkirmish: Found entry at %p!\n", skirmish);
+
+     /* Statistics... */
+     dev->stat.skirmish_wait++;
+
+     word_adopt(dev, skirmish);
+
+     ret = skirmish_wait(dev, skirmish, wait, fusion_id);
+
+     /* Unless destroyed while waiting. */
+     if (ret != -EIDRM && ret != -EINVAL)
+          skirmish_changed(dev, skirmish);
+
+     return ret;
+}
+
 int fusion_skirmish_notify_(FusionDev * dev, int id, FusionID fusion_id)
 {
      int ret;
@@ -607,25 +1216,108 @@ int fusion_skirmish_notify_(FusionDev * dev, int id, FusionID fusion_id)
 
      dev->stat.skirmish_notify++;
 
-     if (skirmish->lock_pid != fusion_core_pid( fusion_core ))
+     word_adopt(dev, skirmish);
+
+     if (skirmish->lock_pid != fusion_core_pid( fusion_core )) {
+          skirmish_changed(dev, skirmish);
           return -EIO;
+     }
 
      skirmish->notify_count++;
 
      fusion_skirmish_notify(skirmish);
 
+     skirmish_changed(dev, skirmish);
+
      return 0;
 }
 
-void fusion_skirmish_dismiss_all(FusionDev * dev, int fusion_id)
+int fusion_skirmish_get_word(FusionDev * dev, int id, Fusionee * fusionee, int *ret_index)
 {
-     FusionLink *l;
+     int ret;
+     unsigned int i;
+     FusionSkirmish *skirmish;
+     SkirmishWords *words;
+
+     FUSION_DEBUG( "%s( id %d )\n", __FUNCTION__, id );
+
+     /* Anyone mapping the words could take or break any lock. */
+     if (dev->secure && fusionee_id(fusionee) != FUSION_ID_MASTER)
+          return -EPERM;
+
+     ret = fusion_skirmish_lookup(&dev->skirmish, id, &skirmish);
+     if (ret)
+          return ret;
+
+     if (!skirmish->word) {
+          words = words_get(dev);
+          if (!words)
+               return -ENOMEM;
 
-     FUSION_DEBUG("%s: fusion_id=%d\n", __FUNCTION__, fusion_id);
+          for (i = 0; i < SKIRMISH_WORDS; i++) {
+               if (!words->skirmishs[i])
+                    break;
+          }
+
+          if (i == SKIRMISH_WORDS)
+               return -ENOSPC;
+
+          words->skirmishs[i] = skirmish;
+
+          skirmish->word = i + 1;
+
+          /* Keep using the kernel until the skirmish is idle. */
+          words->table[i] = FUSION_SKIRMISH_WORD_KERNEL;
+
+          skirmish_changed(dev, skirmish);
+     }
+
+     ret = word_user_add(dev, fusionee, skirmish->word - 1);
+     if (ret)
+          return ret;
 
-     fusion_list_foreach(l, dev->skirmish.list) {
-          FusionSkirmish *skirmish = (FusionSkirmish *) l;
+     *ret_index = skirmish->word - 1;
+
+     return 0;
+}
 
+int fusion_skirmish_map_words(FusionDev * dev, Fusionee * fusionee, struct vm_area_struct *vma)
+{
+     SkirmishWords *words;
+
+     if (dev->secure && fusionee_id(fusionee) != FUSION_ID_MASTER)
+          return -EPERM;
+
+     if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+          return -EINVAL;
+
+     words = words_get(dev);
+     if (!words)
+          return -ENOMEM;
+
+     return remap_pfn_range( vma, vma->vm_start,
+                             virt_to_phys( words->table ) >> PAGE_SHIFT,
+                             PAGE_SIZE, vma->vm_page_prot );
+}
+
+void fusion_skirmish_dismiss_all(FusionDev * dev, Fusionee * fusionee)
+{
+     FusionSkirmish *skirmish;
+     FusionSkirmish *chain;
+     SkirmishHolder *holder, *next;
+     WordUser       *user, *next_user;
+     FusionID        fusion_id = fusionee_id(fusionee);
+
+     FUSION_DEBUG("%s: fusion_id=%ld\n", __FUNCTION__, fusion_id);
+
+     words_release(dev, fusionee, 0);
+
+     direct_list_foreach_safe (user, next_user, fusionee->held.skirmish_words)
+          word_user_free( dev->skirmish_words, user );
+
+     chain = scan_fusionee( dev, fusionee );
+
+     while ((skirmish = scan_pop( &chain )) != NULL) {
           if (skirmish->lock_fid == fusion_id) {
                FUSION_DEBUG( "  -> lock_pid = 0\n" );
 
@@ -650,6 +1342,8 @@ void fusion_skirmish_dismiss_all(FusionDev * dev, int fusion_id)
                skirmish->transfer_from     = skirmish->transfer2_from;
                skirmish->transfer_from_pid = skirmish->transfer2_from_pid;
                skirmish->transfer_count    = skirmish->transfer2_count;
+               skirmish->transfer_call     = skirmish->transfer2_call;
+               skirmish->transfer_serial   = skirmish->transfer2_serial;
 
                if (skirmish->transfer2_to) {
                     skirmish->transfer2_to       = 0;
@@ -660,18 +1354,44 @@ void fusion_skirmish_dismiss_all(FusionDev * dev, int fusion_id)
 
                fusion_core_wq_wake( fusion_core, &skirmish->entry.wait);
           }
+
+          skirmish_changed(dev, skirmish);
      }
+
+     /* Holders left have holds of another fusionee, see holder_get(). */
+     fusion_list_foreach_safe (holder, next, fusionee->held.skirmish_holders)
+          holder_unlink( holder );
 }
 
-void fusion_skirmish_dismiss_all_from_pid(FusionDev * dev, int pid)
+/*
+ * The child may use the lock words the parent got.
+ */
+int fusion_skirmish_fork_all(FusionDev * dev, Fusionee * fusionee, Fusionee * from)
 {
-     FusionLink *l;
+     int       ret;
+     WordUser *user;
+
+     direct_list_foreach (user, from->held.skirmish_words) {
+          ret = word_user_add(dev, fusionee, user->index);
+          if (ret)
+               return ret;
+     }
+
+     return 0;
+}
+
+void fusion_skirmish_dismiss_all_from_pid(FusionDev * dev, Fusionee * fusionee, int pid)
+{
+     FusionSkirmish *skirmish;
+     FusionSkirmish *chain;
 
      FUSION_DEBUG("%s: pid=%d\n", __FUNCTION__, pid);
 
-     fusion_list_foreach(l, dev->skirmish.list) {
-          FusionSkirmish *skirmish = (FusionSkirmish *) l;
+     words_release(dev, fusionee, pid);
 
+     chain = scan_holds( dev, pid );
+
+     while ((skirmish = scan_pop( &chain )) != NULL) {
           if (skirmish->lock_pid == pid) {
                FUSION_DEBUG( "  -> lock_pid = 0\n" );
 
@@ -696,6 +1416,8 @@ void fusion_skirmish_dismiss_all_from_pid(FusionDev * dev, int pid)
                skirmish->transfer_from     = skirmish->transfer2_from;
                skirmish->transfer_from_pid = skirmish->transfer2_from_pid;
                skirmish->transfer_count    = skirmish->transfer2_count;
+               skirmish->transfer_call     = skirmish->transfer2_call;
+               skirmish->transfer_serial   = skirmish->transfer2_serial;
 
                if (skirmish->transfer2_to) {
                     skirmish->transfer2_to       = 0;
@@ -706,20 +1428,28 @@ void fusion_skirmish_dismiss_all_from_pid(FusionDev * dev, int pid)
 
                fusion_core_wq_wake( fusion_core, &skirmish->entry.wait);
           }
+
+          skirmish_changed(dev, skirmish);
      }
 }
 
 void
 fusion_skirmish_transfer_all(FusionDev * dev,
-                             FusionID to, FusionID from, int from_pid, unsigned int serial)
+                             FusionID to, FusionID from, int from_pid, int call_id, unsigned int serial)
 {
-     FusionLink *l;
+     FusionSkirmish *skirmish;
+     FusionSkirmish *chain;
+     Fusionee       *fusionee;
+
+     FUSION_DEBUG("%s: to=%ld, from=%ld, from_pid=%d, call_id=%d, serial=%d\n", __FUNCTION__, to, from, from_pid, call_id, serial );
 
-     FUSION_DEBUG("%s: to=%ld, from=%ld, from_pid=%d, serial=%d\n", __FUNCTION__, to, from, from_pid, serial );
+     /* Locks taken in user space are transferred as well. */
+     if (!fusionee_lookup( dev, from, &fusionee ))
+          words_adopt_pid(dev, fusionee, from_pid);
 
-     fusion_list_foreach(l, dev->skirmish.list) {
-          FusionSkirmish *skirmish = (FusionSkirmish *) l;
+     chain = scan_holds( dev, from_pid );
 
+     while ((skirmish = scan_pop( &chain )) != NULL) {
           if (skirmish->lock_pid == from_pid) {
                if (skirmish->transfer_to == 0) {
                     FUSION_ASSERT(skirmish->transfer_from == 0);
@@ -731,6 +1461,7 @@ fusion_skirmish_transfer_all(FusionDev * dev,
                     skirmish->transfer_from     = from;
                     skirmish->transfer_from_pid = from_pid;
                     skirmish->transfer_count    = skirmish->lock_count;
+                    skirmish->transfer_call     = call_id;
                     skirmish->transfer_serial   = serial;
 
                     FUSION_DEBUG( "  -> lock_pid = 0\n" );
@@ -751,6 +1482,7 @@ fusion_skirmish_transfer_all(FusionDev * dev,
                     skirmish->transfer2_from     = from;
                     skirmish->transfer2_from_pid = from_pid;
                     skirmish->transfer2_count    = skirmish->lock_count;
+                    skirmish->transfer2_call     = call_id;
                     skirmish->transfer2_serial   = serial;
 
                     FUSION_DEBUG( "  -> lock_pid = 0\n" );
@@ -762,18 +1494,21 @@ fusion_skirmish_transfer_all(FusionDev * dev,
                     fusion_core_wq_wake( fusion_core, &skirmish->entry.wait);
                }
           }
+
+          skirmish_changed(dev, skirmish);
      }
 }
 
 void fusion_skirmish_reclaim_all(FusionDev * dev, int from_pid)
 {
-     FusionLink *l;
+     FusionSkirmish *skirmish;
+     FusionSkirmish *chain;
 
      FUSION_DEBUG("%s: from_pid=%d\n", __FUNCTION__, from_pid);
 
-     fusion_list_foreach(l, dev->skirmish.list) {
-          FusionSkirmish *skirmish = (FusionSkirmish *) l;
+     chain = scan_holds( dev, from_pid );
 
+     while ((skirmish = scan_pop( &chain )) != NULL) {
           if ((skirmish->transfer2_to == 0)
               &&  skirmish->transfer_to
               && (skirmish->transfer_from_pid == from_pid) ) {
@@ -814,18 +1549,21 @@ void fusion_skirmish_reclaim_all(FusionDev * dev, int from_pid)
                skirmish->transfer2_from_pid = 0;
                skirmish->transfer2_count    = 0;
           }
+
+          skirmish_changed(dev, skirmish);
      }
 }
 
 void fusion_skirmish_return_all(FusionDev * dev, int from_fusion_id, int to_pid, unsigned int serial)
 {
-     FusionLink *l;
+     FusionSkirmish *skirmish;
+     FusionSkirmish *chain;
 
      FUSION_DEBUG("%s: from_fusion_id=%d, to_pid=%d, serial=%d\n", __FUNCTION__, from_fusion_id, to_pid, serial);
 
-     fusion_list_foreach(l, dev->skirmish.list) {
-          FusionSkirmish *skirmish = (FusionSkirmish *) l;
+     chain = scan_holds( dev, to_pid );
 
+     while ((skirmish = scan_pop( &chain )) != NULL) {
           if (skirmish->transfer2_to == 0) {
                if (skirmish->transfer_to       == from_fusion_id &&
                    skirmish->transfer_from_pid == to_pid         &&
@@ -857,18 +1595,94 @@ void fusion_skirmish_return_all(FusionDev * dev, int from_fusion_id, int to_pid,
 
                skirmish->lock_pid = -1;
           }
+
+          skirmish_changed(dev, skirmish);
      }
 }
 
+/*
+ * Takes back the skirmishs transferred for a call that timed out, unless the
+ * callee holds one of them right now. Nothing is revoked in that case, except
+ * when forced, which takes them away from the callee as well.
+ */
+int fusion_skirmish_revoke_all(FusionDev * dev, int from_fusion_id, int to_pid, unsigned int serial, bool force)
+{
+     FusionSkirmish *skirmish;
+     FusionSkirmish *chain;
+     bool            busy = false;
+
+     FUSION_DEBUG("%s: from_fusion_id=%d, to_pid=%d, serial=%d\n", __FUNCTION__, from_fusion_id, to_pid, serial);
+
+     chain = scan_holds( dev, to_pid );
+
+     while ((skirmish = scan_pop( &chain )) != NULL) {
+          if (skirmish->transfer2_to == 0) {
+               if (skirmish->transfer_to       == from_fusion_id &&
+                   skirmish->transfer_from_pid == to_pid         &&
+                   skirmish->transfer_serial   == serial         &&
+                   skirmish->lock_pid          != 0                 )
+                    busy = true;
+          }
+          else if (skirmish->transfer2_from_pid == to_pid         &&
+                   skirmish->transfer2_to       == from_fusion_id &&
+                   skirmish->transfer2_serial   == serial         &&
+                   skirmish->lock_pid           != 0                 )
+               busy = true;
+     }
+
+     if (busy && !force)
+          return -EBUSY;
+
+     chain = scan_holds( dev, to_pid );
+
+     while ((skirmish = scan_pop( &chain )) != NULL) {
+          if (skirmish->transfer2_to == 0) {
+               if (skirmish->transfer_to       == from_fusion_id &&
+                   skirmish->transfer_from_pid == to_pid         &&
+                   skirmish->transfer_serial   == serial            ) {
+                    FUSION_DEBUG( "  -> lock_pid = %d\n", skirmish->transfer_from_pid );
+
+                    skirmish->lock_fid   = skirmish->transfer_from;
+                    skirmish->lock_pid   = skirmish->transfer_from_pid;
+                    skirmish->lock_count = skirmish->transfer_count;
+
+                    skirmish->transfer_to       = 0;
+                    skirmish->transfer_from     = 0;
+                    skirmish->transfer_from_pid = 0;
+                    skirmish->transfer_count    = 0;
+               }
+          }
+          else if (skirmish->transfer2_from_pid == to_pid   &&
+                   skirmish->transfer2_to       == from_fusion_id &&
+                   skirmish->transfer2_serial   == serial            ) {
+               FUSION_DEBUG( "  -> lock_pid = %d\n", skirmish->transfer2_from_pid );
+
+               skirmish->lock_fid   = skirmish->transfer2_from;
+               skirmish->lock_pid   = skirmish->transfer2_from_pid;
+               skirmish->lock_count = skirmish->transfer2_count;
+
+               skirmish->transfer2_to       = 0;
+               skirmish->transfer2_from     = 0;
+               skirmish->transfer2_from_pid = 0;
+               skirmish->transfer2_count    = 0;
+          }
+
+          skirmish_changed(dev, skirmish);
+     }
+
+     return 0;
+}
+
 void fusion_skirmish_return_all_from(FusionDev * dev, int from_fusion_id)
 {
-     FusionLink *l;
+     FusionSkirmish *skirmish;
+     FusionSkirmish *chain;
 
      FUSION_DEBUG("%s: from_fusion_id=%d\n", __FUNCTION__, from_fusion_id);
 
-     fusion_list_foreach(l, dev->skirmish.list) {
-          FusionSkirmish *skirmish = (FusionSkirmish *) l;
+     chain = scan_holds( dev, 0 );
 
+     while ((skirmish = scan_pop( &chain )) != NULL) {
           if (skirmish->transfer2_to == 0) {
                if (skirmish->transfer_to == from_fusion_id) {
                     FUSION_ASSERT(skirmish->transfer_from != 0);
@@ -896,6 +1710,8 @@ void fusion_skirmish_return_all_from(FusionDev * dev, int from_fusion_id)
 
                skirmish->lock_pid = -1;
           }
+
+          skirmish_changed(dev, skirmish);
      }
 }
 
@@ -15,6 +15,8 @@
 #ifndef __FUSION__SKIRMISH_H__
 #define __FUSION__SKIRMISH_H__
 
+#include <linux/mm.h>
+
 #include "fusiondev.h"
 #include "types.h"
 
@@ -43,18 +45,26 @@ int fusion_skirmish_wait_(FusionDev * dev,
 
 int fusion_skirmish_notify_(FusionDev * dev, int id, FusionID fusion_id);
 
+int fusion_skirmish_get_word(FusionDev * dev, int id, Fusionee * fusionee, int *ret_index);
+
+int fusion_skirmish_map_words(FusionDev * dev, Fusionee * fusionee, struct vm_area_struct *vma);
+
 /* internal functions */
 
-void fusion_skirmish_dismiss_all(FusionDev * dev, int fusion_id);
+void fusion_skirmish_dismiss_all(FusionDev * dev, Fusionee * fusionee);
 
-void fusion_skirmish_dismiss_all_from_pid(FusionDev * dev, int pid);
+int fusion_skirmish_fork_all(FusionDev * dev, Fusionee * fusionee, Fusionee * from);
+
+void fusion_skirmish_dismiss_all_from_pid(FusionDev * dev, Fusionee * fusionee, int pid);
 
 void fusion_skirmish_transfer_all(FusionDev * dev,
-                                  FusionID to, FusionID from, int from_pid, unsigned int serial);
+                                  FusionID to, FusionID from, int from_pid, int call_id, unsigned int serial);
 
 void fusion_skirmish_reclaim_all(FusionDev * dev, int from_pid);
 
 void fusion_skirmish_return_all(FusionDev * dev, int from_fusion_id, int to_fusion_id, unsigned int serial);
 void fusion_skirmish_return_all_from(FusionDev * dev, int from_fusion_id);
 
+int  fusion_skirmish_revoke_all(FusionDev * dev, int from_fusion_id, int to_pid, unsigned int serial, bool force);
+
 #endif
@@ -81,6 +81,9 @@ typedef struct {
 
 /*
  * Receiving a message
+ *
+ * If the next message doesn't fit into the buffer passed to read(), it fails with
+ * EMSGSIZE and the message stays queued. Messages are at most 64k plus headers.
  */
 typedef enum {
      FMT_SEND,                               /* msg_id is an optional custom id */
@@ -88,7 +91,8 @@ typedef enum {
      FMT_REACTOR,                            /* msg_id is the reactor id */
      FMT_SHMPOOL,                            /* msg_id is the pool id */
      FMT_CALL3,                              /* msg_id is the call id */
-     FMT_LEAVE                               /* FusionID in message data */
+     FMT_LEAVE,                              /* FusionID in message data */
+     FMT_CALL_RESULT                         /* msg_id is the call id, FusionCallResult in message data */
 } FusionMessageType;
 
 typedef struct {
@@ -101,6 +105,30 @@ typedef struct {
      /* message data follows */
 } FusionReadMessage;
 
+/*
+ * Receive ring
+ *
+ * Mapping the device at FUSION_MMAP_RECEIVE_RING with one header page followed by
+ * a power of two number of pages enables the ring for the calling fusionee. The data
+ * area must not exceed FUSION_RING_MAX_SIZE.
+ *
+ * Messages without dispatch callback are written to the ring as long as no packets
+ * are queued, otherwise they are queued and returned by read() as usual. The ring
+ * always holds the older messages, so read() returns zero while it is not empty.
+ *
+ * Each record is a FusionReadMessage followed by its data, aligned to four bytes.
+ * If less than a FusionReadMessage fits before the end of the data area or msg_size
+ * is FUSION_RING_WRAP, the next record starts at the beginning of the data area.
+ */
+typedef struct {
+     unsigned int             size;          /* size of the data area following the header page */
+     volatile unsigned int    head;          /* free running write position, updated by fusion */
+     volatile unsigned int    tail;          /* free running read position, updated by the receiver */
+} FusionReceiveRing;
+
+#define FUSION_RING_WRAP               (-1)
+#define FUSION_RING_MAX_SIZE           0x100000
+
 /*
  * Dispatching a message via a reactor
  */
@@ -161,7 +189,10 @@ typedef enum {
      FCEF_ERROR               = 0x00000008,
      FCEF_RESUMABLE           = 0x00000010,
      FCEF_DONE                = 0x00000020,
-     FCEF_ALL                 = 0x0000003f
+     FCEF_ASYNC               = 0x00000040,  /* return at once, result is received as FMT_CALL_RESULT */
+     FCEF_SHMPOOL             = 0x00000080,  /* argument and return data are a FusionSHMPoolRef each (EXECUTE3 only) */
+     FCEF_TIMEOUT             = 0x00000100,  /* give up waiting after timeout_ms with ETIMEDOUT (EXECUTE3 only) */
+     FCEF_ALL                 = 0x000001ff
 } FusionCallExecFlags;
 
 typedef struct {
@@ -200,7 +231,11 @@ typedef struct {
      unsigned int             ret_length;    /* maximum (input) and actual (output) length of return buffer */
 
      FusionCallExecFlags      flags;         /* execution flags */
-     unsigned int             serial;        /* with FCEF_RESUMABLE used for EINTR handling, intialise with zero!!! */
+     unsigned int             serial;        /* with FCEF_RESUMABLE used for EINTR handling, intialise with zero!!!
+                                                with FCEF_ASYNC returns the serial of the FMT_CALL_RESULT to expect */
+
+     int                      timeout_ms;    /* with FCEF_TIMEOUT the time to wait for the result, the call is cancelled
+                                                when it expires, only passed by binaries built with this field */
 } FusionCallExecute3;
 
 typedef struct {
@@ -220,6 +255,26 @@ typedef struct {
      unsigned int             length;        /* length of return buffer */
 } FusionCallReturn3;
 
+/*
+ * Return the result of the previous call and receive the next messages
+ * (like FUSION_CALL_RETURN3 followed by read()) within one system call.
+ */
+typedef struct {
+     FusionCallReturn3        ret;           /* [input] previous call, call_id is zero if nothing to return */
+
+     void                    *buf;           /* [input] buffer for the messages as for read() */
+     unsigned int             buf_size;      /* [input] size of the buffer */
+     unsigned int             flags;         /* [input] FCRRF_NONBLOCK */
+
+     int                      ret_result;    /* [output] result of returning the previous call */
+     int                      received;      /* [output] number of bytes received */
+} FusionCallReturnReceive;
+
+typedef enum {
+     FCRRF_NONE               = 0x00000000,
+     FCRRF_NONBLOCK           = 0x00000001,  /* return -EAGAIN instead of waiting for messages */
+} FusionCallReturnReceiveFlags;
+
 typedef struct {
      int                      call_id;       /* [input] call from which to get the owner */
 
@@ -243,19 +298,62 @@ typedef struct {
      unsigned int             serial;        /* serial number of call, used for return, zero if nothing shall be returned */
 } FusionCallMessage;
 
+/*
+ * Several executions of a call at once
+ *
+ * Watched references set up with FUSION_REF_SET_BATCH that reach zero while the local
+ * references of an exiting fusionee are cleared are notified together, with one FMT_CALL
+ * for up to FUSION_CALL_BATCH_MAX of them. Such a message is recognized by being larger
+ * than a FusionCallMessage, its call_arg is the number of call args that follow.
+ */
+#define FUSION_CALL_BATCH_MAX  1000
+
+typedef struct {
+     FusionCallMessage        message;       /* call_arg is the number of call args */
+
+     int                      call_args[0];  /* call_arg of each execution */
+} FusionCallBatchMessage;
+
 typedef struct {
      void                    *handler;       /* function pointer of handler to call */
      void                    *ctx;           /* optional handler context */
 
      int                      caller;        /* fusion id of the caller or zero if called from Fusion */
      int                      call_arg;      /* optional call parameter */
-     void                    *call_ptr;      /* optional data */
+     void                    *call_ptr;      /* optional data, with FCEF_SHMPOOL pointing into the pool (no data follows) */
      unsigned int             call_length;   /* length of data */
      unsigned int             ret_length;    /* maximum length of return data */
 
      unsigned int             serial;        /* serial number of call, used for return, zero if nothing shall be returned */
 } FusionCallMessage3;
 
+/*
+ * Data within a shared memory pool
+ *
+ * With FCEF_SHMPOOL the argument of FUSION_CALL_EXECUTE3 is a reference to data in a pool
+ * instead of the data itself. Both caller and callee need to have the pool attached.
+ * The callee receives the address of the data in call_ptr, which is valid in every
+ * process, and returns a reference as well, which is passed to the caller as is.
+ */
+typedef struct {
+     int                      pool_id;       /* pool attached by caller and callee */
+     unsigned int             offset;        /* offset of the data from the pool's base */
+     unsigned int             length;        /* length of the data */
+} FusionSHMPoolRef;
+
+/*
+ * Result of a call executed with FCEF_ASYNC
+ *
+ * If the callee's return failed, status is the negative error code and no data follows.
+ */
+typedef struct {
+     unsigned int             serial;        /* serial returned by FUSION_CALL_EXECUTE3 */
+     unsigned int             ret_length;    /* length of return data */
+     int                      status;        /* zero or error code of FUSION_CALL_RETURN3 */
+
+     /* return data follows */
+} FusionCallResult;
+
 /*
  * Watching a reference
  *
@@ -289,6 +387,56 @@ typedef struct {
      int                      catcher;       /* fusion id of the catcher */
 } FusionRefThrow;
 
+/*
+ * Counters of a reference for reading without a system call
+ *
+ * The counters live in a table of one page mapped at FUSION_MMAP_REF_COUNTERS (read only),
+ * the entry of a reference is returned by FUSION_REF_GET_COUNTER. Both values are updated
+ * after each change. Local references still in a delta log are counted after the next FT_REF
+ * system call of any fusionee, the counters may lag behind until then. Inherited
+ * local references are only updated when the count of the ref inherited from reaches or
+ * leaves zero.
+ *
+ * The sequence is odd while an update is in progress. To read both values as a pair, read
+ * the sequence, wait while it is odd, read the values and retry if the sequence changed,
+ * with a read barrier after the first and before the second read of the sequence.
+ */
+typedef struct {
+     volatile unsigned int    sequence;      /* incremented before and after each update */
+     volatile int             global;        /* global count */
+     volatile int             local;         /* local count including inherited ones */
+} FusionRefCounter;
+
+typedef struct {
+     int                      id;            /* reference id */
+
+     int                      index;         /* Returns the index of the counter within the table. */
+} FusionRefGetCounter;
+
+/*
+ * Log of local reference changes applied by fusion at the next FT_REF system call
+ * of any fusionee, e.g. FUSION_REF_STAT sees the changes logged by all of them.
+ *
+ * Mapping the device at FUSION_MMAP_REF_DELTAS with one page enables the log for the
+ * calling fusionee. An entry may only change a count while the fusionee holds a local
+ * reference before and after it, so that nobody sees the reference reaching zero early.
+ * Changes from or to zero and entries of locked or destroyed references are dropped.
+ * If the log is full, FUSION_REF_APPLY_DELTAS has to be called.
+ */
+typedef struct {
+     int                      id;            /* reference id */
+     int                      count;         /* local references to add, negative to release */
+} FusionRefDelta;
+
+typedef struct {
+     unsigned int             size;          /* number of entries */
+     volatile unsigned int    head;          /* free running write position, updated by the fusionee */
+     volatile unsigned int    tail;          /* free running read position, updated by fusion */
+     unsigned int             dropped;       /* entries dropped so far */
+
+     FusionRefDelta           deltas[0];
+} FusionRefDeltaLog;
+
 /*
  * Killing other fusionees (experimental)
  */
@@ -310,6 +458,30 @@ typedef struct {
      unsigned int             notify_count;  /* MUST NOT be reset when the system call is resumed after a signal. */
 } FusionSkirmishWait;
 
+/*
+ * Lock word of a skirmish for locking without a system call in the uncontended case
+ *
+ * The words live in a table of one page mapped at FUSION_MMAP_SKIRMISH_WORDS (read/write).
+ * In a secure world only the master may map them or get the word of a skirmish.
+ *
+ * Each fusionee has to get the index of a word itself (or inherit it via FUSION_FORK)
+ * before using it, owners of a word are only looked for among those fusionees.
+ *
+ * A word is zero while the skirmish is free. A thread takes it by a compare and swap from
+ * zero to its thread id and releases it by a compare and swap back to zero. It has to count
+ * recursive locking itself. If a swap fails, the normal ioctls have to be used, e.g. the word
+ * has FUSION_SKIRMISH_WORD_KERNEL set while the lock is contended, transferred or held via
+ * FUSION_SKIRMISH_PREVAIL, in which case the owner bits are meaningless.
+ */
+#define FUSION_SKIRMISH_WORD_OWNER      0x3fffffff
+#define FUSION_SKIRMISH_WORD_KERNEL     0x80000000
+
+typedef struct {
+     int                      id;            /* skirmish id */
+
+     int                      index;         /* Returns the index of the lock word within the table. */
+} FusionSkirmishWord;
+
 /*
  * Shared memory pools
  */
@@ -401,6 +573,42 @@ typedef struct {
      pid_t     pid;
 } FusionGetFusioneeInfo;
 
+/*
+ * Run a number of ioctls with a single system call, in order.
+ *
+ * Each entry gets its own result, the batch itself only fails if it can't be accessed.
+ * It always stops after an entry returned -EINTR. If it fails with EFAULT partway,
+ * num_done still tells how many entries have been run. Other fusionees may run
+ * between entries, a batch is not atomic.
+ */
+#define FUSION_BATCH_STOP_ON_ERROR      0x00000001    /* Stop after the first entry that failed. */
+
+#define FUSION_BATCH_MAX                1024          /* Maximum number of entries. */
+
+typedef struct {
+     unsigned int             cmd;           /* The ioctl request, e.g. FUSION_REF_UP. */
+     void                    *arg;           /* Its argument. */
+
+     int                      result;        /* Returns the result of the request. */
+} FusionBatchEntry;
+
+typedef struct {
+     FusionBatchEntry        *entries;
+     unsigned int             num_entries;
+     unsigned int             flags;
+
+     unsigned int             num_done;      /* Returns the number of entries that have been run. */
+} FusionBatch;
+
+
+/*
+ * Special offsets for mmap() on the device, in pages
+ */
+#define FUSION_MMAP_RECEIVE_RING        0x7f00
+#define FUSION_MMAP_SKIRMISH_WORDS      0x7f01
+#define FUSION_MMAP_REF_COUNTERS        0x7f02
+#define FUSION_MMAP_REF_DELTAS          0x7f03
+
 
 #define FUSION_ENTER                         _IOR(FT_LOUNGE,    0x00, FusionEnter)
 #define FUSION_UNBLOCK                       _IO (FT_LOUNGE,    0x01)
@@ -419,6 +627,19 @@ typedef struct {
 
 #define FUSION_GET_FUSIONEE_INFO             _IOR(FT_LOUNGE,    0x09, FusionGetFusioneeInfo)
 
+#define FUSION_BATCH                         _IOW(FT_LOUNGE,    0x0A, FusionBatch)
+
+/*
+ * Registers the calling thread as one of several threads reading messages, or removes it.
+ *
+ * Registered threads get messages of different calls, reactors etc. in parallel, each
+ * keeping the order of its own. What a thread has read counts as processed when it
+ * reads again or leaves. Threads that have not registered share a single slot, like
+ * one reader. The receive ring is not used with more than one.
+ */
+#define FUSION_DISPATCHER_ENTER              _IO (FT_LOUNGE,    0x0B)
+#define FUSION_DISPATCHER_LEAVE              _IO (FT_LOUNGE,    0x0C)
+
 
 #define FUSION_SEND_MESSAGE                  _IOW(FT_MESSAGING, 0x00, FusionSendMessage)
 
@@ -431,6 +652,7 @@ typedef struct {
 #define FUSION_CALL_RETURN3                  _IOW(FT_CALL,      0x06, FusionCallReturn3)
 #define FUSION_CALL_GET_OWNER                _IOW(FT_CALL,      0x07, FusionCallGetOwner)
 #define FUSION_CALL_SET_QUOTA                _IOW(FT_CALL,      0x08, FusionCallSetQuota)
+#define FUSION_CALL_RETURN_AND_RECEIVE       _IOWR(FT_CALL,     0x09, FusionCallReturnReceive)
 
 #define FUSION_REF_NEW                       _IOW(FT_REF,       0x00, int)
 #define FUSION_REF_UP                        _IOW(FT_REF,       0x01, int)
@@ -447,6 +669,9 @@ typedef struct {
 #define FUSION_REF_CATCH                     _IOW(FT_REF,       0x0C, int)
 #define FUSION_REF_THROW                     _IOW(FT_REF,       0x0D, FusionRefThrow)
 #define FUSION_REF_SET_SYNC                  _IOW(FT_REF,       0x0E, int)
+#define FUSION_REF_GET_COUNTER               _IOW(FT_REF,       0x0F, FusionRefGetCounter)
+#define FUSION_REF_APPLY_DELTAS              _IO (FT_REF,       0x10)
+#define FUSION_REF_SET_BATCH                 _IOW(FT_REF,       0x11, int)
 
 #define FUSION_SKIRMISH_NEW                  _IOW(FT_SKIRMISH,  0x00, int)
 #define FUSION_SKIRMISH_PREVAIL              _IOW(FT_SKIRMISH,  0x01, int)
@@ -456,6 +681,7 @@ typedef struct {
 #define FUSION_SKIRMISH_LOCK_COUNT           _IOW(FT_SKIRMISH,  0x05, int)
 #define FUSION_SKIRMISH_WAIT                 _IOW(FT_SKIRMISH,  0x06, FusionSkirmishWait)
 #define FUSION_SKIRMISH_NOTIFY               _IOW(FT_SKIRMISH,  0x07, int)
+#define FUSION_SKIRMISH_GET_WORD             _IOW(FT_SKIRMISH,  0x08, FusionSkirmishWord)
 
 #define FUSION_PROPERTY_NEW                  _IOW(FT_PROPERTY,  0x00, int)
 #define FUSION_PROPERTY_LEASE                _IOW(FT_PROPERTY,  0x01, int)
@@ -0,0 +1,214 @@
+/*
+ *      Fusion Kernel Module
+ *
+ *      (c) Copyright 2002-2011  The world wide DirectFB Open Source Community (directfb.org)
+ *
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      as published by the Free Software Foundation; either version
+ *      2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/fusion.h>
+
+#define NUM_REFS    32
+#define NUM_ROUNDS  100000
+
+static long
+elapsed_ms (struct timeval *t1, struct timeval *t2)
+{
+  long d = (t2->tv_sec - t1->tv_sec) * 1000 + (t2->tv_usec - t1->tv_usec) / 1000;
+
+  return d ? d : 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int              fd;
+  int              i, n;
+  int              ok = 1;
+  long             page_size = sysconf (_SC_PAGESIZE);
+  FusionBatchEntry *tail;
+  int              refs[NUM_REFS];
+  FusionBatchEntry entries[NUM_REFS * 2 + 1];
+  FusionBatch      batch;
+  long             d1, d2;
+  struct timeval   t1, t2;
+
+  FusionEnter enter = {{ FUSION_API_MAJOR, FUSION_API_MINOR }};
+
+  /* Open the Fusion Kernel Device. */
+  fd = open ("/dev/fusion0", O_RDWR);
+  if (fd < 0)
+    fd = open ("/dev/fusion/0", O_RDWR);
+  if (fd < 0)
+    {
+      perror ("opening /dev/fusion failed");
+      return -1;
+    }
+
+  /* Query our fusion id. */
+  if (ioctl (fd, FUSION_ENTER, &enter))
+    {
+      perror ("FUSION_ENTER failed");
+      close (fd);
+      return -2;
+    }
+
+  for (i = 0; i < NUM_REFS; i++)
+    {
+      if (ioctl (fd, FUSION_REF_NEW, &refs[i]))
+        {
+          perror ("FUSION_REF_NEW failed");
+          close (fd);
+          return -3;
+        }
+    }
+
+  /* Take and release each reference with one system call per ioctl... */
+  gettimeofday (&t1, NULL);
+
+  for (n = 0; n < NUM_ROUNDS; n++)
+    {
+      for (i = 0; i < NUM_REFS; i++)
+        if (ioctl (fd, FUSION_REF_UP, &refs[i]))
+          perror ("FUSION_REF_UP failed");
+
+      for (i = 0; i < NUM_REFS; i++)
+        if (ioctl (fd, FUSION_REF_DOWN, &refs[i]))
+          perror ("FUSION_REF_DOWN failed");
+    }
+
+  gettimeofday (&t2, NULL);
+
+  d1 = elapsed_ms (&t1, &t2);
+
+  /* ...and with one system call for all of them, checking the count at the end. */
+  for (i = 0; i < NUM_REFS; i++)
+    {
+      entries[i].cmd            = FUSION_REF_UP;
+      entries[i].arg            = &refs[i];
+
+      entries[NUM_REFS + i].cmd = FUSION_REF_DOWN;
+      entries[NUM_REFS + i].arg = &refs[i];
+    }
+
+  /* The result of FUSION_REF_STAT is the count. */
+  entries[NUM_REFS * 2].cmd = FUSION_REF_STAT;
+  entries[NUM_REFS * 2].arg = &refs[0];
+
+  batch.entries     = entries;
+  batch.num_entries = NUM_REFS * 2 + 1;
+  batch.flags       = FUSION_BATCH_STOP_ON_ERROR;
+
+  gettimeofday (&t1, NULL);
+
+  for (n = 0; n < NUM_ROUNDS; n++)
+    {
+      if (ioctl (fd, FUSION_BATCH, &batch))
+        {
+          perror ("FUSION_BATCH failed");
+          ok = 0;
+          break;
+        }
+
+      /* Each entry has its own result. */
+      if (batch.num_done != batch.num_entries)
+        {
+          fprintf (stderr, "Batch stopped at entry %u with %d!\n",
+                   batch.num_done - 1, entries[batch.num_done - 1].result);
+          ok = 0;
+          break;
+        }
+
+      if (entries[NUM_REFS * 2].result != 0)
+        {
+          fprintf (stderr, "Reference count is %d instead of 0!\n", entries[NUM_REFS * 2].result);
+          ok = 0;
+          break;
+        }
+    }
+
+  gettimeofday (&t2, NULL);
+
+  d2 = elapsed_ms (&t1, &t2);
+
+  printf ("Took/released %lu references per second with single ioctls, %lu with FUSION_BATCH.\n",
+          NUM_REFS * 1000UL * NUM_ROUNDS / d1, NUM_REFS * 1000UL * NUM_ROUNDS / d2);
+
+  /* Too many entries. */
+  batch.num_entries = FUSION_BATCH_MAX + 1;
+
+  if (!ioctl (fd, FUSION_BATCH, &batch) || errno != EINVAL)
+    {
+      fprintf (stderr, "FUSION_BATCH with %u entries did not fail with EINVAL!\n", batch.num_entries);
+      ok = 0;
+    }
+
+  /* Entries running into an unmapped page, the ones before it still count. */
+  tail = mmap (NULL, page_size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (tail == MAP_FAILED)
+    {
+      perror ("mmap failed");
+      ok = 0;
+    }
+  else
+    {
+      munmap ((char*) tail + page_size, page_size);
+
+      batch.entries     = (FusionBatchEntry*) ((char*) tail + page_size) - NUM_REFS;
+      batch.num_entries = NUM_REFS * 2;
+      batch.num_done    = 0;
+
+      memcpy (batch.entries, entries, sizeof(FusionBatchEntry) * NUM_REFS);
+
+      if (!ioctl (fd, FUSION_BATCH, &batch) || errno != EFAULT)
+        {
+          fprintf (stderr, "FUSION_BATCH with unmapped entries did not fail with EFAULT!\n");
+          ok = 0;
+        }
+      else if (batch.num_done != NUM_REFS)
+        {
+          fprintf (stderr, "FUSION_BATCH ran %u entries instead of %d before the fault!\n",
+                   batch.num_done, NUM_REFS);
+          ok = 0;
+        }
+
+      /* Release what has been taken. */
+      for (i = 0; i < batch.num_done; i++)
+        {
+          if (batch.entries[i].result)
+            {
+              fprintf (stderr, "Entry %d failed with %d!\n", i, batch.entries[i].result);
+              ok = 0;
+            }
+
+          ioctl (fd, FUSION_REF_DOWN, &refs[i]);
+        }
+
+      munmap (tail, page_size);
+    }
+
+  for (i = 0; i < NUM_REFS; i++)
+    ioctl (fd, FUSION_REF_DESTROY, &refs[i]);
+
+  /* Close the Fusion Kernel Device. */
+  close (fd);
+
+  return ok ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,243 @@
+/*
+ *      Fusion Kernel Module
+ *
+ *      (c) Copyright 2002-2011  The world wide DirectFB Open Source Community (directfb.org)
+ *
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      as published by the Free Software Foundation; either version
+ *      2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include <linux/fusion.h>
+
+#define NUM_REFS  2500
+
+static int refs[NUM_REFS];
+static int notified[NUM_REFS];   /* Number of notifications for each ref. */
+
+/*
+ * Enters the world as another fusionee, takes a local reference to each ref
+ * and exits when told so, which makes all of them reach zero at once.
+ */
+static void
+run_child (int ready_fd, int exit_fd)
+{
+  int  fd;
+  int  i;
+  char c = 0;
+
+  FusionEnter enter = {{ FUSION_API_MAJOR, FUSION_API_MINOR }};
+
+  fd = open ("/dev/fusion0", O_RDWR);
+  if (fd < 0)
+    fd = open ("/dev/fusion/0", O_RDWR);
+  if (fd < 0)
+    {
+      perror ("opening /dev/fusion failed");
+      exit (-1);
+    }
+
+  if (ioctl (fd, FUSION_ENTER, &enter))
+    {
+      perror ("FUSION_ENTER failed");
+      exit (-2);
+    }
+
+  for (i = 0; i < NUM_REFS; i++)
+    if (ioctl (fd, FUSION_REF_UP, &refs[i]))
+      perror ("FUSION_REF_UP failed");
+
+  if (write (ready_fd, &c, 1) != 1 || read (exit_fd, &c, 1) != 1)
+    perror ("child pipe failure");
+
+  /* Exiting clears the local references. */
+  exit (0);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int            fd;
+  int            i;
+  int            len;
+  int            received = 0;
+  int            messages = 0;
+  int            ok = 1;
+  int            ready_pipe[2];
+  int            exit_pipe[2];
+  char           c = 0;
+  char           buf[16384];
+  pid_t          child;
+  FusionCallNew  call_new;
+  FusionRefWatch watch;
+
+  FusionEnter enter = {{ FUSION_API_MAJOR, FUSION_API_MINOR }};
+
+  /* Open the Fusion Kernel Device. */
+  fd = open ("/dev/fusion0", O_RDWR);
+  if (fd < 0)
+    fd = open ("/dev/fusion/0", O_RDWR);
+  if (fd < 0)
+    {
+      perror ("opening /dev/fusion failed");
+      return -1;
+    }
+
+  /* Query our fusion id. */
+  if (ioctl (fd, FUSION_ENTER, &enter))
+    {
+      perror ("FUSION_ENTER failed");
+      close (fd);
+      return -2;
+    }
+
+  call_new.handler = NULL;
+  call_new.ctx     = NULL;
+
+  if (ioctl (fd, FUSION_CALL_NEW, &call_new))
+    {
+      perror ("FUSION_CALL_NEW failed");
+      close (fd);
+      return -3;
+    }
+
+  for (i = 0; i < NUM_REFS; i++)
+    {
+      if (ioctl (fd, FUSION_REF_NEW, &refs[i]))
+        {
+          perror ("FUSION_REF_NEW failed");
+          close (fd);
+          return -4;
+        }
+    }
+
+  if (pipe (ready_pipe) || pipe (exit_pipe))
+    {
+      perror ("pipe failed");
+      close (fd);
+      return -5;
+    }
+
+  /* Fail if the child or the notifications don't show up in time. */
+  alarm (60);
+
+  child = fork();
+  if (!child)
+    {
+      close (fd);
+      run_child (ready_pipe[1], exit_pipe[0]);
+    }
+
+  /* A reference can only be watched while it is in use. */
+  if (read (ready_pipe[0], &c, 1) != 1)
+    {
+      perror ("child failure");
+      close (fd);
+      return -6;
+    }
+
+  /* Watch each reference with its index as call argument, allowing batched notification. */
+  for (i = 0; i < NUM_REFS; i++)
+    {
+      watch.id       = refs[i];
+      watch.call_id  = call_new.call_id;
+      watch.call_arg = i;
+
+      if (ioctl (fd, FUSION_REF_WATCH, &watch) || ioctl (fd, FUSION_REF_SET_BATCH, &refs[i]))
+        {
+          perror ("FUSION_REF_WATCH/SET_BATCH failed");
+          ok = 0;
+        }
+    }
+
+  /* Let the child exit. */
+  if (write (exit_pipe[1], &c, 1) != 1)
+    perror ("child pipe failure");
+
+  waitpid (child, NULL, 0);
+
+  /* Receive the notifications. */
+  while (received < NUM_REFS && ((len = read (fd, buf, sizeof(buf))) > 0 || errno == EINTR))
+    {
+      char *buf_p = buf;
+
+      if (len <= 0)
+        continue;
+
+      while (buf_p < buf + len)
+        {
+          FusionReadMessage *header = (FusionReadMessage*) buf_p;
+          void              *data   = buf_p + sizeof(FusionReadMessage);
+
+          if (header->msg_type == FMT_CALL)
+            {
+              FusionCallBatchMessage *batch = data;
+
+              /* A batch is larger than a single call message. */
+              if (header->msg_size > sizeof(FusionCallMessage))
+                {
+                  for (i = 0; i < batch->message.call_arg; i++)
+                    if (batch->call_args[i] >= 0 && batch->call_args[i] < NUM_REFS)
+                      notified[batch->call_args[i]]++;
+
+                  received += batch->message.call_arg;
+                }
+              else
+                {
+                  if (batch->message.call_arg >= 0 && batch->message.call_arg < NUM_REFS)
+                    notified[batch->message.call_arg]++;
+
+                  received++;
+                }
+
+              messages++;
+            }
+
+          buf_p = data + header->msg_size;
+        }
+    }
+
+  alarm (0);
+
+  printf ("Received %d zero notifications in %d messages (up to %d per message).\n",
+          received, messages, FUSION_CALL_BATCH_MAX);
+
+  /* Each reference exactly once, in as few messages as possible. */
+  for (i = 0; i < NUM_REFS; i++)
+    {
+      if (notified[i] != 1)
+        {
+          fprintf (stderr, "Reference %d has been notified %d times!\n", i, notified[i]);
+          ok = 0;
+        }
+    }
+
+  if (messages != (NUM_REFS + FUSION_CALL_BATCH_MAX - 1) / FUSION_CALL_BATCH_MAX)
+    {
+      fprintf (stderr, "Received %d messages instead of %d!\n",
+               messages, (NUM_REFS + FUSION_CALL_BATCH_MAX - 1) / FUSION_CALL_BATCH_MAX);
+      ok = 0;
+    }
+
+  for (i = 0; i < NUM_REFS; i++)
+    ioctl (fd, FUSION_REF_DESTROY, &refs[i]);
+
+  ioctl (fd, FUSION_CALL_DESTROY, &call_new.call_id);
+
+  /* Close the Fusion Kernel Device. */
+  close (fd);
+
+  return ok ? 0 : EXIT_FAILURE;
+}
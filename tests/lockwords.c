@@ -0,0 +1,194 @@
+/*
+ *      Fusion Kernel Module
+ *
+ *      (c) Copyright 2002-2011  The world wide DirectFB Open Source Community (directfb.org)
+ *
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      as published by the Free Software Foundation; either version
+ *      2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/fusion.h>
+
+#include <pthread.h>
+
+#define NUM_THREADS  4
+#define NUM_LOCKS    1000000
+
+static int                fd;          /* File descriptor of the Fusion Kernel Device */
+static int                skirmish_id;
+static volatile uint32_t *word;        /* Lock word of the skirmish. */
+
+static long               counter;     /* Protected by the skirmish. */
+static long               fast_locks;  /* Taken without a system call, protected as well. */
+
+/*
+ * Takes the word from zero to the thread id, falls back to the kernel if that fails.
+ */
+static void
+lock (uint32_t tid)
+{
+  if (__sync_bool_compare_and_swap (word, 0, tid))
+    {
+      fast_locks++;
+      return;
+    }
+
+  while (ioctl (fd, FUSION_SKIRMISH_PREVAIL, &skirmish_id))
+    {
+      if (errno != EINTR)
+        {
+          perror ("FUSION_SKIRMISH_PREVAIL failed");
+          exit (-1);
+        }
+    }
+}
+
+/*
+ * Takes the word back to zero, falls back to the kernel if it has been adopted meanwhile.
+ */
+static void
+unlock (uint32_t tid)
+{
+  if (__sync_bool_compare_and_swap (word, tid, 0))
+    return;
+
+  if (ioctl (fd, FUSION_SKIRMISH_DISMISS, &skirmish_id))
+    {
+      perror ("FUSION_SKIRMISH_DISMISS failed");
+      exit (-1);
+    }
+}
+
+static void *
+locking_thread (void *arg)
+{
+  int      n;
+  uint32_t tid = syscall (SYS_gettid) & FUSION_SKIRMISH_WORD_OWNER;
+
+  for (n = 0; n < NUM_LOCKS; n++)
+    {
+      lock (tid);
+
+      counter++;
+
+      unlock (tid);
+    }
+
+  return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int                i;
+  int                ok = 1;
+  long               d;
+  long               page_size = sysconf (_SC_PAGESIZE);
+  uint32_t          *table;
+  pthread_t          threads[NUM_THREADS];
+  FusionSkirmishWord skirmish_word;
+  struct timeval     t1, t2;
+
+  FusionEnter enter = {{ FUSION_API_MAJOR, FUSION_API_MINOR }};
+
+  /* Open the Fusion Kernel Device. */
+  fd = open ("/dev/fusion0", O_RDWR);
+  if (fd < 0)
+    fd = open ("/dev/fusion/0", O_RDWR);
+  if (fd < 0)
+    {
+      perror ("opening /dev/fusion failed");
+      return -1;
+    }
+
+  /* Query our fusion id. */
+  if (ioctl (fd, FUSION_ENTER, &enter))
+    {
+      perror ("FUSION_ENTER failed");
+      close (fd);
+      return -2;
+    }
+
+  if (ioctl (fd, FUSION_SKIRMISH_NEW, &skirmish_id))
+    {
+      perror ("FUSION_SKIRMISH_NEW failed");
+      close (fd);
+      return -3;
+    }
+
+  /* Get the index of the lock word, this also allows our threads to own it. */
+  skirmish_word.id = skirmish_id;
+
+  if (ioctl (fd, FUSION_SKIRMISH_GET_WORD, &skirmish_word))
+    {
+      perror ("FUSION_SKIRMISH_GET_WORD failed");
+      close (fd);
+      return -4;
+    }
+
+  /* The table of lock words is one page. */
+  table = mmap (NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, FUSION_MMAP_SKIRMISH_WORDS * page_size);
+  if (table == MAP_FAILED)
+    {
+      perror ("mapping the lock words failed");
+      close (fd);
+      return -5;
+    }
+
+  word = &table[skirmish_word.index];
+
+  gettimeofday (&t1, NULL);
+
+  for (i = 0; i < NUM_THREADS; i++)
+    pthread_create (&threads[i], NULL, locking_thread, NULL);
+
+  for (i = 0; i < NUM_THREADS; i++)
+    pthread_join (threads[i], NULL);
+
+  gettimeofday (&t2, NULL);
+
+  d = (t2.tv_sec - t1.tv_sec) * 1000 + (t2.tv_usec - t1.tv_usec) / 1000;
+
+  /* The skirmish has to be free again, with each increment done under it. */
+  if (counter != NUM_THREADS * (long) NUM_LOCKS)
+    {
+      fprintf (stderr, "Counter is %ld instead of %ld!\n", counter, NUM_THREADS * (long) NUM_LOCKS);
+      ok = 0;
+    }
+
+  if (*word)
+    {
+      fprintf (stderr, "Lock word is 0x%08x instead of 0!\n", *word);
+      ok = 0;
+    }
+
+  printf ("Locked/unlocked %lu times per second (%ld%% without system call).\n",
+          NUM_THREADS * 1000UL * NUM_LOCKS / (d ? d : 1), fast_locks * 100 / (counter ? counter : 1));
+
+  munmap (table, page_size);
+
+  ioctl (fd, FUSION_SKIRMISH_DESTROY, &skirmish_id);
+
+  /* Close the Fusion Kernel Device. */
+  close (fd);
+
+  return ok ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,213 @@
+/*
+ *      Fusion Kernel Module
+ *
+ *      (c) Copyright 2002-2011  The world wide DirectFB Open Source Community (directfb.org)
+ *
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      as published by the Free Software Foundation; either version
+ *      2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/fusion.h>
+
+#define NUM_DELTAS  100
+
+static int                fd;       /* File descriptor of the Fusion Kernel Device */
+
+static FusionRefCounter  *counters; /* Table of counters, read only. */
+static FusionRefDeltaLog *deltas;   /* Log of local reference changes. */
+
+/*
+ * Reads both counts of a reference as a pair.
+ */
+static void
+read_counter (int index, int *ret_global, int *ret_local)
+{
+  FusionRefCounter *counter = &counters[index];
+  unsigned int      sequence;
+
+  do {
+       /* Odd while an update is in progress. */
+       while ((sequence = counter->sequence) & 1)
+         ;
+
+       __sync_synchronize();
+
+       *ret_global = counter->global;
+       *ret_local  = counter->local;
+
+       __sync_synchronize();
+  } while (counter->sequence != sequence);
+}
+
+/*
+ * Checks both counts of a reference, returns zero if they are not the expected ones.
+ */
+static int
+expect_counter (int index, int global, int local, const char *when)
+{
+  int counter_global, counter_local;
+
+  read_counter (index, &counter_global, &counter_local);
+
+  if (counter_global != global || counter_local != local)
+    {
+      fprintf (stderr, "%s: global %d, local %d instead of %d, %d!\n",
+               when, counter_global, counter_local, global, local);
+      return 0;
+    }
+
+  return 1;
+}
+
+/*
+ * Adds an entry to the log, applying the log first if it is full.
+ */
+static void
+add_delta (int id, int count)
+{
+  if (deltas->head - deltas->tail == deltas->size && ioctl (fd, FUSION_REF_APPLY_DELTAS))
+    perror ("FUSION_REF_APPLY_DELTAS failed");
+
+  deltas->deltas[deltas->head % deltas->size].id    = id;
+  deltas->deltas[deltas->head % deltas->size].count = count;
+
+  /* Publish the entry before the head. */
+  __sync_synchronize();
+
+  deltas->head++;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int                 i;
+  int                 id;
+  int                 refs;
+  int                 ok = 1;
+  long                page_size = sysconf (_SC_PAGESIZE);
+  FusionRefGetCounter get_counter;
+
+  FusionEnter enter = {{ FUSION_API_MAJOR, FUSION_API_MINOR }};
+
+  /* Open the Fusion Kernel Device. */
+  fd = open ("/dev/fusion0", O_RDWR);
+  if (fd < 0)
+    fd = open ("/dev/fusion/0", O_RDWR);
+  if (fd < 0)
+    {
+      perror ("opening /dev/fusion failed");
+      return -1;
+    }
+
+  /* Query our fusion id. */
+  if (ioctl (fd, FUSION_ENTER, &enter))
+    {
+      perror ("FUSION_ENTER failed");
+      close (fd);
+      return -2;
+    }
+
+  /* The table of counters can only be mapped for reading. */
+  counters = mmap (NULL, page_size, PROT_READ, MAP_SHARED,
+                   fd, FUSION_MMAP_REF_COUNTERS * page_size);
+  if (counters == MAP_FAILED)
+    {
+      perror ("mapping the reference counters failed");
+      close (fd);
+      return -3;
+    }
+
+  deltas = mmap (NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, FUSION_MMAP_REF_DELTAS * page_size);
+  if (deltas == MAP_FAILED)
+    {
+      perror ("mapping the reference delta log failed");
+      close (fd);
+      return -4;
+    }
+
+  if (ioctl (fd, FUSION_REF_NEW, &id))
+    {
+      perror ("FUSION_REF_NEW failed");
+      close (fd);
+      return -5;
+    }
+
+  get_counter.id = id;
+
+  if (ioctl (fd, FUSION_REF_GET_COUNTER, &get_counter))
+    {
+      perror ("FUSION_REF_GET_COUNTER failed");
+      close (fd);
+      return -6;
+    }
+
+  /* Entries of the log may only change a count that stays above zero. */
+  if (ioctl (fd, FUSION_REF_UP, &id) || ioctl (fd, FUSION_REF_UP_GLOBAL, &id))
+    {
+      perror ("FUSION_REF_UP(_GLOBAL) failed");
+      close (fd);
+      return -7;
+    }
+
+  ok &= expect_counter (get_counter.index, 1, 1, "After FUSION_REF_UP(_GLOBAL)");
+
+  /* Logged changes are not visible until the log is applied... */
+  for (i = 0; i < NUM_DELTAS; i++)
+    add_delta (id, 1);
+
+  ok &= expect_counter (get_counter.index, 1, 1, "After logging");
+
+  /* ...which the next reference ioctl does first. */
+  refs = ioctl (fd, FUSION_REF_STAT, &id);
+  if (refs != NUM_DELTAS + 2)
+    {
+      fprintf (stderr, "FUSION_REF_STAT returned %d instead of %d!\n", refs, NUM_DELTAS + 2);
+      ok = 0;
+    }
+
+  ok &= expect_counter (get_counter.index, 1, NUM_DELTAS + 1, "After FUSION_REF_STAT");
+
+  if (deltas->dropped || deltas->tail != deltas->head)
+    {
+      fprintf (stderr, "Log has %u entries left and %u dropped!\n",
+               deltas->head - deltas->tail, deltas->dropped);
+      ok = 0;
+    }
+
+  /* Release them again, applied before FUSION_REF_DOWN. */
+  add_delta (id, -NUM_DELTAS);
+
+  if (ioctl (fd, FUSION_REF_DOWN, &id) || ioctl (fd, FUSION_REF_DOWN_GLOBAL, &id))
+    {
+      perror ("FUSION_REF_DOWN(_GLOBAL) failed");
+      ok = 0;
+    }
+
+  ok &= expect_counter (get_counter.index, 0, 0, "After releasing all");
+
+  ioctl (fd, FUSION_REF_DESTROY, &id);
+
+  munmap (deltas, page_size);
+  munmap (counters, page_size);
+
+  /* Close the Fusion Kernel Device. */
+  close (fd);
+
+  return ok ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,221 @@
+/*
+ *      Fusion Kernel Module
+ *
+ *      (c) Copyright 2002-2011  The world wide DirectFB Open Source Community (directfb.org)
+ *
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      as published by the Free Software Foundation; either version
+ *      2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include <linux/fusion.h>
+
+#include <pthread.h>
+
+#define NUM_CALLS  1000000
+
+static int       fd;       /* File descriptor of the Fusion Kernel Device */
+static pthread_t receiver; /* Thread dispatching the calls. */
+
+static int       call_id;
+static int       result;   /* Returned for the last call received. */
+static int       failures; /* Returns that failed within the dispatcher. */
+
+/*
+ * Dispatcher returning each call together with receiving the next one
+ */
+static void *
+receiver_thread (void *arg)
+{
+  int                     stop = 0;
+  char                    buf[1024];
+  FusionCallReturnReceive ret_recv;
+
+  /* Nothing to return at first. */
+  ret_recv.ret.call_id = 0;
+  ret_recv.buf         = buf;
+  ret_recv.buf_size    = sizeof(buf);
+  ret_recv.flags       = FCRRF_NONE;
+
+  while (!stop)
+    {
+      /* Current position within the buffer. */
+      char *buf_p = buf;
+
+      if (ioctl (fd, FUSION_CALL_RETURN_AND_RECEIVE, &ret_recv))
+        {
+          if (errno == EINTR)
+            continue;
+
+          perror ("FUSION_CALL_RETURN_AND_RECEIVE failed");
+          failures++;
+          break;
+        }
+
+      /* The previous call has been returned even if receiving failed. */
+      if (ret_recv.ret_result && !failures++)
+        fprintf (stderr, "Returning call failed with %d!\n", ret_recv.ret_result);
+
+      ret_recv.ret.call_id = 0;
+
+      while (buf_p < buf + ret_recv.received)
+        {
+          FusionReadMessage  *header = (FusionReadMessage*) buf_p;
+          FusionCallMessage3 *msg    = (FusionCallMessage3*) (buf_p + sizeof(FusionReadMessage));
+
+          /* One-way call with a negative argument to shut down. */
+          if (header->msg_type == FMT_CALL3 && msg->call_arg < 0)
+            stop = 1;
+          else if (header->msg_type == FMT_CALL3 && msg->serial)
+            {
+              /* A call received before has to be returned on its own. */
+              if (ret_recv.ret.call_id && ioctl (fd, FUSION_CALL_RETURN3, &ret_recv.ret))
+                {
+                  perror ("FUSION_CALL_RETURN3 failed");
+                  failures++;
+                }
+
+              result = msg->call_arg + 1;
+
+              ret_recv.ret.call_id = header->msg_id;
+              ret_recv.ret.serial  = msg->serial;
+              ret_recv.ret.ptr     = &result;
+              ret_recv.ret.length  = sizeof(result);
+            }
+
+          buf_p += sizeof(FusionReadMessage) + header->msg_size;
+        }
+    }
+
+  if (ret_recv.ret.call_id && ioctl (fd, FUSION_CALL_RETURN3, &ret_recv.ret))
+    {
+      perror ("FUSION_CALL_RETURN3 failed");
+      failures++;
+    }
+
+  return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int                n;
+  int                ok = 1;
+  int                ret_val;
+  long               d;
+  FusionCallNew      call_new;
+  FusionCallExecute3 execute;
+  struct timeval     t1, t2;
+
+  FusionEnter enter = {{ FUSION_API_MAJOR, FUSION_API_MINOR }};
+
+  /* Open the Fusion Kernel Device. */
+  fd = open ("/dev/fusion0", O_RDWR);
+  if (fd < 0)
+    fd = open ("/dev/fusion/0", O_RDWR);
+  if (fd < 0)
+    {
+      perror ("opening /dev/fusion failed");
+      return -1;
+    }
+
+  /* Query our fusion id. */
+  if (ioctl (fd, FUSION_ENTER, &enter))
+    {
+      perror ("FUSION_ENTER failed");
+      close (fd);
+      return -2;
+    }
+
+  call_new.handler = NULL;
+  call_new.ctx     = NULL;
+
+  if (ioctl (fd, FUSION_CALL_NEW, &call_new))
+    {
+      perror ("FUSION_CALL_NEW failed");
+      close (fd);
+      return -3;
+    }
+
+  call_id = call_new.call_id;
+
+  /* Start the dispatcher. */
+  pthread_create (&receiver, NULL, receiver_thread, NULL);
+
+  /* Wait for the dispatcher being up. */
+  usleep (100000);
+
+  gettimeofday (&t1, NULL);
+
+  /* Synchronous calls with an int argument and result. */
+  for (n = 0; n < NUM_CALLS; n++)
+    {
+      execute.call_id    = call_id;
+      execute.call_arg   = n;
+      execute.ptr        = NULL;
+      execute.length     = 0;
+      execute.ret_ptr    = &ret_val;
+      execute.ret_length = sizeof(ret_val);
+      execute.flags      = FCEF_NONE;
+      execute.serial     = 0;
+      execute.timeout_ms = 0;
+
+      if (ioctl (fd, FUSION_CALL_EXECUTE3, &execute))
+        {
+          perror ("FUSION_CALL_EXECUTE3 failed");
+          ok = 0;
+          break;
+        }
+
+      if (ret_val != n + 1)
+        {
+          fprintf (stderr, "Call %d returned %d instead of %d!\n", n, ret_val, n + 1);
+          ok = 0;
+          break;
+        }
+    }
+
+  gettimeofday (&t2, NULL);
+
+  d = (t2.tv_sec - t1.tv_sec) * 1000 + (t2.tv_usec - t1.tv_usec) / 1000;
+
+  printf ("Executed %lu synchronous calls per second.\n", n * 1000UL / (d ? d : 1));
+
+  /* Stop the dispatcher, it blocks within the ioctl. */
+  execute.call_arg = -1;
+  execute.flags    = FCEF_ONEWAY;
+
+  if (ioctl (fd, FUSION_CALL_EXECUTE3, &execute))
+    {
+      perror ("FUSION_CALL_EXECUTE3 failed");
+      ok = 0;
+    }
+  else
+    pthread_join (receiver, NULL);
+
+  if (failures)
+    {
+      fprintf (stderr, "%d returns failed!\n", failures);
+      ok = 0;
+    }
+
+  ioctl (fd, FUSION_CALL_DESTROY, &call_id);
+
+  /* Close the Fusion Kernel Device. */
+  close (fd);
+
+  return ok ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,249 @@
+/*
+ *      Fusion Kernel Module
+ *
+ *      (c) Copyright 2002-2011  The world wide DirectFB Open Source Community (directfb.org)
+ *
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      as published by the Free Software Foundation; either version
+ *      2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sched.h>
+
+#include <linux/fusion.h>
+
+#include <pthread.h>
+
+#define RING_SIZE     0x10000   /* size of the data area, a power of two */
+#define NUM_MESSAGES  1000000
+
+typedef struct {
+  int nr;
+} TestMessage;
+
+static int                fd;       /* File descriptor of the Fusion Kernel Device */
+static pthread_t          receiver; /* Thread reading messages from the device. */
+
+static FusionReceiveRing *ring;     /* Header page of the receive ring. */
+static char              *ring_data;/* Data area following the header page. */
+
+static volatile int       last_nr = -1;
+static int                from_ring = 0;
+static int                misordered = 0;
+
+/*
+ * Messages have to arrive in the order they were sent, whether via the ring or not.
+ */
+static void
+process_message (FusionReadMessage *header, void *data)
+{
+  TestMessage *message = (TestMessage*) data;
+
+  if (header->msg_type != FMT_SEND)
+    return;
+
+  if (message->nr != last_nr + 1 && !misordered++)
+    fprintf (stderr, "Received message %d after %d!\n", message->nr, last_nr);
+
+  last_nr = message->nr;
+}
+
+/*
+ * Consumes all records written to the ring so far.
+ */
+static void
+consume_ring (void)
+{
+  unsigned int tail = ring->tail;
+  unsigned int head = ring->head;
+
+  /* Read records after the head. */
+  __sync_synchronize();
+
+  while (tail != head)
+    {
+      unsigned int       offset = tail & (ring->size - 1);
+      FusionReadMessage *header = (FusionReadMessage*) (ring_data + offset);
+
+      /* No room for a header before the end, or a wrap record. */
+      if (ring->size - offset < sizeof(FusionReadMessage) || header->msg_size == FUSION_RING_WRAP)
+        {
+          tail += ring->size - offset;
+          continue;
+        }
+
+      process_message (header, header + 1);
+
+      from_ring++;
+
+      tail += (sizeof(FusionReadMessage) + header->msg_size + 3) & ~3;
+    }
+
+  /* Records have been read before the space is given back. */
+  __sync_synchronize();
+
+  ring->tail = tail;
+}
+
+static void *
+receiver_thread (void *arg)
+{
+  int  len;
+  char buf[1024];
+
+  /* A blocking read returns zero while there are records in the ring. */
+  while ((len = read (fd, buf, 1024)) >= 0 || errno == EINTR)
+    {
+      /* Current position within the buffer. */
+      char *buf_p = buf;
+
+      /* Shutdown? */
+      pthread_testcancel();
+
+      if (len == 0)
+        consume_ring();
+
+      /* Possibly interrupted during blocking read. */
+      if (len <= 0)
+        continue;
+
+      /* Messages that had to be queued are read as usual. */
+      while (buf_p < buf + len)
+        {
+          FusionReadMessage *header = (FusionReadMessage*) buf_p;
+          void              *data   = buf_p + sizeof(FusionReadMessage);
+
+          process_message (header, data);
+
+          buf_p = data + header->msg_size;
+        }
+    }
+
+  perror ("receiver thread failure");
+
+  return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int   n;
+  int   ok = 1;
+  long  d;
+  long  page_size = sysconf (_SC_PAGESIZE);
+  void *map;
+  struct timeval t1, t2;
+
+  FusionEnter enter = {{ FUSION_API_MAJOR, FUSION_API_MINOR }};
+
+  /* Open the Fusion Kernel Device. */
+  fd = open ("/dev/fusion0", O_RDWR);
+  if (fd < 0)
+    fd = open ("/dev/fusion/0", O_RDWR);
+  if (fd < 0)
+    {
+      perror ("opening /dev/fusion failed");
+      return -1;
+    }
+
+  /* Query our fusion id. */
+  if (ioctl (fd, FUSION_ENTER, &enter))
+    {
+      perror ("FUSION_ENTER failed");
+      close (fd);
+      return -2;
+    }
+
+  /* Enable the ring, one header page followed by the data area. */
+  map = mmap (NULL, page_size + RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+              fd, FUSION_MMAP_RECEIVE_RING * page_size);
+  if (map == MAP_FAILED)
+    {
+      perror ("mapping the receive ring failed");
+      close (fd);
+      return -3;
+    }
+
+  ring      = map;
+  ring_data = map + page_size;
+
+  /* Start the receiver thread. */
+  pthread_create (&receiver, NULL, receiver_thread, NULL);
+
+  /* Wait for the receiver being up. */
+  usleep (100000);
+
+  /* Stop time before sending the messages. */
+  gettimeofday (&t1, NULL);
+
+  /* Send some messages to ourself. */
+  for (n = 0; n < NUM_MESSAGES; n++)
+    {
+      FusionSendMessage send;
+      TestMessage       message;
+
+      send.fusion_id   = enter.fusion_id;
+      send.msg_id      = 0;
+      send.msg_channel = 0;
+      send.msg_size    = sizeof(TestMessage);
+      send.msg_data    = &message;
+
+      message.nr = n;
+
+      if (ioctl (fd, FUSION_SEND_MESSAGE, &send))
+        {
+          perror ("FUSION_SEND_MESSAGE failed");
+          ok = 0;
+          break;
+        }
+    }
+
+  /* Wait for all messages to arrive, but not forever. */
+  do {
+       gettimeofday (&t2, NULL);
+
+       d = (t2.tv_sec - t1.tv_sec) * 1000 + (t2.tv_usec - t1.tv_usec) / 1000;
+
+       sched_yield();
+  } while (last_nr < n-1 && d < 60000);
+
+  if (last_nr != n-1 || misordered)
+    {
+      fprintf (stderr, "Received up to message %d of %d, %d out of order!\n", last_nr, n, misordered);
+      ok = 0;
+    }
+
+  /* With a single reader, the ring has to be used. */
+  if (!from_ring)
+    {
+      fprintf (stderr, "No message has been written to the ring!\n");
+      ok = 0;
+    }
+
+  printf ("Sent/received %lu messages per second (%d%% via the ring).\n",
+          n * 1000UL / (d ? d : 1), from_ring * 100 / (n ? n : 1));
+
+  /* Stop the receiver. */
+  pthread_cancel (receiver);
+  pthread_join (receiver, NULL);
+
+  munmap (map, page_size + RING_SIZE);
+
+  /* Close the Fusion Kernel Device. */
+  close (fd);
+
+  return ok ? 0 : EXIT_FAILURE;
+}